@@ -0,0 +1,1682 @@
+/*
+ * Writes a synthetic .pst file for benchmarking extract-pst.
+ *
+ * The file has the structures libpst reads: header, node and block B-trees,
+ * property contexts, attachment tables, subnode trees and compressed RTF. It
+ * has no allocation maps, hierarchy tables, contents tables or named-property
+ * map, so Outlook will not open it. It is a benchmark input, nothing more.
+ *
+ * Besides mail, it can write contacts and appointments. Their named
+ * properties (0x8000 and up) go in under the fixed IDs libpst knows them by:
+ * with no named-property map, libpst takes them as they are.
+ *
+ * Output depends only on the options: the same options and --seed give the
+ * same bytes.
+ */
+
+#include <getopt.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rtfcomp.h"
+
+#define HEADER_SIZE_ANSI 512
+#define HEADER_SIZE_UNICODE 564
+#define DATA_START 0x4400
+
+#define MAX_BLOCK_SIZE 8192
+#define PAGE_SIZE 512
+
+#define NID_TYPE_NORMAL_FOLDER 0x02
+#define NID_TYPE_NORMAL_MESSAGE 0x04
+#define NID_TYPE_ATTACHMENT 0x05
+#define NID_TYPE_LTP 0x1f
+
+#define NID_MESSAGE_STORE 0x21
+#define NID_ROOT_FOLDER 0x122
+#define NID_ATTACHMENT_TABLE 0x671
+
+#define PTYPE_BBT 0x80
+#define PTYPE_NBT 0x81
+
+#define PT_LONG 0x0003
+#define PT_BOOLEAN 0x000b
+#define PT_STRING8 0x001e
+#define PT_UNICODE 0x001f
+#define PT_SYSTIME 0x0040
+#define PT_BINARY 0x0102
+
+// Values longer than this go in a subnode rather than in the heap.
+#define HEAP_VALUE_MAX 256
+#define HEAP_MAX_ALLOCS 512
+#define MAX_PROPS 48
+#define MAX_ATTACHMENTS 3
+#define MAX_SIZE_BUCKETS 16
+
+#define FILETIME_2003 126857664000000000ULL
+#define FILETIME_2021 132539328000000000ULL
+
+typedef struct {
+    uint64_t size;
+    unsigned weight;
+} SizeBucket;
+
+typedef struct {
+    unsigned    n_items;
+    unsigned    n_folders;
+    unsigned    depth;
+    uint64_t    body_size;
+    unsigned    html_percent;
+    unsigned    rtf_percent;
+    unsigned    attach_percent;
+    unsigned    contact_percent;
+    unsigned    appointment_percent;
+    SizeBucket  attach_sizes[MAX_SIZE_BUCKETS];
+    unsigned    n_attach_sizes;
+    int         unicode;
+    int         encrypt;
+    uint64_t    seed;
+    const char* output_path;
+} Config;
+
+typedef struct {
+    unsigned char* data;
+    size_t         len;
+    size_t         cap;
+} Buf;
+
+typedef struct {
+    uint32_t nid;
+    uint64_t bid_data;
+    uint64_t bid_sub;
+    uint32_t parent;
+} Node;
+
+typedef struct {
+    uint32_t nid;
+    uint64_t bid_data;
+    uint64_t bid_sub;
+} SubNode;
+
+typedef struct {
+    SubNode   entries[MAX_ATTACHMENTS * 2 + MAX_PROPS];
+    size_t    n;
+    uint32_t* next_index; // shared by a message and its attachments: libpst searches them as one tree
+} SubTree;
+
+typedef struct {
+    uint16_t       id;
+    uint16_t       type;
+    uint32_t       value;
+    unsigned char* data;
+    size_t         len;
+} Prop;
+
+typedef struct {
+    Prop props[MAX_PROPS];
+    int  n;
+} PropList;
+
+typedef struct {
+    Buf      data;
+    uint16_t offsets[HEAP_MAX_ALLOCS + 1];
+    unsigned n;
+} Heap;
+
+typedef struct {
+    uint32_t nid;
+    uint32_t parent_nid;
+    unsigned depth;
+    unsigned n_messages;
+    int      has_children;
+    char     name[64];
+} Folder;
+
+static Config config = {
+    .n_items = 1000,
+    .n_folders = 10,
+    .depth = 2,
+    .body_size = 2048,
+    .html_percent = 50,
+    .rtf_percent = 50,
+    .attach_percent = 20,
+    .unicode = 1,
+    .encrypt = 1,
+    .seed = 1,
+};
+
+static const char* DEFAULT_ATTACH_SIZES = "16k:70,256k:25,4m:5";
+
+// mpbbCrypt[0..255] from MS-PST 5.1: NDB_CRYPT_PERMUTE encoding
+static const unsigned char PERMUTE[256] = {
+    0x41, 0x36, 0x13, 0x62, 0xa8, 0x21, 0x6e, 0xbb, 0xf4, 0x16, 0xcc, 0x04, 0x7f, 0x64, 0xe8, 0x5d,
+    0x1e, 0xf2, 0xcb, 0x2a, 0x74, 0xc5, 0x5e, 0x35, 0xd2, 0x95, 0x47, 0x9e, 0x96, 0x2d, 0x9a, 0x88,
+    0x4c, 0x7d, 0x84, 0x3f, 0xdb, 0xac, 0x31, 0xb6, 0x48, 0x5f, 0xf6, 0xc4, 0xd8, 0x39, 0x8b, 0xe7,
+    0x23, 0x3b, 0x38, 0x8e, 0xc8, 0xc1, 0xdf, 0x25, 0xb1, 0x20, 0xa5, 0x46, 0x60, 0x4e, 0x9c, 0xfb,
+    0xaa, 0xd3, 0x56, 0x51, 0x45, 0x7c, 0x55, 0x00, 0x07, 0xc9, 0x2b, 0x9d, 0x85, 0x9b, 0x09, 0xa0,
+    0x8f, 0xad, 0xb3, 0x0f, 0x63, 0xab, 0x89, 0x4b, 0xd7, 0xa7, 0x15, 0x5a, 0x71, 0x66, 0x42, 0xbf,
+    0x26, 0x4a, 0x6b, 0x98, 0xfa, 0xea, 0x77, 0x53, 0xb2, 0x70, 0x05, 0x2c, 0xfd, 0x59, 0x3a, 0x86,
+    0x7e, 0xce, 0x06, 0xeb, 0x82, 0x78, 0x57, 0xc7, 0x8d, 0x43, 0xaf, 0xb4, 0x1c, 0xd4, 0x5b, 0xcd,
+    0xe2, 0xe9, 0x27, 0x4f, 0xc3, 0x08, 0x72, 0x80, 0xcf, 0xb0, 0xef, 0xf5, 0x28, 0x6d, 0xbe, 0x30,
+    0x4d, 0x34, 0x92, 0xd5, 0x0e, 0x3c, 0x22, 0x32, 0xe5, 0xe4, 0xf9, 0x9f, 0xc2, 0xd1, 0x0a, 0x81,
+    0x12, 0xe1, 0xee, 0x91, 0x83, 0x76, 0xe3, 0x97, 0xe6, 0x61, 0x8a, 0x17, 0x79, 0xa4, 0xb7, 0xdc,
+    0x90, 0x7a, 0x5c, 0x8c, 0x02, 0xa6, 0xca, 0x69, 0xde, 0x50, 0x1a, 0x11, 0x93, 0xb9, 0x52, 0x87,
+    0x58, 0xfc, 0xed, 0x1d, 0x37, 0x49, 0x1b, 0x6a, 0xe0, 0x29, 0x33, 0x99, 0xbd, 0x6c, 0xd9, 0x94,
+    0xf3, 0x40, 0x54, 0x6f, 0xf0, 0xc6, 0x73, 0xb8, 0xd6, 0x3e, 0x65, 0x18, 0x44, 0x1f, 0xdd, 0x67,
+    0x10, 0xf1, 0x0c, 0x19, 0xec, 0xae, 0x03, 0xa1, 0x14, 0x7b, 0xa9, 0x0b, 0xff, 0xf8, 0xa3, 0xc0,
+    0xa2, 0x01, 0xf7, 0x2e, 0xbc, 0x24, 0x68, 0x75, 0x0d, 0xfe, 0xba, 0x2f, 0xb5, 0xd0, 0xda, 0x3d,
+};
+
+// Some words are Latin-1 so that bodies exercise charset conversion. Subject
+// and header words stay ASCII.
+static const char* WORDS[] = {
+    "the", "of", "and", "to", "in", "is", "that", "for", "it", "as", "was", "with",
+    "be", "by", "on", "not", "he", "this", "are", "or", "his", "from", "at", "which",
+    "but", "have", "an", "had", "they", "you", "were", "their", "one", "all", "we",
+    "meeting", "budget", "report", "schedule", "review", "draft", "contract", "invoice",
+    "project", "deadline", "client", "proposal", "agenda", "quarter", "forecast",
+    "café", "naïve", "résumé", "façade", "über", "señor", "déjà", "crème", "piñata",
+};
+#define N_ASCII_WORDS 50
+#define FIRST_TOPIC_WORD 35
+#define N_WORDS (sizeof(WORDS) / sizeof(WORDS[0]))
+
+static const char* FIRST_NAMES[] = {
+    "Alice", "Bruno", "Chen", "Dana", "Emeka", "Farah", "Gita", "Hugo",
+    "Ines", "Jonas", "Kemal", "Lena", "Mateo", "Nadia", "Omar", "Priya",
+};
+static const char* LAST_NAMES[] = {
+    "Adams", "Baker", "Costa", "Dubois", "Evans", "Fischer", "Garcia", "Haddad",
+    "Ito", "Jensen", "Kowalski", "Lopez", "Moreau", "Nakamura", "Okafor", "Petrov",
+};
+static const char* DOMAINS[] = { "example.com", "example.org", "example.net" };
+static const char* CITIES[] = {
+    "Lyon", "Porto", "Osaka", "Lagos", "Québec", "Malmö", "Zürich", "Austin",
+};
+static const char* LOCATIONS[] = {
+    "Room 1", "Room 2", "Boardroom", "Café downstairs", "Phone; dial-in to follow", "Lobby, east door",
+};
+
+static const struct {
+    const char* extension;
+    const char* mime_type;
+} ATTACHMENT_TYPES[] = {
+    { ".pdf", "application/pdf" },
+    { ".jpg", "image/jpeg" },
+    { ".zip", "application/zip" },
+    { ".docx", "application/vnd.openxmlformats-officedocument.wordprocessingml.document" },
+};
+#define N_ATTACHMENT_TYPES (sizeof(ATTACHMENT_TYPES) / sizeof(ATTACHMENT_TYPES[0]))
+
+
+static FILE*    out;
+static uint64_t file_offset = 0;
+static uint64_t next_block_index = 1;
+static uint64_t next_page_bid = 1;
+static uint64_t rng_state;
+
+static Buf      bbt_entries;
+static size_t   n_bbt_entries = 0;
+static Node*    nodes = NULL;
+static size_t   n_nodes = 0;
+static size_t   nodes_cap = 0;
+
+// format-dependent sizes
+static size_t   bid_size;
+static size_t   block_trailer_size;
+static size_t   max_block_data;
+static size_t   page_entries_size;
+
+
+static void
+die(const char* format, ...)
+{
+    va_list args;
+    fprintf(stderr, "gen-pst: ");
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+
+static void*
+malloc_or_die(size_t size)
+{
+    void* p = malloc(size);
+    if (!p) die("out of memory");
+    return p;
+}
+
+
+/* ---- random numbers: splitmix64 ---- */
+
+static uint64_t
+rng_next(void)
+{
+    uint64_t z = (rng_state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+
+static uint64_t
+rng_below(uint64_t n)
+{
+    return n ? rng_next() % n : 0;
+}
+
+
+static int
+rng_percent(unsigned percent)
+{
+    return rng_below(100) < percent;
+}
+
+
+/* ---- byte buffers ---- */
+
+static void
+buf_reserve(Buf* buf, size_t len)
+{
+    if (buf->len + len <= buf->cap) return;
+    size_t cap = buf->cap ? buf->cap : 256;
+    while (cap < buf->len + len) cap *= 2;
+    buf->data = realloc(buf->data, cap);
+    if (!buf->data) die("out of memory");
+    buf->cap = cap;
+}
+
+
+static void
+buf_append(Buf* buf, const void* data, size_t len)
+{
+    buf_reserve(buf, len);
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+
+static void
+buf_puts(Buf* buf, const char* s)
+{
+    buf_append(buf, s, strlen(s));
+}
+
+
+static void
+buf_printf(Buf* buf, const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    buf_reserve(buf, n + 1);
+    va_start(args, format);
+    vsnprintf((char*) buf->data + buf->len, n + 1, format, args);
+    va_end(args);
+    buf->len += n;
+}
+
+
+static void
+buf_zeros(Buf* buf, size_t len)
+{
+    buf_reserve(buf, len);
+    memset(buf->data + buf->len, 0, len);
+    buf->len += len;
+}
+
+
+static void
+put_u16(unsigned char* p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+
+static void
+put_u32(unsigned char* p, uint32_t v)
+{
+    put_u16(p, v);
+    put_u16(p + 2, v >> 16);
+}
+
+
+static void
+put_u64(unsigned char* p, uint64_t v)
+{
+    put_u32(p, v);
+    put_u32(p + 4, v >> 32);
+}
+
+
+// a BID or IB: 32 bits in ANSI files, 64 in Unicode
+static void
+put_ref(unsigned char* p, uint64_t v)
+{
+    if (config.unicode) put_u64(p, v); else put_u32(p, v);
+}
+
+
+static uint64_t
+get_ref(const unsigned char* p)
+{
+    uint64_t v = 0;
+    for (int i = (int) bid_size - 1; i >= 0; i--) v = (v << 8) | p[i];
+    return v;
+}
+
+
+static void
+buf_u16(Buf* buf, uint16_t v)
+{
+    buf_reserve(buf, 2);
+    put_u16(buf->data + buf->len, v);
+    buf->len += 2;
+}
+
+
+/* ---- checksums ---- */
+
+static uint16_t
+compute_sig(uint64_t ib, uint64_t bid)
+{
+    ib ^= bid;
+    return (uint16_t) ((uint16_t) (ib >> 16) ^ (uint16_t) ib);
+}
+
+
+/* ---- file layout ---- */
+
+static void
+write_at_end(const void* data, size_t len)
+{
+    if (fwrite(data, 1, len, out) != len) die("error writing %s", config.output_path);
+    file_offset += len;
+}
+
+
+static uint64_t
+allocate(size_t align)
+{
+    static const unsigned char zeros[PAGE_SIZE];
+    size_t pad = (align - file_offset % align) % align;
+    write_at_end(zeros, pad);
+    if (!config.unicode && file_offset >= 0x7fffffff - MAX_BLOCK_SIZE) {
+        die("ANSI files cannot exceed 2GB; use --unicode or fewer/smaller items");
+    }
+    return file_offset;
+}
+
+
+static uint64_t
+write_block(int internal, const void* data, size_t len)
+{
+    unsigned char block[MAX_BLOCK_SIZE];
+
+    if (len > max_block_data) die("block too large (%zu bytes)", len);
+    uint64_t bid = (next_block_index++ << 2) | (internal ? 2 : 0);
+    size_t total = (len + block_trailer_size + 63) & ~(size_t) 63;
+    uint64_t ib = allocate(64);
+
+    memset(block, 0, total);
+    memcpy(block, data, len);
+    if (config.encrypt && !internal) {
+        for (size_t i = 0; i < len; i++) block[i] = PERMUTE[block[i]];
+    }
+
+    unsigned char* trailer = block + total - block_trailer_size;
+    put_u16(trailer, len);
+    put_u16(trailer + 2, compute_sig(ib, bid));
+    if (config.unicode) {
+        put_u32(trailer + 4, crc32_ms(block, len));
+        put_u64(trailer + 8, bid);
+    } else {
+        put_u32(trailer + 4, bid);
+        put_u32(trailer + 8, crc32_ms(block, len));
+    }
+    write_at_end(block, total);
+
+    unsigned char entry[24] = { 0 };
+    put_ref(entry, bid);
+    put_ref(entry + bid_size, ib);
+    put_u16(entry + 2 * bid_size, len);
+    put_u16(entry + 2 * bid_size + 2, 2);
+    buf_append(&bbt_entries, entry, config.unicode ? 24 : 12);
+    n_bbt_entries++;
+
+    return bid;
+}
+
+
+// XBLOCK or XXBLOCK over already-written blocks
+static uint64_t
+write_xblock(int level, const uint64_t* bids, size_t n, uint64_t total_len)
+{
+    Buf buf = { 0 };
+    buf_zeros(&buf, 8 + n * bid_size);
+    buf.data[0] = 0x01;
+    buf.data[1] = level;
+    put_u16(buf.data + 2, n);
+    put_u32(buf.data + 4, total_len);
+    for (size_t i = 0; i < n; i++) put_ref(buf.data + 8 + i * bid_size, bids[i]);
+    uint64_t bid = write_block(1, buf.data, buf.len);
+    free(buf.data);
+    return bid;
+}
+
+
+// Writes a data tree and returns its root BID.
+static uint64_t
+write_data(const void* data, size_t len)
+{
+    const unsigned char* p = data;
+
+    if (len <= max_block_data) return write_block(0, p, len);
+
+    size_t per_xblock = (max_block_data - 8) / bid_size;
+    size_t n_blocks = (len + max_block_data - 1) / max_block_data;
+    size_t n_xblocks = (n_blocks + per_xblock - 1) / per_xblock;
+    if (n_xblocks > per_xblock) die("value too large (%zu bytes)", len);
+
+    uint64_t* bids = malloc_or_die(n_blocks * sizeof(uint64_t));
+    uint64_t* xbids = malloc_or_die(n_xblocks * sizeof(uint64_t));
+    for (size_t i = 0; i < n_blocks; i++) {
+        size_t offset = i * max_block_data;
+        size_t n = len - offset < max_block_data ? len - offset : max_block_data;
+        bids[i] = write_block(0, p + offset, n);
+    }
+
+    uint64_t bid;
+    if (n_xblocks == 1) {
+        bid = write_xblock(1, bids, n_blocks, len);
+    } else {
+        for (size_t i = 0; i < n_xblocks; i++) {
+            size_t first = i * per_xblock;
+            size_t n = n_blocks - first < per_xblock ? n_blocks - first : per_xblock;
+            uint64_t bytes = i == n_xblocks - 1 ? len - first * max_block_data : (uint64_t) n * max_block_data;
+            xbids[i] = write_xblock(1, bids + first, n, bytes);
+        }
+        bid = write_xblock(2, xbids, n_xblocks, len);
+    }
+
+    free(bids);
+    free(xbids);
+    return bid;
+}
+
+
+static void
+add_node(uint32_t nid, uint64_t bid_data, uint64_t bid_sub, uint32_t parent)
+{
+    if (n_nodes == nodes_cap) {
+        nodes_cap = nodes_cap ? nodes_cap * 2 : 1024;
+        nodes = realloc(nodes, nodes_cap * sizeof(Node));
+        if (!nodes) die("out of memory");
+    }
+    nodes[n_nodes++] = (Node) { nid, bid_data, bid_sub, parent };
+}
+
+
+/* ---- subnode trees ---- */
+
+static uint32_t
+subtree_add(SubTree* tree, uint32_t nid, uint64_t bid_data, uint64_t bid_sub)
+{
+    if (tree->n == sizeof(tree->entries) / sizeof(tree->entries[0])) die("too many subnodes");
+    if (!nid) nid = (*tree->next_index)++ << 5 | NID_TYPE_LTP;
+    tree->entries[tree->n++] = (SubNode) { nid, bid_data, bid_sub };
+    return nid;
+}
+
+
+static int
+compare_subnodes(const void* a, const void* b)
+{
+    uint32_t x = ((const SubNode*) a)->nid;
+    uint32_t y = ((const SubNode*) b)->nid;
+    return x < y ? -1 : x > y;
+}
+
+
+// Writes an SLBLOCK and returns its BID, or 0 when there are no subnodes.
+static uint64_t
+write_subtree(SubTree* tree)
+{
+    if (!tree->n) return 0;
+    qsort(tree->entries, tree->n, sizeof(SubNode), compare_subnodes);
+
+    size_t header = config.unicode ? 8 : 4;
+    size_t entry = 3 * bid_size;
+    Buf buf = { 0 };
+    buf_zeros(&buf, header + tree->n * entry);
+    buf.data[0] = 0x02;
+    buf.data[1] = 0;
+    put_u16(buf.data + 2, tree->n);
+    for (size_t i = 0; i < tree->n; i++) {
+        unsigned char* p = buf.data + header + i * entry;
+        put_ref(p, tree->entries[i].nid);
+        put_ref(p + bid_size, tree->entries[i].bid_data);
+        put_ref(p + 2 * bid_size, tree->entries[i].bid_sub);
+    }
+    uint64_t bid = write_block(1, buf.data, buf.len);
+    free(buf.data);
+    return bid;
+}
+
+
+/* ---- heap-on-node ---- */
+
+static void
+heap_init(Heap* heap, unsigned char client_sig)
+{
+    heap->data.len = 0;
+    buf_zeros(&heap->data, 12);
+    heap->data.data[2] = 0xec;
+    heap->data.data[3] = client_sig;
+    heap->n = 0;
+    heap->offsets[0] = 12;
+}
+
+
+static uint32_t
+heap_alloc(Heap* heap, const void* data, size_t len)
+{
+    if (heap->n == HEAP_MAX_ALLOCS) die("too many heap allocations");
+    buf_append(&heap->data, data, len);
+    heap->offsets[++heap->n] = heap->data.len;
+    return heap->n << 5;
+}
+
+
+static uint64_t
+heap_write(Heap* heap, uint32_t hid_user_root)
+{
+    if (heap->data.len & 1) buf_zeros(&heap->data, 1);
+    // ibHnpm is even, so it can never look like an XBLOCK header (0x0101)
+    put_u16(heap->data.data, heap->data.len);
+    put_u32(heap->data.data + 4, hid_user_root);
+    buf_u16(&heap->data, heap->n);
+    buf_u16(&heap->data, 0);
+    for (unsigned i = 0; i <= heap->n; i++) buf_u16(&heap->data, heap->offsets[i]);
+    return write_block(0, heap->data.data, heap->data.len);
+}
+
+
+/* ---- properties ---- */
+
+static Prop*
+prop_add(PropList* list, uint16_t id, uint16_t type)
+{
+    if (list->n == MAX_PROPS) die("too many properties");
+    Prop* prop = &list->props[list->n++];
+    memset(prop, 0, sizeof(Prop));
+    prop->id = id;
+    prop->type = type;
+    return prop;
+}
+
+
+static void
+prop_int(PropList* list, uint16_t id, uint16_t type, uint32_t value)
+{
+    prop_add(list, id, type)->value = value;
+}
+
+
+static void
+prop_bytes(PropList* list, uint16_t id, uint16_t type, const void* data, size_t len)
+{
+    Prop* prop = prop_add(list, id, type);
+    prop->data = malloc_or_die(len ? len : 1);
+    memcpy(prop->data, data, len);
+    prop->len = len;
+}
+
+
+static void
+prop_time(PropList* list, uint16_t id, uint64_t filetime)
+{
+    unsigned char data[8];
+    put_u64(data, filetime);
+    prop_bytes(list, id, PT_SYSTIME, data, 8);
+}
+
+
+// Re-encodes UTF-8 as windows-1252 (ANSI files) or UTF-16LE (Unicode files).
+// Our text is all Latin-1.
+static void
+encode_text(Buf* dest, const char* utf8, size_t len)
+{
+    const unsigned char* s = (const unsigned char*) utf8;
+    const unsigned char* end = s + len;
+
+    buf_reserve(dest, len * 2);
+    while (s < end) {
+        unsigned c = *s++;
+        if (c >= 0xc0 && s < end) c = ((c & 0x1f) << 6) | (*s++ & 0x3f);
+        if (config.unicode) {
+            dest->data[dest->len++] = c;
+            dest->data[dest->len++] = c >> 8;
+        } else {
+            dest->data[dest->len++] = c;
+        }
+    }
+}
+
+
+static void
+prop_string(PropList* list, uint16_t id, const char* utf8, size_t len)
+{
+    Buf encoded = { 0 };
+    encode_text(&encoded, utf8, len);
+    Prop* prop = prop_add(list, id, config.unicode ? PT_UNICODE : PT_STRING8);
+    prop->data = encoded.data ? encoded.data : malloc_or_die(1);
+    prop->len = encoded.len;
+}
+
+
+static void
+prop_cstring(PropList* list, uint16_t id, const char* utf8)
+{
+    prop_string(list, id, utf8, strlen(utf8));
+}
+
+
+static void
+props_free(PropList* list)
+{
+    for (int i = 0; i < list->n; i++) free(list->props[i].data);
+    list->n = 0;
+}
+
+
+static int
+is_inline_type(uint16_t type)
+{
+    return type == PT_LONG || type == PT_BOOLEAN;
+}
+
+
+static int
+compare_props(const void* a, const void* b)
+{
+    uint16_t x = ((const Prop*) a)->id;
+    uint16_t y = ((const Prop*) b)->id;
+    return x < y ? -1 : x > y;
+}
+
+
+// The HNID for a variable-size value: a heap allocation, or a subnode.
+static uint32_t
+value_hnid(Heap* heap, SubTree* subtree, const Prop* prop)
+{
+    if (!prop->len) return 0;
+    if (prop->len <= HEAP_VALUE_MAX) return heap_alloc(heap, prop->data, prop->len);
+    return subtree_add(subtree, 0, write_data(prop->data, prop->len), 0);
+}
+
+
+// Writes a property context and returns its BID.
+static uint64_t
+write_pc(PropList* list, SubTree* subtree)
+{
+    static Heap heap;
+
+    qsort(list->props, list->n, sizeof(Prop), compare_props);
+
+    heap_init(&heap, 0xbc);
+    unsigned char header[8] = { 0xb5, 2, 6, 0 };
+    uint32_t hid_header = heap_alloc(&heap, header, sizeof(header));
+
+    Buf records = { 0 };
+    buf_zeros(&records, list->n * 8);
+    for (int i = 0; i < list->n; i++) {
+        const Prop* prop = &list->props[i];
+        unsigned char* record = records.data + i * 8;
+        put_u16(record, prop->id);
+        put_u16(record + 2, prop->type);
+        put_u32(record + 4, is_inline_type(prop->type) ? prop->value : value_hnid(&heap, subtree, prop));
+    }
+    if (list->n) {
+        uint32_t hid_records = heap_alloc(&heap, records.data, records.len);
+        put_u32(heap.data.data + heap.offsets[hid_header / 32 - 1] + 4, hid_records);
+    }
+    free(records.data);
+
+    return heap_write(&heap, hid_header);
+}
+
+
+/* ---- text ---- */
+
+static const char*
+random_word(int ascii_only)
+{
+    return WORDS[rng_below(ascii_only ? N_ASCII_WORDS : N_WORDS)];
+}
+
+
+// Appends about `size` bytes of text in paragraphs, each paragraph passed to
+// `emit_paragraph` as UTF-8.
+static void
+random_paragraphs(uint64_t size, void (*emit_paragraph)(Buf*, const char*, size_t), Buf* dest)
+{
+    Buf paragraph = { 0 };
+    uint64_t written = 0;
+
+    while (written < size) {
+        paragraph.len = 0;
+        unsigned n_words = 20 + rng_below(60);
+        for (unsigned i = 0; i < n_words; i++) {
+            const char* word = random_word(0);
+            if (i == 0) {
+                char first = word[0] >= 'a' && word[0] <= 'z' ? word[0] - 'a' + 'A' : word[0];
+                buf_append(&paragraph, &first, 1);
+                buf_puts(&paragraph, word + 1);
+            } else {
+                buf_puts(&paragraph, " ");
+                buf_puts(&paragraph, word);
+            }
+        }
+        buf_puts(&paragraph, ".");
+        emit_paragraph(dest, (const char*) paragraph.data, paragraph.len);
+        written += paragraph.len;
+    }
+    free(paragraph.data);
+}
+
+
+static void
+emit_text_paragraph(Buf* dest, const char* s, size_t len)
+{
+    buf_append(dest, s, len);
+    buf_puts(dest, "\r\n\r\n");
+}
+
+
+static void
+emit_html_paragraph(Buf* dest, const char* s, size_t len)
+{
+    buf_puts(dest, "<p>");
+    buf_append(dest, s, len);
+    buf_puts(dest, "</p>\r\n");
+}
+
+
+static void
+emit_rtf_paragraph(Buf* dest, const char* s, size_t len)
+{
+    const unsigned char* p = (const unsigned char*) s;
+    const unsigned char* end = p + len;
+    while (p < end) {
+        unsigned c = *p++;
+        if (c >= 0xc0 && p < end) {
+            c = ((c & 0x1f) << 6) | (*p++ & 0x3f);
+            buf_printf(dest, "\\'%02x", c);
+        } else {
+            buf_append(dest, &c, 1);
+        }
+    }
+    buf_puts(dest, "\\par\r\n\\par\r\n");
+}
+
+
+/* ---- items ---- */
+
+static uint64_t
+random_filetime(void)
+{
+    return FILETIME_2003 + rng_below((FILETIME_2021 - FILETIME_2003) / 10000000) * 10000000;
+}
+
+
+static void
+format_rfc822_date(char* dest, size_t size, uint64_t filetime)
+{
+    static const char* DAYS[] = { "Thu", "Fri", "Sat", "Sun", "Mon", "Tue", "Wed" };
+    static const char* MONTHS[] = {
+        "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+    };
+    uint64_t t = filetime / 10000000 - 11644473600ULL;
+    uint64_t days = t / 86400, secs = t % 86400;
+
+    // civil_from_days (Howard Hinnant)
+    int64_t z = days + 719468;
+    int64_t era = z / 146097;
+    unsigned doe = z - era * 146097;
+    unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    unsigned mp = (5 * doy + 2) / 153;
+    unsigned d = doy - (153 * mp + 2) / 5 + 1;
+    unsigned m = mp < 10 ? mp + 3 : mp - 9;
+    int64_t y = yoe + era * 400 + (m <= 2);
+
+    snprintf(dest, size, "%s, %u %s %lld %02u:%02u:%02u +0000",
+             DAYS[days % 7], d, MONTHS[m - 1], (long long) y,
+             (unsigned) (secs / 3600), (unsigned) (secs / 60 % 60), (unsigned) (secs % 60));
+}
+
+
+typedef struct {
+    char first[32];
+    char last[32];
+    char name[64];
+    char address[96];
+} Person;
+
+
+static void
+random_person(Person* person)
+{
+    const char* first = FIRST_NAMES[rng_below(sizeof(FIRST_NAMES) / sizeof(FIRST_NAMES[0]))];
+    const char* last = LAST_NAMES[rng_below(sizeof(LAST_NAMES) / sizeof(LAST_NAMES[0]))];
+    const char* domain = DOMAINS[rng_below(sizeof(DOMAINS) / sizeof(DOMAINS[0]))];
+    snprintf(person->first, sizeof(person->first), "%s", first);
+    snprintf(person->last, sizeof(person->last), "%s", last);
+    snprintf(person->name, sizeof(person->name), "%s %s", first, last);
+    snprintf(person->address, sizeof(person->address), "%s.%s@%s", first, last, domain);
+    for (char* p = person->address; *p; p++) if (*p >= 'A' && *p <= 'Z') *p += 'a' - 'A';
+}
+
+
+static uint64_t
+random_attachment_size(void)
+{
+    unsigned total = 0;
+    for (unsigned i = 0; i < config.n_attach_sizes; i++) total += config.attach_sizes[i].weight;
+    unsigned pick = rng_below(total);
+    for (unsigned i = 0; i < config.n_attach_sizes; i++) {
+        if (pick < config.attach_sizes[i].weight) {
+            uint64_t size = config.attach_sizes[i].size;
+            return size / 2 + rng_below(size / 2 + 1);
+        }
+        pick -= config.attach_sizes[i].weight;
+    }
+    return 0;
+}
+
+
+static void
+random_bytes(unsigned char* dest, size_t len)
+{
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) put_u64(dest + i, rng_next());
+    for (; i < len; i++) dest[i] = rng_next();
+}
+
+
+static uint64_t
+write_attachment_table(const uint32_t* nids, const char (*short_names)[16], const uint64_t* sizes, unsigned n)
+{
+    static Heap heap;
+    // columns in tag order; LtpRowId and LtpRowVer must be at offsets 0 and 4
+    static const struct { uint16_t id; uint16_t offset; } COLUMNS[] = {
+        { 0x0e20, 8 },  // PidTagAttachSize
+        { 0x3704, 12 }, // PidTagAttachFilename
+        { 0x3705, 16 }, // PidTagAttachMethod
+        { 0x370b, 20 }, // PidTagRenderingPosition
+        { 0x67f2, 0 },  // PidTagLtpRowId
+        { 0x67f3, 4 },  // PidTagLtpRowVer
+    };
+    const unsigned n_columns = sizeof(COLUMNS) / sizeof(COLUMNS[0]);
+    const unsigned row_size = 24 + (n_columns + 7) / 8;
+    const unsigned index_entry_size = config.unicode ? 8 : 6;
+
+    heap_init(&heap, 0x7c);
+
+    Buf rows = { 0 }, row_index = { 0 };
+    for (unsigned i = 0; i < n; i++) {
+        Buf name = { 0 };
+        encode_text(&name, short_names[i], strlen(short_names[i]));
+        uint32_t hid_name = heap_alloc(&heap, name.data, name.len);
+        free(name.data);
+
+        unsigned char row[32] = { 0 };
+        put_u32(row + 0, nids[i]);
+        put_u32(row + 4, i + 1);
+        put_u32(row + 8, sizes[i]);
+        put_u32(row + 12, hid_name);
+        put_u32(row + 16, 1); // ATTACH_BY_VALUE
+        put_u32(row + 20, 0xffffffff);
+        row[24] = 0xfc; // cell existence bits for all six columns
+        buf_append(&rows, row, row_size);
+
+        unsigned char entry[8] = { 0 };
+        put_u32(entry, nids[i]);
+        put_u32(entry + 4, i);
+        buf_append(&row_index, entry, index_entry_size);
+    }
+
+    uint32_t hid_rows = heap_alloc(&heap, rows.data, rows.len);
+    uint32_t hid_row_index_records = heap_alloc(&heap, row_index.data, row_index.len);
+    unsigned char bth[8] = { 0xb5, 4, index_entry_size - 4, 0 };
+    put_u32(bth + 4, hid_row_index_records);
+    uint32_t hid_row_index = heap_alloc(&heap, bth, sizeof(bth));
+    free(rows.data);
+    free(row_index.data);
+
+    Buf info = { 0 };
+    buf_zeros(&info, 22 + 8 * n_columns);
+    info.data[0] = 0x7c;
+    info.data[1] = n_columns;
+    put_u16(info.data + 2, 24);       // end of 4-byte columns
+    put_u16(info.data + 4, 24);       // end of 2-byte columns
+    put_u16(info.data + 6, 24);       // end of 1-byte columns
+    put_u16(info.data + 8, row_size); // end of cell existence bits
+    put_u32(info.data + 10, hid_row_index);
+    put_u32(info.data + 14, hid_rows);
+    for (unsigned i = 0; i < n_columns; i++) {
+        unsigned char* column = info.data + 22 + 8 * i;
+        uint16_t type = COLUMNS[i].id == 0x3704 ? (config.unicode ? PT_UNICODE : PT_STRING8) : PT_LONG;
+        put_u16(column, type);
+        put_u16(column + 2, COLUMNS[i].id);
+        put_u16(column + 4, COLUMNS[i].offset);
+        column[6] = 4;
+        column[7] = i == 4 ? 0 : i == 5 ? 1 : i + 2;
+    }
+    uint32_t hid_info = heap_alloc(&heap, info.data, info.len);
+    free(info.data);
+
+    return heap_write(&heap, hid_info);
+}
+
+
+static uint64_t
+write_attachment(SubTree* message_subtree, uint32_t nid, const char* short_name, const char* long_name,
+                 unsigned type, uint64_t size)
+{
+    static unsigned char* data = NULL;
+    static uint64_t data_cap = 0;
+
+    if (size > data_cap) {
+        free(data);
+        data = malloc_or_die(size);
+        data_cap = size;
+    }
+    random_bytes(data, size);
+
+    PropList props = { .n = 0 };
+    SubTree subtree = { .n = 0, .next_index = message_subtree->next_index };
+    prop_int(&props, 0x0e20, PT_LONG, size);
+    prop_cstring(&props, 0x3001, long_name);
+    prop_bytes(&props, 0x3701, PT_BINARY, data, size);
+    prop_cstring(&props, 0x3703, ATTACHMENT_TYPES[type].extension);
+    prop_cstring(&props, 0x3704, short_name);
+    prop_int(&props, 0x3705, PT_LONG, 1);
+    prop_cstring(&props, 0x3707, long_name);
+    prop_int(&props, 0x370b, PT_LONG, 0xffffffff);
+    prop_cstring(&props, 0x370e, ATTACHMENT_TYPES[type].mime_type);
+    prop_cstring(&props, 0x3716, "attachment");
+    prop_int(&props, 0x7ffe, PT_BOOLEAN, 0);
+
+    uint64_t bid_data = write_pc(&props, &subtree);
+    props_free(&props);
+    subtree_add(message_subtree, nid, bid_data, write_subtree(&subtree));
+    return size;
+}
+
+
+static void
+write_message(uint32_t nid, const Folder* folder)
+{
+    PropList props = { .n = 0 };
+    uint32_t next_index = 0x401;
+    SubTree subtree = { .n = 0, .next_index = &next_index };
+    Buf subject = { 0 }, body = { 0 }, html = { 0 }, rtf = { 0 }, headers = { 0 }, encoded = { 0 };
+    Person from, to[3];
+    char date[64], message_id[128];
+
+    random_person(&from);
+    unsigned n_to = 1 + rng_below(3);
+    for (unsigned i = 0; i < n_to; i++) random_person(&to[i]);
+    uint64_t sent = random_filetime();
+    format_rfc822_date(date, sizeof(date), sent);
+    snprintf(message_id, sizeof(message_id), "<%016llx.%08x@%s>",
+             (unsigned long long) rng_next(), nid, strchr(from.address, '@') + 1);
+
+    unsigned n_subject_words = 3 + rng_below(6);
+    for (unsigned i = 0; i < n_subject_words; i++) {
+        if (i) buf_puts(&subject, " ");
+        buf_puts(&subject, random_word(1));
+    }
+    subject.data[0] += 'A' - 'a';
+
+    uint64_t body_size = config.body_size / 2 + rng_below(config.body_size + 1);
+    random_paragraphs(body_size, emit_text_paragraph, &body);
+
+    int has_html = rng_percent(config.html_percent);
+    if (has_html) {
+        buf_printf(&html,
+                   "<html><head><meta http-equiv=\"Content-Type\" content=\"text/html; charset=%s\"></head><body>\r\n",
+                   config.unicode ? "utf-8" : "windows-1252");
+        random_paragraphs(body_size, emit_html_paragraph, &html);
+        buf_puts(&html, "</body></html>\r\n");
+        if (!config.unicode) {
+            // HTML is binary, in the message's code page
+            encode_text(&encoded, (const char*) html.data, html.len);
+            html.len = 0;
+            buf_append(&html, encoded.data, encoded.len);
+        }
+    }
+
+    int has_rtf = rng_percent(config.rtf_percent);
+    if (has_rtf) {
+        Buf raw = { 0 };
+        buf_puts(&raw, "{\\rtf1\\ansi\\ansicpg1252\\deff0{\\fonttbl{\\f0\\fswiss Arial;}}\r\n\\f0\\fs20 ");
+        random_paragraphs(body_size, emit_rtf_paragraph, &raw);
+        buf_puts(&raw, "}\r\n");
+        size_t rtf_len;
+        unsigned char* compressed = rtfcomp_compress(raw.data, raw.len, &rtf_len);
+        if (!compressed) die("out of memory");
+        buf_append(&rtf, compressed, rtf_len);
+        free(compressed);
+        free(raw.data);
+    }
+
+    buf_printf(&headers,
+               "Received: from mail.%s ([192.0.2.%u]) by mx.example.com with ESMTP id %08x;\r\n\t%s\r\n"
+               "From: %s <%s>\r\nTo: ",
+               strchr(from.address, '@') + 1, (unsigned) rng_below(256), nid, date, from.name, from.address);
+    for (unsigned i = 0; i < n_to; i++) {
+        buf_printf(&headers, "%s%s <%s>", i ? ", " : "", to[i].name, to[i].address);
+    }
+    buf_printf(&headers,
+               "\r\nSubject: %.*s\r\nDate: %s\r\nMessage-ID: %s\r\nMIME-Version: 1.0\r\n"
+               "Content-Type: multipart/alternative; boundary=\"----=_NextPart_%08x\"\r\n\r\n",
+               (int) subject.len, subject.data, date, message_id, nid);
+
+    Buf display_to = { 0 };
+    for (unsigned i = 0; i < n_to; i++) {
+        buf_printf(&display_to, "%s%s", i ? "; " : "", to[i].name);
+    }
+
+    unsigned n_attachments = rng_percent(config.attach_percent) ? 1 + rng_below(MAX_ATTACHMENTS) : 0;
+    uint64_t attachment_bytes = 0;
+    if (n_attachments) {
+        uint32_t nids[MAX_ATTACHMENTS];
+        char short_names[MAX_ATTACHMENTS][16];
+        uint64_t sizes[MAX_ATTACHMENTS];
+        for (unsigned i = 0; i < n_attachments; i++) {
+            unsigned type = rng_below(N_ATTACHMENT_TYPES);
+            char long_name[64];
+            const char* word = random_word(1);
+            snprintf(long_name, sizeof(long_name), "%s-%u%s", word, i + 1, ATTACHMENT_TYPES[type].extension);
+            snprintf(short_names[i], sizeof(short_names[i]), "%.6s~%u%.4s", word, i + 1, ATTACHMENT_TYPES[type].extension);
+            nids[i] = next_index++ << 5 | NID_TYPE_ATTACHMENT;
+            sizes[i] = write_attachment(&subtree, nids[i], short_names[i], long_name, type, random_attachment_size());
+            attachment_bytes += sizes[i];
+        }
+        subtree_add(&subtree, NID_ATTACHMENT_TABLE, write_attachment_table(nids, short_names, sizes, n_attachments), 0);
+    }
+
+    prop_cstring(&props, 0x001a, "IPM.Note");
+    prop_string(&props, 0x0037, (const char*) subject.data, subject.len);
+    prop_time(&props, 0x0039, sent);
+    prop_cstring(&props, 0x0042, from.name);
+    prop_cstring(&props, 0x0064, "SMTP");
+    prop_cstring(&props, 0x0065, from.address);
+    prop_string(&props, 0x007d, (const char*) headers.data, headers.len);
+    prop_cstring(&props, 0x0c1a, from.name);
+    prop_cstring(&props, 0x0c1e, "SMTP");
+    prop_cstring(&props, 0x0c1f, from.address);
+    prop_string(&props, 0x0e04, (const char*) display_to.data, display_to.len);
+    prop_time(&props, 0x0e06, sent + 10000000ULL * rng_below(600));
+    prop_int(&props, 0x0e07, PT_LONG, 0x01 | (n_attachments ? 0x10 : 0));
+    prop_int(&props, 0x0e08, PT_LONG, body.len + html.len + rtf.len + headers.len + attachment_bytes);
+    prop_int(&props, 0x0e1b, PT_BOOLEAN, n_attachments > 0);
+    if (has_rtf) prop_int(&props, 0x0e1f, PT_BOOLEAN, 1);
+    prop_string(&props, 0x1000, (const char*) body.data, body.len);
+    if (has_rtf) prop_bytes(&props, 0x1009, PT_BINARY, rtf.data, rtf.len);
+    if (has_html) prop_bytes(&props, 0x1013, PT_BINARY, html.data, html.len);
+    prop_cstring(&props, 0x1035, message_id);
+    prop_time(&props, 0x3007, sent);
+    prop_time(&props, 0x3008, sent);
+    prop_int(&props, 0x3fde, PT_LONG, config.unicode ? 65001 : 1252);
+    prop_int(&props, 0x3ffd, PT_LONG, 1252);
+
+    uint64_t bid_data = write_pc(&props, &subtree);
+    add_node(nid, bid_data, write_subtree(&subtree), folder->nid);
+
+    props_free(&props);
+    free(subject.data);
+    free(body.data);
+    free(html.data);
+    free(rtf.data);
+    free(headers.data);
+    free(encoded.data);
+    free(display_to.data);
+}
+
+
+static void
+random_phone(char* dest, size_t size)
+{
+    snprintf(dest, size, "+1 555 %03u %04u", (unsigned) rng_below(1000), (unsigned) rng_below(10000));
+}
+
+
+// Notes and descriptions: CRLFs, and the commas and semicolons vCard and
+// iCalendar escape.
+static void
+random_notes(Buf* dest, uint64_t size)
+{
+    buf_printf(dest, "Follow up by %s, %s; see the %s.\r\n\r\n",
+               WORDS[FIRST_TOPIC_WORD + rng_below(N_ASCII_WORDS - FIRST_TOPIC_WORD)],
+               CITIES[rng_below(sizeof(CITIES) / sizeof(CITIES[0]))], random_word(1));
+    random_paragraphs(size, emit_text_paragraph, dest);
+}
+
+
+static void
+write_contact(uint32_t nid, const Folder* folder)
+{
+    PropList props = { .n = 0 };
+    uint32_t next_index = 0x401;
+    SubTree subtree = { .n = 0, .next_index = &next_index };
+    Buf body = { 0 }, address = { 0 };
+    Person person;
+    char company[64], business_phone[32], home_phone[32], mobile_phone[32], postal_code[16];
+
+    random_person(&person);
+    const char* word = WORDS[FIRST_TOPIC_WORD + rng_below(N_ASCII_WORDS - FIRST_TOPIC_WORD)];
+    snprintf(company, sizeof(company), "%c%s %s, Inc.", word[0] - 'a' + 'A', word + 1, person.last);
+    random_phone(business_phone, sizeof(business_phone));
+    random_phone(home_phone, sizeof(home_phone));
+    random_phone(mobile_phone, sizeof(mobile_phone));
+    const char* city = CITIES[rng_below(sizeof(CITIES) / sizeof(CITIES[0]))];
+    snprintf(postal_code, sizeof(postal_code), "%05u", (unsigned) rng_below(100000));
+    unsigned street_number = 1 + rng_below(999);
+    buf_printf(&address, "%u %s Street\r\n%s, %s", street_number, person.last, city, postal_code);
+    char street[64];
+    snprintf(street, sizeof(street), "%u %s Street", street_number, person.last);
+    uint64_t created = random_filetime();
+    random_notes(&body, rng_below(config.body_size / 4 + 1));
+
+    prop_cstring(&props, 0x001a, "IPM.Contact");
+    prop_cstring(&props, 0x0037, person.name);
+    prop_string(&props, 0x1000, (const char*) body.data, body.len);
+    prop_time(&props, 0x3007, created);
+    prop_time(&props, 0x3008, created + 10000000ULL * rng_below(86400 * 365));
+    prop_cstring(&props, 0x3a06, person.first);
+    prop_cstring(&props, 0x3a08, business_phone);
+    prop_cstring(&props, 0x3a09, home_phone);
+    prop_cstring(&props, 0x3a11, person.last);
+    prop_cstring(&props, 0x3a16, company);
+    prop_cstring(&props, 0x3a17, random_word(1));
+    prop_cstring(&props, 0x3a1c, mobile_phone);
+    prop_cstring(&props, 0x3a27, city);
+    prop_cstring(&props, 0x3a29, street);
+    prop_cstring(&props, 0x3a2a, postal_code);
+    if (rng_percent(50)) prop_time(&props, 0x3a42, FILETIME_2003 - 10000000ULL * rng_below(86400ULL * 365 * 50));
+    prop_int(&props, 0x3fde, PT_LONG, config.unicode ? 65001 : 1252);
+    prop_cstring(&props, 0x8005, person.name);
+    prop_string(&props, 0x801b, (const char*) address.data, address.len);
+    prop_cstring(&props, 0x8082, "SMTP");
+    prop_cstring(&props, 0x8083, person.address);
+    prop_cstring(&props, 0x8084, person.name);
+
+    uint64_t bid_data = write_pc(&props, &subtree);
+    add_node(nid, bid_data, write_subtree(&subtree), folder->nid);
+
+    props_free(&props);
+    free(body.data);
+    free(address.data);
+}
+
+
+static void
+write_appointment(uint32_t nid, const Folder* folder)
+{
+    PropList props = { .n = 0 };
+    uint32_t next_index = 0x401;
+    SubTree subtree = { .n = 0, .next_index = &next_index };
+    Buf subject = { 0 }, body = { 0 };
+
+    unsigned n_subject_words = 2 + rng_below(5);
+    for (unsigned i = 0; i < n_subject_words; i++) {
+        if (i) buf_puts(&subject, " ");
+        buf_puts(&subject, random_word(1));
+    }
+    subject.data[0] += 'A' - 'a';
+    random_notes(&body, rng_below(config.body_size / 2 + 1));
+
+    uint64_t start = random_filetime();
+    int all_day = rng_percent(10);
+    uint64_t duration = all_day ? 86400 : 900 * (1 + rng_below(8));
+    if (all_day) start -= start % (86400 * 10000000ULL);
+    int alarm = rng_percent(60);
+
+    prop_cstring(&props, 0x001a, "IPM.Appointment");
+    prop_string(&props, 0x0037, (const char*) subject.data, subject.len);
+    prop_string(&props, 0x1000, (const char*) body.data, body.len);
+    prop_time(&props, 0x3007, start - 10000000ULL * rng_below(86400 * 30));
+    prop_time(&props, 0x3008, start - 10000000ULL * rng_below(86400));
+    prop_int(&props, 0x3fde, PT_LONG, config.unicode ? 65001 : 1252);
+    prop_int(&props, 0x8205, PT_LONG, rng_below(4));
+    prop_cstring(&props, 0x8208, LOCATIONS[rng_below(sizeof(LOCATIONS) / sizeof(LOCATIONS[0]))]);
+    prop_time(&props, 0x820d, start);
+    prop_time(&props, 0x820e, start + 10000000ULL * duration);
+    prop_int(&props, 0x8215, PT_BOOLEAN, all_day);
+    prop_int(&props, 0x8223, PT_BOOLEAN, 0);
+    if (alarm) prop_int(&props, 0x8501, PT_LONG, 5 * rng_below(7));
+    prop_int(&props, 0x8503, PT_BOOLEAN, alarm);
+
+    uint64_t bid_data = write_pc(&props, &subtree);
+    add_node(nid, bid_data, write_subtree(&subtree), folder->nid);
+
+    props_free(&props);
+    free(subject.data);
+    free(body.data);
+}
+
+
+static void
+write_folder(const Folder* folder)
+{
+    PropList props = { .n = 0 };
+    uint32_t next_index = 0x401;
+    SubTree subtree = { .n = 0, .next_index = &next_index };
+
+    prop_cstring(&props, 0x3001, folder->name);
+    prop_int(&props, 0x3602, PT_LONG, folder->n_messages);
+    prop_int(&props, 0x3603, PT_LONG, 0);
+    prop_int(&props, 0x360a, PT_BOOLEAN, folder->has_children);
+    prop_cstring(&props, 0x3613, "IPF.Note");
+
+    uint64_t bid_data = write_pc(&props, &subtree);
+    add_node(folder->nid, bid_data, write_subtree(&subtree), folder->parent_nid);
+    props_free(&props);
+}
+
+
+static void
+write_message_store(uint32_t top_nid)
+{
+    PropList props = { .n = 0 };
+    uint32_t next_index = 0x401;
+    SubTree subtree = { .n = 0, .next_index = &next_index };
+    unsigned char record_key[16], entry_id[24] = { 0 };
+
+    random_bytes(record_key, sizeof(record_key));
+    memcpy(entry_id + 4, record_key, sizeof(record_key));
+    put_u32(entry_id + 20, top_nid);
+
+    prop_bytes(&props, 0x0ff9, PT_BINARY, record_key, sizeof(record_key));
+    prop_cstring(&props, 0x3001, "Personal Folders");
+    prop_int(&props, 0x35df, PT_LONG, 0x89);
+    prop_bytes(&props, 0x35e0, PT_BINARY, entry_id, sizeof(entry_id));
+
+    uint64_t bid_data = write_pc(&props, &subtree);
+    add_node(NID_MESSAGE_STORE, bid_data, write_subtree(&subtree), 0);
+    props_free(&props);
+}
+
+
+/* ---- B-trees and header ---- */
+
+typedef struct {
+    uint64_t key;
+    uint64_t bid;
+    uint64_t ib;
+} PageRef;
+
+
+static PageRef
+write_page(int ptype, int level, const unsigned char* entries, size_t n, size_t entry_size)
+{
+    unsigned char page[PAGE_SIZE] = { 0 };
+    uint64_t bid = next_page_bid++;
+    uint64_t ib = allocate(PAGE_SIZE);
+
+    memcpy(page, entries, n * entry_size);
+    page[page_entries_size] = n;
+    page[page_entries_size + 1] = page_entries_size / entry_size;
+    page[page_entries_size + 2] = entry_size;
+    page[page_entries_size + 3] = level;
+
+    if (config.unicode) {
+        page[496] = page[497] = ptype;
+        put_u16(page + 498, compute_sig(ib, bid));
+        put_u32(page + 500, crc32_ms(page, 496));
+        put_u64(page + 504, bid);
+    } else {
+        page[500] = page[501] = ptype;
+        put_u16(page + 502, compute_sig(ib, bid));
+        put_u32(page + 504, bid);
+        put_u32(page + 508, crc32_ms(page, 500));
+    }
+    write_at_end(page, PAGE_SIZE);
+
+    return (PageRef) { get_ref(entries), bid, ib };
+}
+
+
+// Writes a B-tree over sorted leaf entries and returns the root page.
+static PageRef
+write_btree(int ptype, const unsigned char* entries, size_t n, size_t entry_size)
+{
+    size_t per_page = page_entries_size / entry_size;
+    size_t n_refs = (n + per_page - 1) / per_page;
+    PageRef* refs = malloc_or_die(n_refs * sizeof(PageRef));
+
+    for (size_t i = 0; i < n_refs; i++) {
+        size_t count = n - i * per_page < per_page ? n - i * per_page : per_page;
+        refs[i] = write_page(ptype, 0, entries + i * per_page * entry_size, count, entry_size);
+    }
+
+    size_t branch_size = 3 * bid_size;
+    size_t per_branch = page_entries_size / branch_size;
+    unsigned char* branch = malloc_or_die(per_branch * branch_size);
+    for (int level = 1; n_refs > 1; level++) {
+        size_t n_parents = (n_refs + per_branch - 1) / per_branch;
+        for (size_t i = 0; i < n_parents; i++) {
+            size_t first = i * per_branch;
+            size_t count = n_refs - first < per_branch ? n_refs - first : per_branch;
+            for (size_t j = 0; j < count; j++) {
+                put_ref(branch + j * branch_size, refs[first + j].key);
+                put_ref(branch + j * branch_size + bid_size, refs[first + j].bid);
+                put_ref(branch + j * branch_size + 2 * bid_size, refs[first + j].ib);
+            }
+            refs[i] = write_page(ptype, level, branch, count, branch_size);
+        }
+        n_refs = n_parents;
+    }
+
+    PageRef root = refs[0];
+    free(branch);
+    free(refs);
+    return root;
+}
+
+
+static int
+compare_nodes(const void* a, const void* b)
+{
+    uint32_t x = ((const Node*) a)->nid;
+    uint32_t y = ((const Node*) b)->nid;
+    return x < y ? -1 : x > y;
+}
+
+
+static PageRef
+write_nbt(void)
+{
+    size_t entry_size = config.unicode ? 32 : 16;
+    unsigned char* entries = calloc(n_nodes, entry_size);
+    if (!entries) die("out of memory");
+
+    qsort(nodes, n_nodes, sizeof(Node), compare_nodes);
+    for (size_t i = 0; i < n_nodes; i++) {
+        unsigned char* p = entries + i * entry_size;
+        put_ref(p, nodes[i].nid);
+        put_ref(p + bid_size, nodes[i].bid_data);
+        put_ref(p + 2 * bid_size, nodes[i].bid_sub);
+        put_u32(p + 3 * bid_size, nodes[i].parent);
+    }
+    PageRef root = write_btree(PTYPE_NBT, entries, n_nodes, entry_size);
+    free(entries);
+    return root;
+}
+
+
+static void
+write_header(PageRef nbt, PageRef bbt, uint32_t next_folder_index, uint32_t next_message_index)
+{
+    unsigned char header[HEADER_SIZE_UNICODE] = { 0 };
+    size_t size = config.unicode ? HEADER_SIZE_UNICODE : HEADER_SIZE_ANSI;
+    size_t rgnid = config.unicode ? 44 : 36;
+    size_t root = config.unicode ? 180 : 164;
+    size_t root_ref = config.unicode ? 8 : 4;
+    size_t after_root = config.unicode ? 256 : 204;
+
+    memcpy(header, "!BDN", 4);
+    memcpy(header + 8, "SM", 2);
+    put_u16(header + 10, config.unicode ? 23 : 14);
+    put_u16(header + 12, 19);
+    header[14] = header[15] = 0x01;
+
+    if (config.unicode) {
+        put_u64(header + 32, next_page_bid);
+        put_u64(header + 516, next_block_index << 2);
+    } else {
+        put_u32(header + 24, next_block_index << 2);
+        put_u32(header + 28, next_page_bid);
+    }
+    put_u32(header + rgnid - 4, n_nodes); // dwUnique
+    for (int type = 0; type < 32; type++) {
+        uint32_t next = type == NID_TYPE_NORMAL_FOLDER ? next_folder_index
+                      : type == NID_TYPE_NORMAL_MESSAGE ? next_message_index
+                      : 0x400;
+        put_u32(header + rgnid + type * 4, next);
+    }
+
+    // ROOT: ibFileEof, ibAMapLast, cbAMapFree, cbPMapFree, BREFNBT, BREFBBT, fAMapValid
+    put_ref(header + root + 4, file_offset);
+    put_ref(header + root + 4 + 4 * root_ref, nbt.bid);
+    put_ref(header + root + 4 + 5 * root_ref, nbt.ib);
+    put_ref(header + root + 4 + 6 * root_ref, bbt.bid);
+    put_ref(header + root + 4 + 7 * root_ref, bbt.ib);
+    header[root + 4 + 8 * root_ref] = 0; // no allocation maps
+
+    memset(header + after_root, 0xff, 256); // deprecated rgbFM, rgbFP
+    header[after_root + 256] = 0x80;
+    header[after_root + 257] = config.encrypt ? 1 : 0;
+
+    put_u32(header + 4, crc32_ms(header + 8, 471));
+    if (config.unicode) put_u32(header + 524, crc32_ms(header + 8, 516));
+
+    if (fseek(out, 0, SEEK_SET) != 0 || fwrite(header, 1, size, out) != size) {
+        die("error writing %s", config.output_path);
+    }
+}
+
+
+/* ---- main ---- */
+
+static uint64_t
+parse_size(const char* s)
+{
+    char* end;
+    uint64_t n = strtoull(s, &end, 10);
+    switch (*end) {
+        case 'k': case 'K': n <<= 10; end++; break;
+        case 'm': case 'M': n <<= 20; end++; break;
+        case 'g': case 'G': n <<= 30; end++; break;
+    }
+    if (end == s || *end) die("invalid size '%s'", s);
+    return n;
+}
+
+
+// "16k:70,256k:25,4m:5": sizes with relative weights
+static void
+parse_size_buckets(const char* s)
+{
+    char* copy = strdup(s);
+    config.n_attach_sizes = 0;
+    for (char* item = strtok(copy, ","); item; item = strtok(NULL, ",")) {
+        char* colon = strchr(item, ':');
+        if (!colon || config.n_attach_sizes == MAX_SIZE_BUCKETS) die("invalid --attach-sizes '%s'", s);
+        *colon = '\0';
+        SizeBucket* bucket = &config.attach_sizes[config.n_attach_sizes++];
+        bucket->size = parse_size(item);
+        bucket->weight = strtoul(colon + 1, NULL, 10);
+    }
+    free(copy);
+}
+
+
+static unsigned
+parse_percent(const char* s, const char* option)
+{
+    char* end;
+    unsigned long n = strtoul(s, &end, 10);
+    if (end == s || *end || n > 100) die("invalid %s '%s'", option, s);
+    return n;
+}
+
+
+static void __attribute__((noreturn))
+usage(int status)
+{
+    fprintf(status ? stderr : stdout,
+        "Usage: gen-pst [OPTIONS] OUTPUT.pst\n"
+        "\n"
+        "  --items N            items (default 1000)\n"
+        "  --folders N          folders (default 10)\n"
+        "  --depth N            maximum folder nesting (default 2)\n"
+        "  --body-size BYTES    typical text body size (default 2k)\n"
+        "  --html PERCENT       messages with an HTML body (default 50)\n"
+        "  --rtf PERCENT        messages with a compressed RTF body (default 50)\n"
+        "  --attach PERCENT     messages with 1-3 attachments (default 20)\n"
+        "  --attach-sizes LIST  SIZE:WEIGHT,... (default %s)\n"
+        "  --contacts PERCENT   items that are contacts rather than mail (default 0)\n"
+        "  --appointments PERCENT\n"
+        "                       items that are appointments (default 0)\n"
+        "  --ansi, --unicode    file format (default unicode)\n"
+        "  --encryption TYPE    none or permute (default permute)\n"
+        "  --seed N             random seed (default 1)\n",
+        DEFAULT_ATTACH_SIZES
+    );
+    exit(status);
+}
+
+
+static void
+parse_args(int argc, char** argv)
+{
+    static const struct option OPTIONS[] = {
+        { "items",        required_argument, NULL, 'n' },
+        { "folders",      required_argument, NULL, 'f' },
+        { "depth",        required_argument, NULL, 'd' },
+        { "body-size",    required_argument, NULL, 'b' },
+        { "html",         required_argument, NULL, 'h' },
+        { "rtf",          required_argument, NULL, 'r' },
+        { "attach",       required_argument, NULL, 'a' },
+        { "attach-sizes", required_argument, NULL, 's' },
+        { "contacts",     required_argument, NULL, 'c' },
+        { "appointments", required_argument, NULL, 'p' },
+        { "ansi",         no_argument,       NULL, 'A' },
+        { "unicode",      no_argument,       NULL, 'U' },
+        { "encryption",   required_argument, NULL, 'e' },
+        { "seed",         required_argument, NULL, 'S' },
+        { "help",         no_argument,       NULL, 'H' },
+        { NULL, 0, NULL, 0 },
+    };
+
+    parse_size_buckets(DEFAULT_ATTACH_SIZES);
+
+    int c;
+    while ((c = getopt_long(argc, argv, "", OPTIONS, NULL)) != -1) {
+        switch (c) {
+            case 'n': config.n_items = parse_size(optarg); break;
+            case 'f': config.n_folders = parse_size(optarg); break;
+            case 'd': config.depth = parse_size(optarg); break;
+            case 'b': config.body_size = parse_size(optarg); break;
+            case 'h': config.html_percent = parse_percent(optarg, "--html"); break;
+            case 'r': config.rtf_percent = parse_percent(optarg, "--rtf"); break;
+            case 'a': config.attach_percent = parse_percent(optarg, "--attach"); break;
+            case 's': parse_size_buckets(optarg); break;
+            case 'c': config.contact_percent = parse_percent(optarg, "--contacts"); break;
+            case 'p': config.appointment_percent = parse_percent(optarg, "--appointments"); break;
+            case 'A': config.unicode = 0; break;
+            case 'U': config.unicode = 1; break;
+            case 'e':
+                if (strcmp(optarg, "none") == 0) config.encrypt = 0;
+                else if (strcmp(optarg, "permute") == 0) config.encrypt = 1;
+                else die("invalid --encryption '%s'", optarg);
+                break;
+            case 'S': config.seed = strtoull(optarg, NULL, 0); break;
+            case 'H': usage(0);
+            default: usage(2);
+        }
+    }
+    if (optind != argc - 1 || !config.n_folders || !config.depth) usage(2);
+    if (config.contact_percent + config.appointment_percent > 100) die("--contacts and --appointments add up to more than 100");
+    config.output_path = argv[optind];
+}
+
+
+int
+main(int argc, char** argv)
+{
+    parse_args(argc, argv);
+
+    rng_state = config.seed;
+    bid_size = config.unicode ? 8 : 4;
+    block_trailer_size = config.unicode ? 16 : 12;
+    max_block_data = MAX_BLOCK_SIZE - block_trailer_size;
+    page_entries_size = config.unicode ? 488 : 496;
+
+    out = fopen(config.output_path, "wb");
+    if (!out) die("could not open %s", config.output_path);
+    static char out_buffer[1 << 20];
+    setvbuf(out, out_buffer, _IOFBF, sizeof(out_buffer));
+
+    // header and unused space before the first block
+    static const unsigned char zeros[PAGE_SIZE];
+    while (file_offset < DATA_START) write_at_end(zeros, PAGE_SIZE);
+
+    // Folders hang off "Top of Personal Folders" (or each other) up to --depth.
+    uint32_t top_nid = 0x401 << 5 | NID_TYPE_NORMAL_FOLDER;
+    Folder* folders = calloc(config.n_folders, sizeof(Folder));
+    if (!folders) die("out of memory");
+    for (unsigned i = 0; i < config.n_folders; i++) {
+        Folder* folder = &folders[i];
+        folder->nid = (0x402 + i) << 5 | NID_TYPE_NORMAL_FOLDER;
+        folder->parent_nid = top_nid;
+        folder->depth = 1;
+        if (i > 0 && config.depth > 1 && rng_percent(50)) {
+            Folder* parent = &folders[rng_below(i)];
+            if (parent->depth < config.depth) {
+                folder->parent_nid = parent->nid;
+                folder->depth = parent->depth + 1;
+                parent->has_children = 1;
+            }
+        }
+        const char* word = WORDS[FIRST_TOPIC_WORD + rng_below(N_ASCII_WORDS - FIRST_TOPIC_WORD)];
+        snprintf(folder->name, sizeof(folder->name), "%c%s %u", word[0] - 'a' + 'A', word + 1, i + 1);
+    }
+
+    uint32_t first_message_index = 0x10001;
+    for (unsigned i = 0; i < config.n_items; i++) {
+        Folder* folder = &folders[rng_below(config.n_folders)];
+        folder->n_messages++;
+        uint32_t nid = (first_message_index + i) << 5 | NID_TYPE_NORMAL_MESSAGE;
+        // Only draw when asked to, so that mail-only files stay the same
+        unsigned kind = config.contact_percent + config.appointment_percent ? rng_below(100) : 100;
+        if (kind < config.contact_percent) {
+            write_contact(nid, folder);
+        } else if (kind < config.contact_percent + config.appointment_percent) {
+            write_appointment(nid, folder);
+        } else {
+            write_message(nid, folder);
+        }
+    }
+
+    for (unsigned i = 0; i < config.n_folders; i++) write_folder(&folders[i]);
+    Folder top = { top_nid, NID_ROOT_FOLDER, 0, 0, 1, "Top of Personal Folders" };
+    write_folder(&top);
+    Folder root = { NID_ROOT_FOLDER, NID_ROOT_FOLDER, 0, 0, 1, "Root" };
+    write_folder(&root);
+    write_message_store(top_nid);
+
+    PageRef nbt = write_nbt();
+    PageRef bbt = write_btree(PTYPE_BBT, bbt_entries.data, n_bbt_entries, config.unicode ? 24 : 12);
+    write_header(nbt, bbt, 0x402 + config.n_folders, first_message_index + config.n_items);
+
+    if (fclose(out) != 0) die("error writing %s", config.output_path);
+    free(folders);
+    free(nodes);
+    free(bbt_entries.data);
+    return 0;
+}
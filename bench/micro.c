@@ -0,0 +1,482 @@
+/*
+ * Microbenchmarks for extract-pst's MIME rendering primitives.
+ *
+ * Usage: bench/micro [NAME...]
+ *
+ * Links src/*.c (built with -DEXTRACT_PST_NO_MAIN) and times each primitive
+ * on the messages in bench/samples/. Prints one line of JSON per benchmark:
+ *
+ *   {"bench":"header_strip_field","nsPerOp":...,"bytesPerOp":...,"bytesPerSecond":...}
+ *
+ * bytesPerOp is the size of the input one call processes. Each benchmark runs
+ * in batches for BENCH_SECONDS (default 0.5) and reports its fastest batch.
+ * Benchmarks that mutate their input include the copy that restores it; the
+ * "memcpy" benchmark measures that copy on its own.
+ *
+ * Rendered output goes to /dev/null; results go to stdout.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// libpst includes:
+#include <libpst.h>
+#include <lzfu.h>
+
+#include "extract-pst.h"
+#include "output.h"
+#include "stats.h"
+#include "rtfcomp.h"
+
+#define MIN_BATCH_NS 10000000 /* 10ms */
+#define ATTACHMENT_SIZE (1024 * 1024)
+#define N_NESTED 16
+#define NESTED_PREAMBLE "Content-Type: multipart/mixed;\n\tboundary=\"_004_outer_\"\nMIME-Version: 1.0\n\n"
+
+typedef struct {
+    const char* name;
+    void      (*op)(void);
+    size_t*     bytes_per_op;
+} Bench;
+
+typedef struct {
+    char*  data;
+    size_t len;
+} Sample;
+
+static Sample headers_lf;      // as index_embedded_headers and header_* see them
+static Sample headers_crlf;    // as Outlook stores them, before removeCR
+static Sample nested_headers;  // the MIME headers of N_NESTED embedded messages
+static Sample html;
+static Sample rtf;
+static Sample rtf_compressed;
+static Sample attachment;
+static Sample filenames;       // '\0'-separated
+static size_t n_filenames;
+static char*  scratch;
+static pst_item         contact_item;   // a filled-in business card
+static pst_item_contact contact;
+static size_t           contact_bytes;  // of its strings
+static pst_item         appointment_item;
+static pst_item_appointment appointment;
+static size_t           appointment_bytes;
+
+static volatile uintptr_t sink;
+
+
+static void
+fail(const char* message, const char* detail)
+{
+    fprintf(stderr, "micro: %s%s%s\n", message, detail ? ": " : "", detail ? detail : "");
+    exit(1);
+}
+
+
+static Sample
+read_sample(const char* dir, const char* name)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+    FILE* f = fopen(path, "rb");
+    if (!f) fail("could not open sample", path);
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    Sample sample;
+    sample.data = malloc_or_die(len + 1);
+    sample.len = fread(sample.data, 1, len, f);
+    sample.data[sample.len] = '\0';
+    fclose(f);
+    return sample;
+}
+
+
+static Sample
+with_crlf(Sample lf)
+{
+    Sample crlf;
+    crlf.data = malloc_or_die(lf.len * 2 + 1);
+    crlf.len = 0;
+    for (size_t i = 0; i < lf.len; i++) {
+        if (lf.data[i] == '\n') crlf.data[crlf.len++] = '\r';
+        crlf.data[crlf.len++] = lf.data[i];
+    }
+    crlf.data[crlf.len] = '\0';
+    return crlf;
+}
+
+
+static Sample
+concat(const char* prefix, Sample sample)
+{
+    Sample result;
+    size_t prefix_len = strlen(prefix);
+    result.len = prefix_len + sample.len;
+    result.data = malloc_or_die(result.len + 1);
+    memcpy(result.data, prefix, prefix_len);
+    memcpy(result.data + prefix_len, sample.data, sample.len + 1);
+    return result;
+}
+
+
+static void
+load_samples(const char* dir)
+{
+    headers_lf = read_sample(dir, "headers.txt");
+    headers_crlf = with_crlf(headers_lf);
+    // An email with N_NESTED forwarded messages: each one's headers are
+    // the block after a "message/rfc822" block.
+    Sample part = concat(
+        "--_004_outer_\nContent-Type: message/rfc822\nContent-Disposition: attachment\n\n",
+        headers_lf
+    );
+    nested_headers.len = 0;
+    nested_headers.data = malloc_or_die(strlen(NESTED_PREAMBLE) + N_NESTED * part.len + 1);
+    strcpy(nested_headers.data, NESTED_PREAMBLE);
+    nested_headers.len = strlen(NESTED_PREAMBLE);
+    for (int i = 0; i < N_NESTED; i++) {
+        memcpy(nested_headers.data + nested_headers.len, part.data, part.len + 1);
+        nested_headers.len += part.len;
+    }
+    free(part.data);
+    html = read_sample(dir, "body.html");
+    rtf = read_sample(dir, "body.rtf");
+
+    rtf_compressed.data = (char*) rtfcomp_compress((unsigned char*) rtf.data, rtf.len, &rtf_compressed.len);
+    if (!rtf_compressed.data) fail("out of memory", NULL);
+
+    // Attachments are mostly already-compressed formats: their bytes look random.
+    attachment.len = ATTACHMENT_SIZE;
+    attachment.data = malloc_or_die(attachment.len);
+    uint64_t x = 0x9e3779b97f4a7c15ULL;
+    for (size_t i = 0; i < attachment.len; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        attachment.data[i] = x;
+    }
+
+    static const char FILENAMES[] =
+        "Q1 budget (revised).xlsx\0"
+        "Steering committee \"final\" minutes.docx\0"
+        "scan_2017-03-14_160205.pdf\0"
+        "C:\\Users\\dana\\Desktop\\forecast.xlsx\0"
+        "image001.png\0";
+    filenames.data = (char*) FILENAMES;
+    filenames.len = 0;
+    for (const char* s = FILENAMES; *s; s += strlen(s) + 1) {
+        filenames.len += strlen(s);
+        n_filenames++;
+    }
+
+    size_t scratch_len = headers_crlf.len;
+    if (nested_headers.len > scratch_len) scratch_len = nested_headers.len;
+    scratch = malloc_or_die(scratch_len + 1);
+}
+
+
+static size_t
+set_string(pst_string* s, const char* value)
+{
+    s->str = (char*) value;
+    s->is_utf8 = 1;
+    return strlen(value);
+}
+
+
+static FILETIME*
+filetime(uint64_t ticks)
+{
+    FILETIME* ft = malloc_or_die(sizeof(FILETIME));
+    ft->dwLowDateTime = (uint32_t) ticks;
+    ft->dwHighDateTime = (uint32_t) (ticks >> 32);
+    return ft;
+}
+
+
+/**
+ * A contact and an appointment, with the fields Outlook usually fills in
+ * and a few characters that need escaping.
+ */
+static void
+load_vitems(void)
+{
+    size_t n = 0;
+    n += set_string(&contact.fullname,          "Dana Whitfield-Okafor");
+    n += set_string(&contact.surname,           "Whitfield-Okafor");
+    n += set_string(&contact.first_name,        "Dana");
+    n += set_string(&contact.address1,          "dana.whitfield@example.com");
+    n += set_string(&contact.business_street,   "1200 Harbour Rd., Suite 400");
+    n += set_string(&contact.business_city,     "Vancouver");
+    n += set_string(&contact.business_state,    "BC");
+    n += set_string(&contact.business_postal_code, "V6B 1A1");
+    n += set_string(&contact.business_country,  "Canada");
+    n += set_string(&contact.business_address,  "1200 Harbour Rd., Suite 400\r\nVancouver, BC  V6B 1A1\r\nCanada");
+    n += set_string(&contact.business_phone,    "+1 (604) 555-0142");
+    n += set_string(&contact.business_fax,      "+1 (604) 555-0143");
+    n += set_string(&contact.mobile_phone,      "+1 (604) 555-0199");
+    n += set_string(&contact.job_title,         "Director, Regional Operations");
+    n += set_string(&contact.company_name,      "Northwind Logistics; Pacific Division");
+    n += set_string(&contact_item.body,         "Met at the March conference.\r\nPrefers email; call only if urgent.");
+    contact.birthday = filetime(121000000000000000ULL);
+    contact_item.contact = &contact;
+    contact_bytes = n;
+
+    n = 0;
+    n += set_string(&appointment_item.subject,  "Quarterly review: budget, staffing, and Q3 targets");
+    n += set_string(&appointment_item.body,     "Agenda:\r\n1. Budget\r\n2. Staffing; open roles\r\n3. Q3 targets\r\n");
+    n += set_string(&appointment.location,      "Boardroom 4B, Harbour Rd.");
+    appointment.start = filetime(131700000000000000ULL);
+    appointment.end = filetime(131700036000000000ULL);
+    appointment.showas = PST_FREEBUSY_BUSY;
+    appointment.label = PST_APP_LABEL_BUSINESS;
+    appointment.alarm = 1;
+    appointment.alarm_minutes = 15;
+    appointment_item.create_date = filetime(131690000000000000ULL);
+    appointment_item.modify_date = filetime(131695000000000000ULL);
+    appointment_item.appointment = &appointment;
+    appointment_item.block_id = 0x2044;
+    appointment_bytes = n;
+}
+
+
+/* ---- benchmarks ---- */
+
+static void
+bench_memcpy(void)
+{
+    memcpy(scratch, headers_crlf.data, headers_crlf.len + 1);
+    sink += scratch[0];
+}
+
+
+static void
+bench_removeCR(void)
+{
+    memcpy(scratch, headers_crlf.data, headers_crlf.len + 1);
+    removeCR(scratch);
+    sink += scratch[0];
+}
+
+
+static void
+bench_my_stristr(void)
+{
+    sink += (uintptr_t) my_stristr(headers_lf.data, "\nMessage-Id:");
+}
+
+
+static void
+bench_my_stristr_miss(void)
+{
+    sink += (uintptr_t) my_stristr(headers_lf.data, "\nX-Nonexistent:");
+}
+
+
+static void
+bench_header_has_field(void)
+{
+    // the checks write_normal_email makes
+    int flag = 0;
+    header_has_field(headers_lf.data, "\nFrom:",        &flag);
+    header_has_field(headers_lf.data, "\nTo:",          &flag);
+    header_has_field(headers_lf.data, "\nSubject:",     &flag);
+    header_has_field(headers_lf.data, "\nDate:",        &flag);
+    header_has_field(headers_lf.data, "\nCC:",          &flag);
+    header_has_field(headers_lf.data, "\nMessage-Id:",  &flag);
+    sink += flag;
+}
+
+
+static void
+bench_header_strip_field(void)
+{
+    // the fields write_normal_email strips
+    memcpy(scratch, headers_lf.data, headers_lf.len + 1);
+    header_strip_field(scratch, "\nMicrosoft Mail Internet Headers");
+    header_strip_field(scratch, "\nMIME-Version:");
+    header_strip_field(scratch, "\nContent-Type:");
+    header_strip_field(scratch, "\nContent-Transfer-Encoding:");
+    header_strip_field(scratch, "\nContent-class:");
+    header_strip_field(scratch, "\nX-MimeOLE:");
+    header_strip_field(scratch, "\nX-From_:");
+    sink += scratch[0];
+}
+
+
+static void
+bench_embedded_headers(void)
+{
+    memcpy(scratch, nested_headers.data, nested_headers.len + 1);
+    EmbeddedHeaders embedded = { NULL, 0, 0, NULL, 0 };
+    index_embedded_headers(&embedded, scratch);
+    for (int i = 0; i < N_NESTED; i++) {
+        sink += (uintptr_t) next_embedded_headers(&embedded);
+    }
+}
+
+
+static void
+bench_test_base64(void)
+{
+    sink += test_base64(html.data, html.len);
+}
+
+
+static void
+bench_quote_string(void)
+{
+    for (const char* s = filenames.data; *s; s += strlen(s) + 1) {
+        char* quoted = quote_string((char*) s);
+        sink += quoted[0];
+        free(quoted);
+    }
+}
+
+
+static void
+bench_write_pst_string_with_len(void)
+{
+    write_pst_string_with_len(html.data, html.len, "text/html", "utf-8", 1);
+}
+
+
+static void
+bench_out_base64(void)
+{
+    out_base64(attachment.data, attachment.len);
+}
+
+
+static void
+bench_write_vcard(void)
+{
+    write_vcard(&contact_item, &contact, NULL);
+}
+
+
+static void
+bench_write_appointment(void)
+{
+    write_appointment(&appointment_item);
+}
+
+
+static void
+bench_pst_lzfu_decompress(void)
+{
+    size_t size;
+    char* data = pst_lzfu_decompress(rtf_compressed.data, rtf_compressed.len, &size);
+    if (!data) fail("pst_lzfu_decompress failed", NULL);
+    sink += size;
+    free(data);
+}
+
+
+static const Bench BENCHES[] = {
+    { "memcpy",                     bench_memcpy,                    &headers_crlf.len },
+    { "removeCR",                   bench_removeCR,                  &headers_crlf.len },
+    { "my_stristr",                 bench_my_stristr,                &headers_lf.len },
+    { "my_stristr_miss",            bench_my_stristr_miss,           &headers_lf.len },
+    { "header_has_field",           bench_header_has_field,          &headers_lf.len },
+    { "header_strip_field",         bench_header_strip_field,        &headers_lf.len },
+    { "embedded_headers",           bench_embedded_headers,          &nested_headers.len },
+    { "test_base64",                bench_test_base64,               &html.len },
+    { "quote_string",               bench_quote_string,              &filenames.len },
+    { "write_pst_string_with_len",  bench_write_pst_string_with_len, &html.len },
+    { "out_base64",                 bench_out_base64,                &attachment.len },
+    { "write_vcard",                bench_write_vcard,               &contact_bytes },
+    { "write_appointment",          bench_write_appointment,         &appointment_bytes },
+    { "pst_lzfu_decompress",        bench_pst_lzfu_decompress,       &rtf.len },
+};
+#define N_BENCHES (sizeof(BENCHES) / sizeof(BENCHES[0]))
+
+
+/* ---- harness ---- */
+
+static uint64_t
+time_batch(const Bench* bench, uint64_t n_ops)
+{
+    uint64_t start = stats_now();
+    for (uint64_t i = 0; i < n_ops; i++) bench->op();
+    out_flush();
+    return stats_now() - start;
+}
+
+
+static void
+run(const Bench* bench, double seconds, FILE* report)
+{
+    uint64_t n_ops = 1;
+    uint64_t ns;
+    while ((ns = time_batch(bench, n_ops)) < MIN_BATCH_NS) {
+        n_ops *= 2;
+    }
+
+    double best = (double) ns / n_ops;
+    uint64_t deadline = stats_now() + (uint64_t) (seconds * 1e9);
+    while (stats_now() < deadline) {
+        double batch = (double) time_batch(bench, n_ops) / n_ops;
+        if (batch < best) best = batch;
+    }
+
+    size_t bytes = *bench->bytes_per_op;
+    fprintf(report, "{\"bench\":\"%s\",\"nsPerOp\":%.1f,\"bytesPerOp\":%zu,\"bytesPerSecond\":%.0f}\n",
+            bench->name, best, bytes, bytes / best * 1e9);
+    fflush(report);
+}
+
+
+static int
+selected(const char* name, int argc, char** argv)
+{
+    if (argc < 2) return 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], name) == 0) return 1;
+    }
+    return 0;
+}
+
+
+int
+main(int argc, char** argv)
+{
+    const char* seconds_s = getenv("BENCH_SECONDS");
+    double seconds = seconds_s ? atof(seconds_s) : 0.5;
+
+    char* self = strdup_or_die(argv[0]);
+    char samples[4096];
+    snprintf(samples, sizeof(samples), "%s/samples", dirname(self));
+    free(self);
+    load_samples(samples);
+    load_vitems();
+
+    mime_boundary = "MICRO-BENCH-BOUNDARY";
+
+    // out_*() write to STDOUT_FILENO. Point it at /dev/null and report on
+    // the real stdout.
+    int report_fd = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (report_fd < 0 || null_fd < 0 || dup2(null_fd, STDOUT_FILENO) < 0) {
+        fail("could not redirect stdout to /dev/null", NULL);
+    }
+    close(null_fd);
+    FILE* report = fdopen(report_fd, "w");
+    if (!report) fail("could not open report stream", NULL);
+
+    for (size_t i = 0; i < N_BENCHES; i++) {
+        if (selected(BENCHES[i].name, argc, argv)) run(&BENCHES[i], seconds, report);
+    }
+
+    fclose(report);
+    return 0;
+}
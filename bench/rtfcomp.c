@@ -0,0 +1,141 @@
+/*
+ * Compressed RTF (MS-OXRTFCP). See rtfcomp.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "rtfcomp.h"
+
+// MS-OXRTFCP 2.1.2.1. We only need its length: matches never reach into it.
+#define LZFU_PREFIX_LENGTH 207
+#define LZFU_DICT_SIZE 4096
+#define LZFU_MAX_MATCH 17
+#define LZFU_MIN_MATCH 3
+// keep a match's source from being overwritten while it is copied
+#define LZFU_MAX_DISTANCE (LZFU_DICT_SIZE - LZFU_MAX_MATCH)
+#define LZFU_HASH_SIZE 4096
+#define LZFU_CHAIN_LIMIT 32
+#define LZFU_HEADER_SIZE 16
+
+
+uint32_t
+crc32_ms(const unsigned char* data, size_t len)
+{
+    static uint32_t table[256];
+    if (!table[1]) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = c & 1 ? (c >> 1) ^ 0xedb88320 : c >> 1;
+            table[i] = c;
+        }
+    }
+
+    uint32_t c = 0;
+    for (size_t i = 0; i < len; i++) c = table[(c ^ data[i]) & 0xff] ^ (c >> 8);
+    return c;
+}
+
+
+static unsigned
+lzfu_hash(const unsigned char* p)
+{
+    return ((p[0] << 8) ^ (p[1] << 4) ^ p[2]) & (LZFU_HASH_SIZE - 1);
+}
+
+
+static void
+put_u32(unsigned char* p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+
+unsigned char*
+rtfcomp_compress(const unsigned char* in, size_t len, size_t* out_len)
+{
+    static int32_t head[LZFU_HASH_SIZE];
+    // worst case: every byte a literal, plus a control byte per 8 tokens and
+    // the end marker
+    unsigned char* out = malloc(LZFU_HEADER_SIZE + len + len / 8 + 4);
+    int32_t* prev = malloc((len + 1) * sizeof(int32_t));
+    if (!out || !prev) {
+        free(out);
+        free(prev);
+        return NULL;
+    }
+
+    size_t n = LZFU_HEADER_SIZE;
+    size_t pos = 0;
+    int done = 0;
+
+    for (int i = 0; i < LZFU_HASH_SIZE; i++) head[i] = -1;
+
+    while (!done) {
+        size_t control_at = n++;
+        unsigned char control = 0;
+
+        for (int bit = 0; bit < 8; bit++) {
+            uint16_t dict_pos = (LZFU_PREFIX_LENGTH + pos) % LZFU_DICT_SIZE;
+            if (pos >= len) {
+                // a reference to the write position marks the end
+                control |= 1 << bit;
+                out[n++] = dict_pos >> 4;
+                out[n++] = (dict_pos & 0xf) << 4;
+                done = 1;
+                break;
+            }
+
+            size_t best_len = 0, best_from = 0;
+            if (pos + LZFU_MIN_MATCH <= len) {
+                size_t max = len - pos < LZFU_MAX_MATCH ? len - pos : LZFU_MAX_MATCH;
+                int32_t candidate = head[lzfu_hash(in + pos)];
+                for (int chain = 0; candidate >= 0 && chain < LZFU_CHAIN_LIMIT; chain++) {
+                    if (pos - candidate > LZFU_MAX_DISTANCE) break;
+                    size_t m = 0;
+                    while (m < max && in[candidate + m] == in[pos + m]) m++;
+                    if (m > best_len) {
+                        best_len = m;
+                        best_from = candidate;
+                        if (m == max) break;
+                    }
+                    candidate = prev[candidate];
+                }
+            }
+
+            size_t advance = 1;
+            if (best_len >= LZFU_MIN_MATCH) {
+                uint16_t offset = (LZFU_PREFIX_LENGTH + best_from) % LZFU_DICT_SIZE;
+                uint16_t reference = (offset << 4) | (best_len - 2);
+                control |= 1 << bit;
+                out[n++] = reference >> 8;
+                out[n++] = reference;
+                advance = best_len;
+            } else {
+                out[n++] = in[pos];
+            }
+
+            for (size_t i = 0; i < advance; i++, pos++) {
+                if (pos + LZFU_MIN_MATCH <= len) {
+                    unsigned h = lzfu_hash(in + pos);
+                    prev[pos] = head[h];
+                    head[h] = pos;
+                }
+            }
+        }
+        out[control_at] = control;
+    }
+
+    size_t compressed = n - LZFU_HEADER_SIZE;
+    put_u32(out, compressed + 12);
+    put_u32(out + 4, len);
+    put_u32(out + 8, 0x75465a4c); // "LZFu"
+    put_u32(out + 12, crc32_ms(out + LZFU_HEADER_SIZE, compressed));
+    free(prev);
+
+    *out_len = n;
+    return out;
+}
@@ -0,0 +1,26 @@
+/*
+ * Compressed RTF (MS-OXRTFCP) and the CRC-32 it shares with MS-PST.
+ *
+ * gen-pst writes compressed RTF bodies with it; micro feeds them to
+ * pst_lzfu_decompress().
+ */
+
+#ifndef RTFCOMP_H
+#define RTFCOMP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * MS-PST 5.3: CRC-32 without the pre- and post-inversion. MS-OXRTFCP uses
+ * the same.
+ */
+uint32_t        crc32_ms(const unsigned char* data, size_t len);
+
+/**
+ * Returns a malloc()ed "LZFu" stream, header included, and sets *out_len.
+ * Returns NULL when out of memory.
+ */
+unsigned char*  rtfcomp_compress(const unsigned char* in, size_t len, size_t* out_len);
+
+#endif
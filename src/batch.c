@@ -0,0 +1,407 @@
+/*
+ * Batch mode. See batch.h.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "extract-pst.h"
+#include "options.h"
+#include "output.h"
+
+#define READ_CHUNK_SIZE (64 * 1024)
+#define IDLE_SLEEP_NS 5000000 /* 5ms */
+
+// Every input that finishes before the ones ahead of it waits in a temp
+// file. Cap how many, so disk use and open files stay bounded.
+#define MAX_PENDING_INPUTS 64
+
+// A part's "Content-Disposition: form-data; name=..." line is short. If
+// there's no blank line within this many bytes, the output is corrupt.
+#define MAX_PART_HEADER 1024
+
+typedef enum {
+    PART_DROP,
+    PART_PASS,
+    PART_PROGRESS,
+    PART_ERROR,
+} PartMode;
+
+typedef struct {
+    const char* path;
+    pid_t       pid;
+    int         fd;         // the child's stdout: an unlinked temp file
+    int         exited;
+    int         status;
+    uint64_t    offset;     // bytes of fd relayed so far
+} Job;
+
+typedef struct {
+    char*       data;
+    size_t      len;
+    size_t      cap;
+} Bytes;
+
+typedef struct {
+    Bytes       pending;        // read from the head job, not yet relayed
+    Bytes       body;           // the current part, for PART_PROGRESS and PART_ERROR
+    PartMode    mode;
+    int         closed;         // saw the closing delimiter
+    int         saw_done;
+    uint64_t    index_base;     // added to this input's part indices
+    uint64_t    n_indices;      // this input's highest part index + 1
+    uint64_t    processed_base; // items processed in earlier inputs
+    uint64_t    n_processed;    // ... and in this one, per its last progress part
+} Relay;
+
+static Job*     jobs;
+static size_t   n_jobs;
+static unsigned n_workers;      // jobs that may run at once
+static char*    delimiter;      // "\r\n--" mime_boundary
+static size_t   delimiter_len;
+
+
+static void
+bytes_append(Bytes* bytes, const char* data, size_t len)
+{
+    if (bytes->len + len > bytes->cap) {
+        size_t cap = bytes->cap ? bytes->cap : READ_CHUNK_SIZE;
+        while (cap < bytes->len + len) cap *= 2;
+        char* grown = realloc(bytes->data, cap);
+        if (!grown) die("out of memory while relaying batch output");
+        bytes->data = grown;
+        bytes->cap = cap;
+    }
+    memcpy(bytes->data + bytes->len, data, len);
+    bytes->len += len;
+}
+
+
+static void
+kill_jobs(void)
+{
+    for (size_t i = 0; i < n_jobs; i++) {
+        if (jobs[i].pid > 0 && !jobs[i].exited) kill(jobs[i].pid, SIGKILL);
+    }
+}
+
+
+static void
+fail_input(const Job* job, const char* message, size_t message_len)
+{
+    kill_jobs();
+    size_t len = strlen(job->path) + 2 + message_len + 1;
+    char* error = malloc_or_die(len);
+    snprintf(error, len, "%s: %.*s", job->path, (int) message_len, message);
+    die(error);
+}
+
+
+static int
+name_is(const char* name, size_t name_len, const char* expected)
+{
+    return name_len == strlen(expected) && memcmp(name, expected, name_len) == 0;
+}
+
+
+static void
+start_part(Relay* relay, const char* header, size_t header_len)
+{
+    static const char PREFIX[] = "Content-Disposition: form-data; name=";
+    const size_t prefix_len = sizeof(PREFIX) - 1;
+
+    relay->mode = PART_PASS;
+    if (header_len > prefix_len && memcmp(header, PREFIX, prefix_len) == 0) {
+        const char* name = header + prefix_len;
+        size_t name_len = header_len - prefix_len;
+
+        if (name_is(name, name_len, "progress")) {
+            relay->mode = PART_PROGRESS;
+            return;
+        }
+        if (name_is(name, name_len, "done")) {
+            relay->mode = PART_DROP;
+            relay->saw_done = 1;
+            return;
+        }
+        if (name_is(name, name_len, "error")) {
+            relay->mode = PART_ERROR;
+            return;
+        }
+
+        // "123.json" or "123.blob": renumber
+        const char* ext = name;
+        uint64_t index = 0;
+        while (ext < name + name_len && *ext >= '0' && *ext <= '9') {
+            index = index * 10 + (*ext++ - '0');
+        }
+        size_t ext_len = name + name_len - ext;
+        if (ext > name && (name_is(ext, ext_len, ".json") || name_is(ext, ext_len, ".blob"))) {
+            if (index + 1 > relay->n_indices) relay->n_indices = index + 1;
+            out_printf(
+                "%s\r\n%s%" PRIu64 "%.*s\r\n\r\n",
+                delimiter,
+                PREFIX,
+                relay->index_base + index,
+                (int) ext_len,
+                ext
+            );
+            return;
+        }
+    }
+
+    // anything else ("stats") passes through as is
+    out_write(delimiter, delimiter_len);
+    out_write("\r\n", 2);
+    out_write(header, header_len);
+    out_write("\r\n\r\n", 4);
+}
+
+
+static void
+part_body(Relay* relay, const char* data, size_t len)
+{
+    switch (relay->mode) {
+        case PART_DROP:
+            break;
+        case PART_PASS:
+            out_write(data, len);
+            break;
+        case PART_PROGRESS:
+        case PART_ERROR:
+            bytes_append(&relay->body, data, len);
+            break;
+    }
+}
+
+
+static void
+end_part(Relay* relay, const Job* job)
+{
+    if (relay->mode == PART_PROGRESS) {
+        uint64_t n_processed, n_total;
+        bytes_append(&relay->body, "", 1);
+        if (sscanf(relay->body.data, "{\"children\":{\"nProcessed\":%" SCNu64 ",\"nTotal\":%" SCNu64 "}}", &n_processed, &n_total) == 2) {
+            relay->n_processed = n_processed;
+            output_progress(relay->processed_base + n_processed, relay->processed_base + n_total);
+        }
+    } else if (relay->mode == PART_ERROR) {
+        fail_input(job, relay->body.len ? relay->body.data : "", relay->body.len);
+    }
+    relay->body.len = 0;
+    relay->mode = PART_DROP;
+}
+
+
+/**
+ * Relays every complete part boundary in relay->pending, and the part
+ * bodies between them. Keeps what might be the start of an incomplete
+ * boundary, unless at_eof.
+ */
+static void
+relay_parse(Relay* relay, const Job* job, int at_eof)
+{
+    char* data = relay->pending.data;
+    size_t len = relay->pending.len;
+    size_t pos = 0;
+
+    while (pos < len && !relay->closed) {
+        char* d = memmem(data + pos, len - pos, delimiter, delimiter_len);
+        if (!d) {
+            size_t keep = at_eof ? 0 : delimiter_len - 1;
+            size_t n = len - pos > keep ? len - pos - keep : 0;
+            part_body(relay, data + pos, n);
+            pos += n;
+            break;
+        }
+
+        part_body(relay, data + pos, d - (data + pos));
+        pos = d - data;
+
+        const char* after = d + delimiter_len;
+        size_t available = data + len - after;
+        if (available < 2) {
+            if (at_eof) fail_input(job, "output ended in a part boundary", strlen("output ended in a part boundary"));
+            break;
+        }
+        if (after[0] == '-' && after[1] == '-') {
+            end_part(relay, job);
+            relay->closed = 1;
+            pos = len;
+            break;
+        }
+        if (after[0] != '\r' || after[1] != '\n') {
+            // a nested message's boundary, "--BOUNDARY-1": body text
+            part_body(relay, d, 1);
+            pos += 1;
+            continue;
+        }
+
+        const char* header = after + 2;
+        char* header_end = memmem(header, data + len - header, "\r\n\r\n", 4);
+        if (!header_end) {
+            if (at_eof || (size_t) (data + len - header) > MAX_PART_HEADER) {
+                fail_input(job, "output has a malformed part header", strlen("output has a malformed part header"));
+            }
+            break;
+        }
+        end_part(relay, job);
+        start_part(relay, header, header_end - header);
+        pos = header_end + 4 - data;
+    }
+
+    if (relay->closed) pos = len; // nothing may follow the closing delimiter
+    memmove(data, data + pos, len - pos);
+    relay->pending.len = len - pos;
+}
+
+
+static void
+relay_finish(Relay* relay, const Job* job)
+{
+    relay_parse(relay, job, 1);
+
+    if (WIFSIGNALED(job->status)) {
+        char message[64];
+        snprintf(message, sizeof(message), "conversion was killed by signal %d", WTERMSIG(job->status));
+        fail_input(job, message, strlen(message));
+    }
+    if (!WIFEXITED(job->status) || WEXITSTATUS(job->status) != 0 || !relay->saw_done) {
+        fail_input(job, "conversion ended early", strlen("conversion ended early"));
+    }
+
+    relay->index_base += relay->n_indices;
+    relay->processed_base += relay->n_processed;
+    relay->n_indices = 0;
+    relay->n_processed = 0;
+    relay->mode = PART_DROP;
+    relay->closed = 0;
+    relay->saw_done = 0;
+    relay->pending.len = 0;
+}
+
+
+static void
+start_job(size_t i, BatchConvertFn convert)
+{
+    Job* job = &jobs[i];
+
+    char template[] = "extract-pst-batch-XXXXXX";
+    job->fd = mkstemp(template);
+    if (job->fd < 0) die("could not create a temp file for batch output");
+    unlink(template);
+
+    out_flush(); // or the child would write our buffered output, too
+    job->pid = fork();
+    if (job->pid < 0) die("could not start a batch worker");
+
+    if (job->pid == 0) {
+        // If the parent dies, nobody will read our output.
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        if (dup2(job->fd, STDOUT_FILENO) < 0) _exit(1);
+        // Our siblings share the CPUs and memory we planned with
+        options_share(n_workers);
+        out_init();
+        for (size_t j = 0; j <= i; j++) {
+            if (jobs[j].fd >= 0) close(jobs[j].fd);
+        }
+        convert(job->path, i);
+        // Tell the parent this input finished, as a one-PST run would.
+        output_done();
+        out_flush();
+        _exit(0);
+    }
+}
+
+
+static void
+reap_jobs(size_t* n_running)
+{
+    pid_t pid;
+    int status;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (size_t i = 0; i < n_jobs; i++) {
+            if (jobs[i].pid == pid) {
+                jobs[i].exited = 1;
+                jobs[i].status = status;
+                *n_running -= 1;
+            }
+        }
+    }
+}
+
+
+void
+batch_run(char* const* paths, size_t n_paths, unsigned max_jobs, BatchConvertFn convert)
+{
+    jobs = malloc_or_die(n_paths * sizeof(Job));
+    n_jobs = n_paths;
+    n_workers = n_paths < max_jobs ? n_paths : max_jobs;
+    for (size_t i = 0; i < n_paths; i++) {
+        jobs[i].path = paths[i];
+        jobs[i].pid = 0;
+        jobs[i].fd = -1;
+        jobs[i].exited = 0;
+        jobs[i].status = 0;
+        jobs[i].offset = 0;
+    }
+
+    delimiter_len = strlen("\r\n--") + strlen(mime_boundary);
+    delimiter = malloc_or_die(delimiter_len + 1);
+    snprintf(delimiter, delimiter_len + 1, "\r\n--%s", mime_boundary);
+
+    Relay relay;
+    memset(&relay, 0, sizeof(relay));
+    relay.mode = PART_DROP;
+    char* chunk = malloc_or_die(READ_CHUNK_SIZE);
+
+    size_t head = 0, n_started = 0, n_running = 0;
+    while (head < n_paths) {
+        while (n_started < n_paths && n_running < max_jobs && n_started - head < MAX_PENDING_INPUTS) {
+            start_job(n_started++, convert);
+            n_running++;
+        }
+
+        reap_jobs(&n_running);
+
+        // Check for exit before reading, so the last read sees all output.
+        Job* job = &jobs[head];
+        int exited = job->exited;
+        ssize_t n = pread(job->fd, chunk, READ_CHUNK_SIZE, job->offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            die("could not read batch output");
+        }
+        if (n > 0) {
+            job->offset += n;
+            bytes_append(&relay.pending, chunk, n);
+            relay_parse(&relay, job, 0);
+        } else if (exited) {
+            relay_finish(&relay, job);
+            close(job->fd);
+            job->fd = -1;
+            head++;
+        } else {
+            out_flush(); // don't sit on output while we wait
+            struct timespec idle = { 0, IDLE_SLEEP_NS };
+            nanosleep(&idle, NULL);
+        }
+    }
+
+    free(chunk);
+    free(relay.pending.data);
+    free(relay.body.data);
+    free(delimiter);
+    free(jobs);
+}
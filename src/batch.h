@@ -0,0 +1,30 @@
+/*
+ * Batch mode: converting several PSTs into one output stream.
+ *
+ * Each input is converted by a forked child that writes its parts, exactly
+ * as a one-PST run would, to an unlinked temp file. Up to max_jobs children
+ * run at once. The parent relays the children's parts to stdout in input
+ * order, as they are written:
+ *
+ * - "N.json" and "N.blob" become "M.json" and "M.blob", with M counting up
+ *   across all inputs;
+ * - "progress" counts items across all inputs converted so far;
+ * - "done" is dropped: the caller writes one after batch_run() returns;
+ * - "error" stops the batch with an error naming the input;
+ * - anything else ("stats") passes through unchanged.
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stddef.h>
+
+/**
+ * Converts one input in a child process, writing its parts through
+ * output.h. The child writes "done" after it returns.
+ */
+typedef void (*BatchConvertFn)(const char* path, size_t input_index);
+
+void      batch_run(char* const* paths, size_t n_paths, unsigned max_jobs, BatchConvertFn convert);
+
+#endif
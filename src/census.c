@@ -0,0 +1,116 @@
+/*
+ * The census. See census.h.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "census.h"
+#include "extract-pst.h"
+
+static pst_file*        census_file;
+static const DescTable* census_table;
+static pid_t            child_pid = -1;
+static int              child_fd = -1;  // the pipe's read end
+static int              counted;
+static size_t           n_counted;
+
+
+static size_t
+count_items_in_top_of_folders(pst_file* pstfile, const DescTable* table)
+{
+    size_t n = 0;
+    const DescEntry* top = &table->entries[0];
+
+    // No need to recurse: top-level folders count all children (right? TODO check)
+    for (uint32_t i = 0; i < top->n_children; i++) {
+        pst_desc_tree child;
+        desc_node(table, desc_child(table, top, i), &child);
+        pst_item* item = pst_parse_item(pstfile, &child, NULL);
+        if (item->folder && item->file_as.str && item->folder->item_count) {
+            n += item->folder->item_count;
+        }
+        pst_freeItem(item);
+    }
+
+    return n;
+}
+
+
+static void
+reap_child(void)
+{
+    close(child_fd);
+    child_fd = -1;
+    while (waitpid(child_pid, NULL, 0) < 0 && errno == EINTR);
+    child_pid = -1;
+}
+
+
+static void
+count_in_process(void)
+{
+    n_counted = count_items_in_top_of_folders(census_file, census_table);
+    counted = 1;
+}
+
+
+void
+census_begin(pst_file* pstfile, const DescTable* table, const char* path)
+{
+    census_file = pstfile;
+    census_table = table;
+    counted = 0;
+
+    int fds[2];
+    if (pipe(fds) != 0) {
+        count_in_process();
+        return;
+    }
+
+    child_pid = fork();
+    if (child_pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        count_in_process();
+        return;
+    }
+
+    if (child_pid == 0) {
+        // Don't hold stdout open for whoever reads it, if we die mid-run.
+        // And leave the inherited FILE* alone: even fclose() may seek it.
+        close(STDOUT_FILENO);
+        close(fds[0]);
+        FILE* fp = fopen(path, "rb");
+        if (!fp) _exit(1);
+        pstfile->fp = fp;
+        size_t n = count_items_in_top_of_folders(pstfile, table);
+        _exit(write(fds[1], &n, sizeof(n)) == sizeof(n) ? 0 : 1);
+    }
+
+    close(fds[1]);
+    child_fd = fds[0];
+}
+
+
+size_t
+census_end(void)
+{
+    if (counted) return n_counted;
+
+    size_t n;
+    ssize_t len;
+    while ((len = read(child_fd, &n, sizeof(n))) < 0 && errno == EINTR);
+    reap_child();
+    if (len == sizeof(n)) {
+        n_counted = n;
+        counted = 1;
+    } else {
+        // The child failed: its pipe closed without a count
+        count_in_process();
+    }
+    return n_counted;
+}
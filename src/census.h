@@ -0,0 +1,35 @@
+/*
+ * The census: how many items a PST has, for "progress" parts.
+ *
+ * Counting takes a parse of each top-level folder, and on a large PST those
+ * reads are scattered and cold. So census_begin() counts in a forked child,
+ * and we start on the first item right away. Its "progress" part waits for
+ * the count: then every part has the same count, whatever the timing. The
+ * child has everything libpst has loaded, but opens the PST again: the
+ * FILE* it inherits shares a file offset with ours. It writes the count to
+ * a pipe and exits.
+ *
+ * If the child can't be started or fails, we count in-process.
+ */
+
+#ifndef CENSUS_H
+#define CENSUS_H
+
+#include <stddef.h>
+
+#include <libpst.h>
+
+#include "desc.h"
+
+/**
+ * Starts counting the items in table's top-level folders. path is the PST
+ * pstfile was opened from.
+ */
+void      census_begin(pst_file* pstfile, const DescTable* table, const char* path);
+
+/**
+ * Waits for the count and returns it.
+ */
+size_t    census_end(void);
+
+#endif
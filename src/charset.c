@@ -0,0 +1,485 @@
+/*
+ * Conversion of item strings to UTF-8. See charset.h.
+ */
+
+#include <errno.h>
+#include <iconv.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <libpst.h>
+
+#include "extract-pst.h"
+#include "charset.h"
+#include "itemarena.h"
+#include "stats.h"
+
+// max size of the charset name pst_default_charset() writes
+#define CHARSET_BUFFER_SIZE 30
+
+// number of iconv descriptors we keep open. PSTs rarely mix more than two or
+// three charsets; past this limit we open and close a descriptor per string.
+#define N_CACHED_ICONVS 8
+
+typedef struct {
+    char    charset[64];
+    iconv_t cd;
+} CachedIconv;
+
+static CachedIconv cached_iconvs[N_CACHED_ICONVS];
+static size_t      n_cached_iconvs = 0;
+
+/*
+ * Bytes 0x80-0xFF of the Windows code pages, as Unicode code points. 0 means
+ * the code page leaves the byte undefined: iconv rejects those, so we hand
+ * such strings to iconv and let it fail the same way libpst's would.
+ *
+ * windows-1255 and windows-1258 are missing on purpose: glibc's iconv
+ * composes their combining marks, which a byte-by-byte table cannot do.
+ */
+static const int WINDOWS_CODEPAGES[] = { 1250, 1251, 1252, 1253, 1254, 1256, 1257 };
+
+static const uint16_t WINDOWS_CODEPAGE_TABLES[][128] = {
+    { // windows-1250
+        0x20AC, 0x0000, 0x201A, 0x0000, 0x201E, 0x2026, 0x2020, 0x2021,
+        0x0000, 0x2030, 0x0160, 0x2039, 0x015A, 0x0164, 0x017D, 0x0179,
+        0x0000, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+        0x0000, 0x2122, 0x0161, 0x203A, 0x015B, 0x0165, 0x017E, 0x017A,
+        0x00A0, 0x02C7, 0x02D8, 0x0141, 0x00A4, 0x0104, 0x00A6, 0x00A7,
+        0x00A8, 0x00A9, 0x015E, 0x00AB, 0x00AC, 0x00AD, 0x00AE, 0x017B,
+        0x00B0, 0x00B1, 0x02DB, 0x0142, 0x00B4, 0x00B5, 0x00B6, 0x00B7,
+        0x00B8, 0x0105, 0x015F, 0x00BB, 0x013D, 0x02DD, 0x013E, 0x017C,
+        0x0154, 0x00C1, 0x00C2, 0x0102, 0x00C4, 0x0139, 0x0106, 0x00C7,
+        0x010C, 0x00C9, 0x0118, 0x00CB, 0x011A, 0x00CD, 0x00CE, 0x010E,
+        0x0110, 0x0143, 0x0147, 0x00D3, 0x00D4, 0x0150, 0x00D6, 0x00D7,
+        0x0158, 0x016E, 0x00DA, 0x0170, 0x00DC, 0x00DD, 0x0162, 0x00DF,
+        0x0155, 0x00E1, 0x00E2, 0x0103, 0x00E4, 0x013A, 0x0107, 0x00E7,
+        0x010D, 0x00E9, 0x0119, 0x00EB, 0x011B, 0x00ED, 0x00EE, 0x010F,
+        0x0111, 0x0144, 0x0148, 0x00F3, 0x00F4, 0x0151, 0x00F6, 0x00F7,
+        0x0159, 0x016F, 0x00FA, 0x0171, 0x00FC, 0x00FD, 0x0163, 0x02D9,
+    },
+    { // windows-1251
+        0x0402, 0x0403, 0x201A, 0x0453, 0x201E, 0x2026, 0x2020, 0x2021,
+        0x20AC, 0x2030, 0x0409, 0x2039, 0x040A, 0x040C, 0x040B, 0x040F,
+        0x0452, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+        0x0000, 0x2122, 0x0459, 0x203A, 0x045A, 0x045C, 0x045B, 0x045F,
+        0x00A0, 0x040E, 0x045E, 0x0408, 0x00A4, 0x0490, 0x00A6, 0x00A7,
+        0x0401, 0x00A9, 0x0404, 0x00AB, 0x00AC, 0x00AD, 0x00AE, 0x0407,
+        0x00B0, 0x00B1, 0x0406, 0x0456, 0x0491, 0x00B5, 0x00B6, 0x00B7,
+        0x0451, 0x2116, 0x0454, 0x00BB, 0x0458, 0x0405, 0x0455, 0x0457,
+        0x0410, 0x0411, 0x0412, 0x0413, 0x0414, 0x0415, 0x0416, 0x0417,
+        0x0418, 0x0419, 0x041A, 0x041B, 0x041C, 0x041D, 0x041E, 0x041F,
+        0x0420, 0x0421, 0x0422, 0x0423, 0x0424, 0x0425, 0x0426, 0x0427,
+        0x0428, 0x0429, 0x042A, 0x042B, 0x042C, 0x042D, 0x042E, 0x042F,
+        0x0430, 0x0431, 0x0432, 0x0433, 0x0434, 0x0435, 0x0436, 0x0437,
+        0x0438, 0x0439, 0x043A, 0x043B, 0x043C, 0x043D, 0x043E, 0x043F,
+        0x0440, 0x0441, 0x0442, 0x0443, 0x0444, 0x0445, 0x0446, 0x0447,
+        0x0448, 0x0449, 0x044A, 0x044B, 0x044C, 0x044D, 0x044E, 0x044F,
+    },
+    { // windows-1252
+        0x20AC, 0x0000, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021,
+        0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0x0000, 0x017D, 0x0000,
+        0x0000, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+        0x02DC, 0x2122, 0x0161, 0x203A, 0x0153, 0x0000, 0x017E, 0x0178,
+        0x00A0, 0x00A1, 0x00A2, 0x00A3, 0x00A4, 0x00A5, 0x00A6, 0x00A7,
+        0x00A8, 0x00A9, 0x00AA, 0x00AB, 0x00AC, 0x00AD, 0x00AE, 0x00AF,
+        0x00B0, 0x00B1, 0x00B2, 0x00B3, 0x00B4, 0x00B5, 0x00B6, 0x00B7,
+        0x00B8, 0x00B9, 0x00BA, 0x00BB, 0x00BC, 0x00BD, 0x00BE, 0x00BF,
+        0x00C0, 0x00C1, 0x00C2, 0x00C3, 0x00C4, 0x00C5, 0x00C6, 0x00C7,
+        0x00C8, 0x00C9, 0x00CA, 0x00CB, 0x00CC, 0x00CD, 0x00CE, 0x00CF,
+        0x00D0, 0x00D1, 0x00D2, 0x00D3, 0x00D4, 0x00D5, 0x00D6, 0x00D7,
+        0x00D8, 0x00D9, 0x00DA, 0x00DB, 0x00DC, 0x00DD, 0x00DE, 0x00DF,
+        0x00E0, 0x00E1, 0x00E2, 0x00E3, 0x00E4, 0x00E5, 0x00E6, 0x00E7,
+        0x00E8, 0x00E9, 0x00EA, 0x00EB, 0x00EC, 0x00ED, 0x00EE, 0x00EF,
+        0x00F0, 0x00F1, 0x00F2, 0x00F3, 0x00F4, 0x00F5, 0x00F6, 0x00F7,
+        0x00F8, 0x00F9, 0x00FA, 0x00FB, 0x00FC, 0x00FD, 0x00FE, 0x00FF,
+    },
+    { // windows-1253
+        0x20AC, 0x0000, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021,
+        0x0000, 0x2030, 0x0000, 0x2039, 0x0000, 0x0000, 0x0000, 0x0000,
+        0x0000, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+        0x0000, 0x2122, 0x0000, 0x203A, 0x0000, 0x0000, 0x0000, 0x0000,
+        0x00A0, 0x0385, 0x0386, 0x00A3, 0x00A4, 0x00A5, 0x00A6, 0x00A7,
+        0x00A8, 0x00A9, 0x0000, 0x00AB, 0x00AC, 0x00AD, 0x00AE, 0x2015,
+        0x00B0, 0x00B1, 0x00B2, 0x00B3, 0x0384, 0x00B5, 0x00B6, 0x00B7,
+        0x0388, 0x0389, 0x038A, 0x00BB, 0x038C, 0x00BD, 0x038E, 0x038F,
+        0x0390, 0x0391, 0x0392, 0x0393, 0x0394, 0x0395, 0x0396, 0x0397,
+        0x0398, 0x0399, 0x039A, 0x039B, 0x039C, 0x039D, 0x039E, 0x039F,
+        0x03A0, 0x03A1, 0x0000, 0x03A3, 0x03A4, 0x03A5, 0x03A6, 0x03A7,
+        0x03A8, 0x03A9, 0x03AA, 0x03AB, 0x03AC, 0x03AD, 0x03AE, 0x03AF,
+        0x03B0, 0x03B1, 0x03B2, 0x03B3, 0x03B4, 0x03B5, 0x03B6, 0x03B7,
+        0x03B8, 0x03B9, 0x03BA, 0x03BB, 0x03BC, 0x03BD, 0x03BE, 0x03BF,
+        0x03C0, 0x03C1, 0x03C2, 0x03C3, 0x03C4, 0x03C5, 0x03C6, 0x03C7,
+        0x03C8, 0x03C9, 0x03CA, 0x03CB, 0x03CC, 0x03CD, 0x03CE, 0x0000,
+    },
+    { // windows-1254
+        0x20AC, 0x0000, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021,
+        0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0x0000, 0x0000, 0x0000,
+        0x0000, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+        0x02DC, 0x2122, 0x0161, 0x203A, 0x0153, 0x0000, 0x0000, 0x0178,
+        0x00A0, 0x00A1, 0x00A2, 0x00A3, 0x00A4, 0x00A5, 0x00A6, 0x00A7,
+        0x00A8, 0x00A9, 0x00AA, 0x00AB, 0x00AC, 0x00AD, 0x00AE, 0x00AF,
+        0x00B0, 0x00B1, 0x00B2, 0x00B3, 0x00B4, 0x00B5, 0x00B6, 0x00B7,
+        0x00B8, 0x00B9, 0x00BA, 0x00BB, 0x00BC, 0x00BD, 0x00BE, 0x00BF,
+        0x00C0, 0x00C1, 0x00C2, 0x00C3, 0x00C4, 0x00C5, 0x00C6, 0x00C7,
+        0x00C8, 0x00C9, 0x00CA, 0x00CB, 0x00CC, 0x00CD, 0x00CE, 0x00CF,
+        0x011E, 0x00D1, 0x00D2, 0x00D3, 0x00D4, 0x00D5, 0x00D6, 0x00D7,
+        0x00D8, 0x00D9, 0x00DA, 0x00DB, 0x00DC, 0x0130, 0x015E, 0x00DF,
+        0x00E0, 0x00E1, 0x00E2, 0x00E3, 0x00E4, 0x00E5, 0x00E6, 0x00E7,
+        0x00E8, 0x00E9, 0x00EA, 0x00EB, 0x00EC, 0x00ED, 0x00EE, 0x00EF,
+        0x011F, 0x00F1, 0x00F2, 0x00F3, 0x00F4, 0x00F5, 0x00F6, 0x00F7,
+        0x00F8, 0x00F9, 0x00FA, 0x00FB, 0x00FC, 0x0131, 0x015F, 0x00FF,
+    },
+    { // windows-1256
+        0x20AC, 0x067E, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021,
+        0x02C6, 0x2030, 0x0679, 0x2039, 0x0152, 0x0686, 0x0698, 0x0688,
+        0x06AF, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+        0x06A9, 0x2122, 0x0691, 0x203A, 0x0153, 0x200C, 0x200D, 0x06BA,
+        0x00A0, 0x060C, 0x00A2, 0x00A3, 0x00A4, 0x00A5, 0x00A6, 0x00A7,
+        0x00A8, 0x00A9, 0x06BE, 0x00AB, 0x00AC, 0x00AD, 0x00AE, 0x00AF,
+        0x00B0, 0x00B1, 0x00B2, 0x00B3, 0x00B4, 0x00B5, 0x00B6, 0x00B7,
+        0x00B8, 0x00B9, 0x061B, 0x00BB, 0x00BC, 0x00BD, 0x00BE, 0x061F,
+        0x06C1, 0x0621, 0x0622, 0x0623, 0x0624, 0x0625, 0x0626, 0x0627,
+        0x0628, 0x0629, 0x062A, 0x062B, 0x062C, 0x062D, 0x062E, 0x062F,
+        0x0630, 0x0631, 0x0632, 0x0633, 0x0634, 0x0635, 0x0636, 0x00D7,
+        0x0637, 0x0638, 0x0639, 0x063A, 0x0640, 0x0641, 0x0642, 0x0643,
+        0x00E0, 0x0644, 0x00E2, 0x0645, 0x0646, 0x0647, 0x0648, 0x00E7,
+        0x00E8, 0x00E9, 0x00EA, 0x00EB, 0x0649, 0x064A, 0x00EE, 0x00EF,
+        0x064B, 0x064C, 0x064D, 0x064E, 0x00F4, 0x064F, 0x0650, 0x00F7,
+        0x0651, 0x00F9, 0x0652, 0x00FB, 0x00FC, 0x200E, 0x200F, 0x06D2,
+    },
+    { // windows-1257
+        0x20AC, 0x0000, 0x201A, 0x0000, 0x201E, 0x2026, 0x2020, 0x2021,
+        0x0000, 0x2030, 0x0000, 0x2039, 0x0000, 0x00A8, 0x02C7, 0x00B8,
+        0x0000, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+        0x0000, 0x2122, 0x0000, 0x203A, 0x0000, 0x00AF, 0x02DB, 0x0000,
+        0x00A0, 0x0000, 0x00A2, 0x00A3, 0x00A4, 0x0000, 0x00A6, 0x00A7,
+        0x00D8, 0x00A9, 0x0156, 0x00AB, 0x00AC, 0x00AD, 0x00AE, 0x00C6,
+        0x00B0, 0x00B1, 0x00B2, 0x00B3, 0x00B4, 0x00B5, 0x00B6, 0x00B7,
+        0x00F8, 0x00B9, 0x0157, 0x00BB, 0x00BC, 0x00BD, 0x00BE, 0x00E6,
+        0x0104, 0x012E, 0x0100, 0x0106, 0x00C4, 0x00C5, 0x0118, 0x0112,
+        0x010C, 0x00C9, 0x0179, 0x0116, 0x0122, 0x0136, 0x012A, 0x013B,
+        0x0160, 0x0143, 0x0145, 0x00D3, 0x014C, 0x00D5, 0x00D6, 0x00D7,
+        0x0172, 0x0141, 0x015A, 0x016A, 0x00DC, 0x017B, 0x017D, 0x00DF,
+        0x0105, 0x012F, 0x0101, 0x0107, 0x00E4, 0x00E5, 0x0119, 0x0113,
+        0x010D, 0x00E9, 0x017A, 0x0117, 0x0123, 0x0137, 0x012B, 0x013C,
+        0x0161, 0x0144, 0x0146, 0x00F3, 0x014D, 0x00F5, 0x00F6, 0x00F7,
+        0x0173, 0x0142, 0x015B, 0x016B, 0x00FC, 0x017C, 0x017E, 0x02D9,
+    },
+};
+
+static const char* ASCII_COMPATIBLE_CHARSET_PREFIXES[] = {
+    "windows-",
+    "cp125",
+    "iso-8859-",
+    "us-ascii",
+    "ascii",
+    "latin",
+    "koi8-",
+    "gb2312",
+    "gbk",
+    "big5",
+    "euc-",
+};
+
+
+int
+string_is_ascii(const char* s, size_t* len)
+{
+    const unsigned char* p = (const unsigned char*) s;
+    unsigned char high = 0;
+
+    // Step to an aligned address first: aligned loads never cross into a page
+    // past the end of the string.
+    while (((uintptr_t) p & 15) != 0) {
+        if (*p == '\0') {
+            *len = p - (const unsigned char*) s;
+            return !(high & 0x80);
+        }
+        high |= *p++;
+    }
+    if (high & 0x80) {
+        *len = (p - (const unsigned char*) s) + strlen((const char*) p);
+        return 0;
+    }
+
+#ifdef __SSE2__
+    for (;; p += 16) {
+        __m128i v = _mm_load_si128((const __m128i*) p);
+        int nul = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128()));
+        int non_ascii = _mm_movemask_epi8(v);
+        if (nul) {
+            int n = __builtin_ctz(nul);
+            *len = (p - (const unsigned char*) s) + n;
+            return (non_ascii & ((1 << n) - 1)) == 0;
+        }
+        if (non_ascii) {
+            *len = (p - (const unsigned char*) s) + strlen((const char*) p);
+            return 0;
+        }
+    }
+#else
+    for (;; p += sizeof(uint64_t)) {
+        uint64_t w = *(const uint64_t*) p;
+        uint64_t nul = (w - 0x0101010101010101ull) & ~w & 0x8080808080808080ull;
+        if (nul) {
+            size_t n = strlen((const char*) p);
+            *len = (p - (const unsigned char*) s) + n;
+            while (n--) {
+                if (*p++ & 0x80) return 0;
+            }
+            return 1;
+        }
+        if (w & 0x8080808080808080ull) {
+            *len = (p - (const unsigned char*) s) + strlen((const char*) p);
+            return 0;
+        }
+    }
+#endif
+}
+
+
+static int
+charset_is_ascii_compatible(const char* charset)
+{
+    for (size_t i = 0; i < sizeof(ASCII_COMPATIBLE_CHARSET_PREFIXES) / sizeof(ASCII_COMPATIBLE_CHARSET_PREFIXES[0]); i++) {
+        const char* prefix = ASCII_COMPATIBLE_CHARSET_PREFIXES[i];
+        if (strncasecmp(charset, prefix, strlen(prefix)) == 0) return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * Finds the table for the given charset.
+ *
+ * Returns 1 and sets *table if we can decode the charset without iconv.
+ * iso-8859-1 maps bytes straight to code points, so its *table is NULL.
+ */
+static int
+find_codepage_table(const char* charset, const uint16_t** table)
+{
+    if (strcasecmp(charset, "iso-8859-1") == 0) {
+        *table = NULL;
+        return 1;
+    }
+
+    int codepage;
+    if (strncasecmp(charset, "windows-", 8) == 0) {
+        codepage = atoi(charset + 8);
+    } else if (strncasecmp(charset, "cp", 2) == 0) {
+        codepage = atoi(charset + 2);
+    } else {
+        return 0;
+    }
+
+    for (size_t i = 0; i < sizeof(WINDOWS_CODEPAGES) / sizeof(WINDOWS_CODEPAGES[0]); i++) {
+        if (WINDOWS_CODEPAGES[i] == codepage) {
+            *table = WINDOWS_CODEPAGE_TABLES[i];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * Replaces str with its UTF-8 decoding through table.
+ *
+ * Returns 0 without touching str if a byte is undefined in the code page.
+ */
+static int
+decode_with_table(const uint16_t* table, pst_string* str, size_t len)
+{
+    const unsigned char* in = (const unsigned char*) str->str;
+    size_t out_len = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        unsigned int c = in[i];
+        if (c < 0x80) {
+            out_len += 1;
+        } else {
+            unsigned int u = table ? table[c - 0x80] : c;
+            if (u == 0) return 0;
+            out_len += u < 0x800 ? 2 : 3;
+        }
+    }
+
+    char* out = item_arena_alloc(out_len + 1);
+    char* o = out;
+    for (size_t i = 0; i < len; i++) {
+        unsigned int c = in[i];
+        if (c < 0x80) {
+            *o++ = c;
+        } else {
+            unsigned int u = table ? table[c - 0x80] : c;
+            if (u < 0x800) {
+                *o++ = 0xC0 | (u >> 6);
+                *o++ = 0x80 | (u & 0x3F);
+            } else {
+                *o++ = 0xE0 | (u >> 12);
+                *o++ = 0x80 | ((u >> 6) & 0x3F);
+                *o++ = 0x80 | (u & 0x3F);
+            }
+        }
+    }
+    *o = '\0';
+
+    item_arena_set_string(str, out);
+    str->is_utf8 = 1;
+    return 1;
+}
+
+
+/**
+ * Returns an iconv descriptor converting charset to UTF-8, or (iconv_t) -1.
+ *
+ * Sets *cached to 0 if the caller must iconv_close() the result.
+ */
+static iconv_t
+open_iconv(const char* charset, int* cached)
+{
+    for (size_t i = 0; i < n_cached_iconvs; i++) {
+        if (strcasecmp(cached_iconvs[i].charset, charset) == 0) {
+            *cached = 1;
+            return cached_iconvs[i].cd;
+        }
+    }
+
+    iconv_t cd = iconv_open("utf-8", charset);
+    if (n_cached_iconvs < N_CACHED_ICONVS && strlen(charset) < sizeof(cached_iconvs[0].charset)) {
+        // cache failures too, so we don't retry iconv_open() on every string
+        strcpy(cached_iconvs[n_cached_iconvs].charset, charset);
+        cached_iconvs[n_cached_iconvs].cd = cd;
+        n_cached_iconvs += 1;
+        *cached = 1;
+    } else {
+        *cached = 0;
+    }
+    return cd;
+}
+
+
+/**
+ * Replaces str with its UTF-8 conversion through iconv.
+ *
+ * Returns 0 without touching str if the conversion fails. As in libpst's
+ * pst_vb_8bit2utf8(), that includes a conversion iconv() made with
+ * irreversible substitutions (a positive result), so such strings stay
+ * as they are, as libpst would leave them.
+ */
+static int
+decode_with_iconv(const char* charset, pst_string* str, size_t len)
+{
+    int cached;
+    iconv_t cd = open_iconv(charset, &cached);
+    if (cd == (iconv_t) -1) {
+        DEBUG_WARN(("Failed to open iconv for %s\n", charset));
+        return 0;
+    }
+    iconv(cd, NULL, NULL, NULL, NULL); // reset shift state left by the last string
+
+    // iconv() can't tell us the output size up front: convert into a
+    // buffer we keep for the run, then copy into the item arena
+    static char* out = NULL;
+    static size_t capacity = 0;
+    if (capacity < len * 2 + 16) {
+        capacity = len * 2 + 16;
+        free(out);
+        out = malloc_or_die(capacity);
+    }
+    size_t used = 0;
+    char* in = str->str;
+    size_t in_left = len + 1; // convert the NUL too, like libpst does
+    size_t result;
+
+    for (;;) {
+        char* o = out + used;
+        size_t out_left = capacity - used;
+        result = iconv(cd, &in, &in_left, &o, &out_left);
+        used = o - out;
+        if (result != (size_t) -1 || errno != E2BIG) break;
+        capacity *= 2;
+        out = realloc(out, capacity);
+        if (!out) die("out of memory because a string was too large");
+    }
+    int ok = result == 0;
+
+    if (!cached) iconv_close(cd);
+
+    if (!ok) {
+        DEBUG_WARN(("Failed to convert %s to utf-8 - %s\n", charset, str->str));
+        return 0;
+    }
+
+    char* converted = item_arena_alloc(used);
+    memcpy(converted, out, used);
+    item_arena_set_string(str, converted);
+    str->is_utf8 = 1;
+    return 1;
+}
+
+
+static void
+convert_utf8_untimed(pst_item* item, pst_string* str)
+{
+    char buffer[CHARSET_BUFFER_SIZE];
+
+    DEBUG_ENT("convert_utf8");
+    if (str->is_utf8) {
+        DEBUG_RET();
+        return;
+    }
+    if (!str->str) {
+        item_arena_set_string(str, item_arena_alloc(1));
+        str->str[0] = '\0';
+        DEBUG_RET();
+        return;
+    }
+
+    const char* charset = pst_default_charset(item, sizeof(buffer), buffer);
+    if (strcasecmp("utf-8", charset) == 0) {
+        // libpst leaves is_utf8 unset here; so do we
+        DEBUG_RET();
+        return;
+    }
+
+    size_t len;
+    if (string_is_ascii(str->str, &len) && charset_is_ascii_compatible(charset)) {
+        str->is_utf8 = 1;
+        DEBUG_RET();
+        return;
+    }
+
+    const uint16_t* table;
+    if (find_codepage_table(charset, &table) && decode_with_table(table, str, len)) {
+        DEBUG_RET();
+        return;
+    }
+
+    decode_with_iconv(charset, str, len);
+    DEBUG_RET();
+}
+
+
+void
+convert_utf8(pst_item* item, pst_string* str)
+{
+    STATS_BEGIN(start);
+    convert_utf8_untimed(item, str);
+    STATS_END(PHASE_UTF8, start);
+}
+
+
+void
+convert_utf8_null(pst_item* item, pst_string* str)
+{
+    if (!str->str) return;
+    convert_utf8(item, str);
+}
@@ -0,0 +1,38 @@
+/*
+ * Conversion of item strings to UTF-8.
+ *
+ * These are drop-in replacements for libpst's pst_convert_utf8() and
+ * pst_convert_utf8_null(), with identical results. They skip the work
+ * libpst does on every call:
+ *
+ * 1. Pure-ASCII strings in an ASCII-compatible charset are already UTF-8, so
+ *    we flag them as such without copying.
+ * 2. Common Windows code pages are decoded with lookup tables.
+ * 3. Everything else goes through iconv, with one descriptor per charset
+ *    opened once and reused for the whole run.
+ */
+
+#ifndef CHARSET_H
+#define CHARSET_H
+
+#include <libpst.h>
+
+/**
+ * Converted strings live in the item arena (see itemarena.h): free item
+ * with item_arena_free_item(), not pst_freeItem().
+ *
+ * So a converted string must never be handed to a libpst call that frees
+ * or replaces a pst_string's buffer -- pst_rfc2047(), pst_rfc2231(), or
+ * libpst's own pst_convert_utf8(). item_arena_detach() it first, to give
+ * it a malloc()ed buffer of its own.
+ */
+void      convert_utf8(pst_item* item, pst_string* str);
+void      convert_utf8_null(pst_item* item, pst_string* str);
+
+/**
+ * Returns nonzero if the NUL-terminated string is 7-bit ASCII, and stores its
+ * length in *len.
+ */
+int       string_is_ascii(const char* s, size_t* len);
+
+#endif
@@ -0,0 +1,150 @@
+/*
+ * FILETIME formatting. See datetime.h.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "datetime.h"
+
+// 100ns FILETIME ticks from 1601-01-01 to 1970-01-01
+#define FILETIME_UNIX_EPOCH 116444736000000000LL
+#define FILETIME_TICKS_PER_SECOND 10000000
+
+static const char WEEKDAYS[7][4] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+static const char MONTHS[12][4] = {
+    "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+typedef struct {
+    int64_t   day;          // since 1970-01-01
+    int64_t   year;
+    int       month;        // 1-12
+    int       mday;         // 1-31
+    int       wday;         // 0 is Sunday
+} Date;
+
+// The last day we worked out
+static Date cached_date = { INT64_MIN, 0, 0, 0, 0 };
+
+
+/**
+ * Works out the civil date of day (days since 1970-01-01), as in Howard
+ * Hinnant's civil_from_days().
+ */
+static void
+date_from_day(Date* date, int64_t day)
+{
+    int64_t z = day + 719468;
+    int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    int64_t doe = z - era * 146097;
+    int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    int64_t mp = (5 * doy + 2) / 153;
+
+    date->day = day;
+    date->mday = doy - (153 * mp + 2) / 5 + 1;
+    date->month = mp < 10 ? mp + 3 : mp - 9;
+    date->year = yoe + era * 400 + (date->month <= 2);
+    int64_t wday = (day + 4) % 7;  // 1970-01-01 was a Thursday
+    date->wday = wday < 0 ? wday + 7 : wday;
+}
+
+
+static char*
+put2(char* p, int n)
+{
+    p[0] = '0' + n / 10;
+    p[1] = '0' + n % 10;
+    return p + 2;
+}
+
+
+/**
+ * Writes year as strftime()'s %Y does: no padding, a '-' if negative.
+ */
+static char*
+put_year(char* p, int64_t year)
+{
+    uint64_t n = year < 0 ? -(uint64_t) year : (uint64_t) year;
+    char digits[20];
+    size_t len = 0;
+    do {
+        digits[len++] = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    if (year < 0) *p++ = '-';
+    while (len) *p++ = digits[--len];
+    return p;
+}
+
+
+size_t
+format_filetime(const FILETIME* filetime, DateTimeFormat format, char* buf)
+{
+    // as pst_fileTimeToUnixTime() does it, truncating toward zero
+    int64_t ticks = (int64_t) (((uint64_t) filetime->dwHighDateTime << 32) | filetime->dwLowDateTime);
+    int64_t t = (ticks - FILETIME_UNIX_EPOCH) / FILETIME_TICKS_PER_SECOND;
+
+    int64_t day = t / 86400;
+    int64_t seconds = t % 86400;
+    if (seconds < 0) {
+        day--;
+        seconds += 86400;
+    }
+    if (day != cached_date.day) date_from_day(&cached_date, day);
+    const Date* date = &cached_date;
+    int hour = seconds / 3600;
+    int minute = seconds / 60 % 60;
+    int second = seconds % 60;
+
+    char* p = buf;
+    switch (format) {
+        case DATETIME_RFC2445:
+            p = put_year(p, date->year);
+            p = put2(p, date->month);
+            p = put2(p, date->mday);
+            *p++ = 'T';
+            p = put2(p, hour);
+            p = put2(p, minute);
+            p = put2(p, second);
+            *p++ = 'Z';
+            break;
+        case DATETIME_RFC2425:
+            p = put_year(p, date->year);
+            *p++ = '-';
+            p = put2(p, date->month);
+            *p++ = '-';
+            p = put2(p, date->mday);
+            *p++ = 'T';
+            p = put2(p, hour);
+            *p++ = ':';
+            p = put2(p, minute);
+            *p++ = ':';
+            p = put2(p, second);
+            *p++ = 'Z';
+            break;
+        case DATETIME_RFC2822:
+            memcpy(p, WEEKDAYS[date->wday], 3);
+            p += 3;
+            *p++ = ',';
+            *p++ = ' ';
+            p = put2(p, date->mday);
+            *p++ = ' ';
+            memcpy(p, MONTHS[date->month - 1], 3);
+            p += 3;
+            *p++ = ' ';
+            p = put_year(p, date->year);
+            *p++ = ' ';
+            p = put2(p, hour);
+            *p++ = ':';
+            p = put2(p, minute);
+            *p++ = ':';
+            p = put2(p, second);
+            memcpy(p, " +0000", 6);
+            p += 6;
+            break;
+    }
+    *p = '\0';
+    return p - buf;
+}
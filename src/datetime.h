@@ -0,0 +1,33 @@
+/*
+ * FILETIME formatting for vCard, iCalendar and email headers.
+ *
+ * libpst's pst_rfc2445_datetime_format() and friends go through gmtime_r()
+ * and strftime() for each date, and we write a few per item. This does the
+ * calendar math with integers, and remembers the last day it worked out,
+ * since an item's dates (and neighbouring items') are mostly the same day.
+ * The output is byte for byte what libpst and strftime() write.
+ */
+
+#ifndef DATETIME_H
+#define DATETIME_H
+
+#include <stddef.h>
+
+#include <libpst.h>
+
+// Big enough for any format, NUL included
+#define DATETIME_SIZE 40
+
+typedef enum {
+    DATETIME_RFC2445,   // 20030612T053000Z: pst_rfc2445_datetime_format()
+    DATETIME_RFC2425,   // 2003-06-12T05:30:00Z: pst_rfc2425_datetime_format()
+    DATETIME_RFC2822,   // Thu, 12 Jun 2003 05:30:00 +0000: the Date header
+} DateTimeFormat;
+
+/**
+ * Writes filetime, in UTC, to buf (DATETIME_SIZE bytes) and returns its
+ * length.
+ */
+size_t    format_filetime(const FILETIME* filetime, DateTimeFormat format, char* buf);
+
+#endif
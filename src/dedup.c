@@ -0,0 +1,396 @@
+/*
+ * Duplicate email suppression. See dedup.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dedup.h"
+#include "digest.h"
+#include "extract-pst.h"
+
+// Grow the table when it is this full, in percent
+#define MAX_LOAD 50
+
+#define FILE_MAGIC "extract-pst dedup 2\n"
+
+typedef struct {
+    DedupKey  key;              // all zero: an empty slot
+    uint64_t  filename_offset;  // into filenames
+    uint64_t  input_offset;     // into filenames
+} Entry;
+
+typedef struct {
+    Entry*    entries;
+    size_t    n_slots;          // a power of 2, or 0
+    size_t    n_entries;
+} Table;
+
+static Table    emails;
+static Table    attachments;    // filename_offset unused
+static Table    inputs;         // keyed by digest; filename_offset is the input
+static char*    filenames;      // NUL-terminated strings, back to back
+static size_t   filenames_len;
+static size_t   filenames_cap;
+static uint64_t current_input;  // into filenames
+static int      has_input;
+static DedupKey* pending_attachments;   // this item's, until it's written
+static size_t   n_pending_attachments;
+static size_t   pending_attachments_cap;
+
+// Every field of the key goes into both digests
+typedef struct {
+    Digest    digests[2];
+} KeyBuilder;
+
+
+static void
+key_update(KeyBuilder* builder, const void* data, size_t len)
+{
+    digest_update(&builder->digests[0], data, len);
+    digest_update(&builder->digests[1], data, len);
+}
+
+
+/**
+ * Adds a field, length first, so "ab","c" and "a","bc" differ.
+ */
+static void
+key_add_bytes(KeyBuilder* builder, const char* data, size_t len)
+{
+    uint64_t len64 = len;
+    key_update(builder, &len64, sizeof(len64));
+    key_update(builder, data, len);
+}
+
+
+/**
+ * Adds a string with surrounding whitespace (and strip_chars) removed and
+ * ASCII letters lowercased. Non-ASCII bytes are taken as they are.
+ */
+static void
+key_add_string(KeyBuilder* builder, const char* s, const char* strip_chars)
+{
+    if (!s) s = "";
+    while (*s && (*s == ' ' || *s == '\t' || *s == '\r' || *s == '\n' || strchr(strip_chars, *s))) s++;
+    size_t len = strlen(s);
+    while (len && (s[len - 1] == ' ' || s[len - 1] == '\t' || s[len - 1] == '\r' || s[len - 1] == '\n' || strchr(strip_chars, s[len - 1]))) len--;
+
+    uint64_t len64 = len;
+    key_update(builder, &len64, sizeof(len64));
+
+    char lower[256];
+    while (len) {
+        size_t n = len < sizeof(lower) ? len : sizeof(lower);
+        for (size_t i = 0; i < n; i++) {
+            char c = s[i];
+            lower[i] = c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+        }
+        key_update(builder, lower, n);
+        s += n;
+        len -= n;
+    }
+}
+
+
+DedupKey
+dedup_email_key(pst_item* item)
+{
+    pst_item_email* email = item->email;
+    KeyBuilder builder;
+    digest_init(&builder.digests[0], 0);
+    digest_init(&builder.digests[1], 1);
+
+    key_add_string(&builder, email->messageid.str, "<>");
+
+    // to the second: copies in different stores may round differently
+    uint64_t sent_s = 0;
+    if (email->sent_date) {
+        uint64_t filetime = ((uint64_t) email->sent_date->dwHighDateTime << 32) | email->sent_date->dwLowDateTime;
+        sent_s = filetime / 10000000;
+    }
+    key_update(&builder, &sent_s, sizeof(sent_s));
+
+    key_add_string(&builder, email->sender_address.str ? email->sender_address.str : email->outlook_sender.str, "");
+    key_add_string(&builder, email->sentto_address.str, "");
+    key_add_string(&builder, email->cc_address.str, "");
+    key_add_string(&builder, item->subject.str, "");
+
+    key_add_bytes(&builder, item->body.str, item->body.str ? strlen(item->body.str) : 0);
+    key_add_bytes(&builder, email->htmlbody.str, email->htmlbody.str ? strlen(email->htmlbody.str) : 0);
+    // An email may have only an RTF body. Compressed, it's a fine key.
+    key_add_bytes(&builder, email->rtf_compressed.data, email->rtf_compressed.data ? email->rtf_compressed.size : 0);
+
+    DedupKey key = { {
+        digest_final(&builder.digests[0]),
+        digest_final(&builder.digests[1]),
+    } };
+    if (key.hash[0] == 0 && key.hash[1] == 0) key.hash[1] = 1; // all zero means "empty"
+    return key;
+}
+
+
+static int
+key_is_empty(const DedupKey* key)
+{
+    return key->hash[0] == 0 && key->hash[1] == 0;
+}
+
+
+/**
+ * Returns the slot holding key, or the empty slot where it belongs.
+ */
+static Entry*
+find_slot(Table* table, const DedupKey* key)
+{
+    size_t mask = table->n_slots - 1;
+    for (size_t i = key->hash[0] & mask; ; i = (i + 1) & mask) {
+        Entry* entry = &table->entries[i];
+        if (key_is_empty(&entry->key)
+                || (entry->key.hash[0] == key->hash[0] && entry->key.hash[1] == key->hash[1])) {
+            return entry;
+        }
+    }
+}
+
+
+static void
+grow_table(Table* table)
+{
+    Entry* old_entries = table->entries;
+    size_t old_n_slots = table->n_slots;
+
+    table->n_slots = table->n_slots ? table->n_slots * 2 : 1024;
+    table->entries = calloc(table->n_slots, sizeof(Entry));
+    if (!table->entries) die("out of memory while recording items for dedup");
+
+    for (size_t i = 0; i < old_n_slots; i++) {
+        if (!key_is_empty(&old_entries[i].key)) {
+            *find_slot(table, &old_entries[i].key) = old_entries[i];
+        }
+    }
+    free(old_entries);
+}
+
+
+static uint64_t
+add_filename(const char* filename, size_t len)
+{
+    if (filenames_len + len + 1 > filenames_cap) {
+        size_t cap = filenames_cap ? filenames_cap : 64 * 1024;
+        while (cap < filenames_len + len + 1) cap *= 2;
+        char* grown = realloc(filenames, cap);
+        if (!grown) die("out of memory while recording items for dedup");
+        filenames = grown;
+        filenames_cap = cap;
+    }
+    uint64_t offset = filenames_len;
+    memcpy(filenames + filenames_len, filename, len);
+    filenames[filenames_len + len] = '\0';
+    filenames_len += len + 1;
+    return offset;
+}
+
+
+/**
+ * Adds key (with filename, unless it's NULL, and input_offset) and returns
+ * NULL, or returns the entry that already has key.
+ */
+static Entry*
+insert(Table* table, DedupKey key, const char* filename, size_t filename_len, uint64_t input_offset)
+{
+    if ((table->n_entries + 1) * 100 > table->n_slots * MAX_LOAD) grow_table(table);
+
+    Entry* entry = find_slot(table, &key);
+    if (key_is_empty(&entry->key)) {
+        entry->key = key;
+        entry->filename_offset = filename ? add_filename(filename, filename_len) : 0;
+        entry->input_offset = input_offset;
+        table->n_entries++;
+        return NULL;
+    }
+    return entry;
+}
+
+
+/**
+ * Returns the offset of input in filenames, adding it the first time. Many
+ * keys share an input, so each input is stored once.
+ */
+static uint64_t
+intern_input(const char* input, size_t len)
+{
+    KeyBuilder builder;
+    digest_init(&builder.digests[0], 0);
+    digest_init(&builder.digests[1], 1);
+    key_add_bytes(&builder, input, len);
+    DedupKey key = { { digest_final(&builder.digests[0]), digest_final(&builder.digests[1]) } };
+    if (key_is_empty(&key)) key.hash[1] = 1;
+
+    Entry* existing = insert(&inputs, key, input, len, 0);
+    return existing ? existing->filename_offset : find_slot(&inputs, &key)->filename_offset;
+}
+
+
+void
+dedup_set_input(const char* input)
+{
+    current_input = intern_input(input, strlen(input));
+    has_input = 1;
+}
+
+
+const char*
+dedup_find(DedupKey key, const char** input)
+{
+    if (!emails.n_slots) return NULL;
+    Entry* entry = find_slot(&emails, &key);
+    if (key_is_empty(&entry->key)) return NULL;
+    *input = filenames + entry->input_offset;
+    return filenames + entry->filename_offset;
+}
+
+
+void
+dedup_add(DedupKey key, const char* filename)
+{
+    if (!has_input) dedup_set_input("");
+    insert(&emails, key, filename, strlen(filename), current_input);
+}
+
+
+int
+dedup_attachment_seen(uint64_t hash, uint64_t size)
+{
+    // size can't be 0 here, so the key isn't "empty"
+    DedupKey key = { { hash, size } };
+    if (attachments.n_slots && !key_is_empty(&find_slot(&attachments, &key)->key)) return 1;
+    for (size_t i = 0; i < n_pending_attachments; i++) {
+        if (pending_attachments[i].hash[0] == hash && pending_attachments[i].hash[1] == size) return 1;
+    }
+
+    if (n_pending_attachments == pending_attachments_cap) {
+        pending_attachments_cap = pending_attachments_cap ? pending_attachments_cap * 2 : 16;
+        DedupKey* grown = realloc(pending_attachments, pending_attachments_cap * sizeof(DedupKey));
+        if (!grown) die("out of memory while recording attachments for dedup");
+        pending_attachments = grown;
+    }
+    pending_attachments[n_pending_attachments++] = key;
+    return 0;
+}
+
+
+void
+dedup_attachment_commit(void)
+{
+    for (size_t i = 0; i < n_pending_attachments; i++) {
+        insert(&attachments, pending_attachments[i], NULL, 0, 0);
+    }
+    n_pending_attachments = 0;
+}
+
+
+void
+dedup_attachment_drop(void)
+{
+    n_pending_attachments = 0;
+}
+
+
+/*
+ * The file is FILE_MAGIC, then one record per key: the key's two hashes
+ * (8 bytes each, little-endian), the input's length (2 bytes,
+ * little-endian), the input, the filename's length (2 bytes) and the
+ * filename.
+ */
+
+
+static void
+write_le(unsigned char* p, uint64_t v, size_t size)
+{
+    for (size_t i = 0; i < size; i++, v >>= 8) p[i] = v & 0xff;
+}
+
+
+static uint64_t
+read_le(const unsigned char* p, size_t size)
+{
+    uint64_t v = 0;
+    for (size_t i = size; i > 0; i--) v = (v << 8) | p[i - 1];
+    return v;
+}
+
+
+void
+dedup_load(const char* path)
+{
+    FILE* f = fopen(path, "rb");
+    if (!f) return;
+
+    char magic[sizeof(FILE_MAGIC) - 1];
+    if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) || memcmp(magic, FILE_MAGIC, sizeof(magic))) {
+        fclose(f);
+        die("EXTRACT_PST_DEDUP_FILE is not an extract-pst dedup file");
+    }
+
+    unsigned char header[18];
+    unsigned char len_bytes[2];
+    static char input[65536], filename[65536];
+    size_t n;
+    while ((n = fread(header, 1, sizeof(header), f)) == sizeof(header)) {
+        DedupKey key = { { read_le(header, 8), read_le(header + 8, 8) } };
+        size_t input_len = read_le(header + 16, 2);
+        if (fread(input, 1, input_len, f) != input_len) break;
+        if (fread(len_bytes, 1, 2, f) != 2) break;
+        size_t len = read_le(len_bytes, 2);
+        if (fread(filename, 1, len, f) != len || key_is_empty(&key)) break;
+        insert(&emails, key, filename, len, intern_input(input, input_len));
+    }
+    int truncated = n != 0 || !feof(f);
+    fclose(f);
+    if (truncated) die("EXTRACT_PST_DEDUP_FILE is truncated or corrupt");
+}
+
+
+void
+dedup_save(const char* path)
+{
+    size_t tmp_len = strlen(path) + strlen(".tmp") + 1;
+    char* tmp_path = malloc_or_die(tmp_len);
+    snprintf(tmp_path, tmp_len, "%s.tmp", path);
+
+    FILE* f = fopen(tmp_path, "wb");
+    if (!f) die("could not write EXTRACT_PST_DEDUP_FILE");
+
+    int ok = fwrite(FILE_MAGIC, 1, sizeof(FILE_MAGIC) - 1, f) == sizeof(FILE_MAGIC) - 1;
+    for (size_t i = 0; ok && i < emails.n_slots; i++) {
+        const Entry* entry = &emails.entries[i];
+        if (key_is_empty(&entry->key)) continue;
+
+        const char* input = filenames + entry->input_offset;
+        size_t input_len = strlen(input);
+        if (input_len > 0xffff) input_len = 0xffff;
+        const char* filename = filenames + entry->filename_offset;
+        size_t len = strlen(filename);
+        if (len > 0xffff) len = 0xffff;
+        unsigned char header[18];
+        unsigned char len_bytes[2];
+        write_le(header, entry->key.hash[0], 8);
+        write_le(header + 8, entry->key.hash[1], 8);
+        write_le(header + 16, input_len, 2);
+        write_le(len_bytes, len, 2);
+        ok = fwrite(header, 1, sizeof(header), f) == sizeof(header)
+            && fwrite(input, 1, input_len, f) == input_len
+            && fwrite(len_bytes, 1, 2, f) == 2
+            && fwrite(filename, 1, len, f) == len;
+    }
+
+    if (fclose(f) != 0) ok = 0;
+    if (!ok || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        die("could not write EXTRACT_PST_DEDUP_FILE");
+    }
+    free(tmp_path);
+}
@@ -0,0 +1,79 @@
+/*
+ * Duplicate email and attachment suppression.
+ *
+ * With EXTRACT_PST_DEDUP, each email gets a key: a 128-bit digest of its
+ * Message-Id, sent date, sender, recipients, subject and bodies (text,
+ * HTML and compressed RTF), each trimmed and lowercased. The first email
+ * with a given key is rendered as usual; each later one becomes a
+ * "duplicate" part naming the first one's filename, and the input it came
+ * from.
+ *
+ * The set of keys is an open-addressing hash table of fixed-size entries;
+ * filenames and inputs live in one growing buffer. With
+ * EXTRACT_PST_DEDUP_FILE, the set is loaded from that file before the run
+ * and saved to it after, so it spans runs.
+ *
+ * Attachments have a set of their own, keyed by XXH64 and size.
+ */
+
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdint.h>
+
+#include <libpst.h>
+
+typedef struct {
+    uint64_t  hash[2];
+} DedupKey;
+
+DedupKey  dedup_email_key(pst_item* item);
+
+/**
+ * Sets the input that dedup_add() records filenames as coming from: the
+ * input's filename, as a JSON string's contents.
+ */
+void      dedup_set_input(const char* input);
+
+/**
+ * Returns the filename recorded with key, and sets *input to its input, if
+ * the set has it. Otherwise returns NULL.
+ */
+const char* dedup_find(DedupKey key, const char** input);
+
+/**
+ * Records key with filename, from the current input. Call it once the
+ * email is written, so a key never names a file that isn't there.
+ */
+void      dedup_add(DedupKey key, const char* filename);
+
+/**
+ * With EXTRACT_PST_ATTACHMENT_DEDUP: returns nonzero if an attachment with
+ * this XXH64 and size (> 0) was written already, by an earlier item or by
+ * this one. If not, notes it for this item. This set is never saved.
+ */
+int       dedup_attachment_seen(uint64_t hash, uint64_t size);
+
+/**
+ * Adds the attachments this item noted to the set, once the item is
+ * written: later copies may then refer to them.
+ */
+void      dedup_attachment_commit(void);
+
+/**
+ * Forgets the attachments this item noted: it was skipped, so they aren't
+ * there to refer to.
+ */
+void      dedup_attachment_drop(void);
+
+/**
+ * Adds the keys saved in path to the set. A missing file is an empty set.
+ */
+void      dedup_load(const char* path);
+
+/**
+ * Saves the set to path, replacing it atomically.
+ */
+void      dedup_save(const char* path);
+
+#endif
@@ -0,0 +1,138 @@
+/*
+ * Compact descriptor table. See desc.h.
+ */
+
+#include <stdlib.h>
+
+#include "desc.h"
+#include "extract-pst.h"
+#include "stats.h"
+
+// pst_load_index() allocates each node on its own
+#define MALLOC_OVERHEAD 16
+
+
+static uint32_t
+count_nodes(const pst_desc_tree* d_ptr)
+{
+    uint32_t n = 0;
+    for (; d_ptr; d_ptr = d_ptr->next) {
+        if (d_ptr->desc) n += 1 + count_nodes(d_ptr->child);
+    }
+    return n;
+}
+
+
+static uint32_t
+i_table_index(const DescTable* table, const pst_index_ll* ptr)
+{
+    return ptr ? (uint32_t) (ptr - table->i_table) : DESC_NONE;
+}
+
+
+static void
+set_entry(DescTable* table, uint32_t i, const pst_desc_tree* d_ptr)
+{
+    if (d_ptr->d_id > UINT32_MAX) die("descriptor ID is out of range: is the PST corrupt?");
+
+    DescEntry* entry = &table->entries[i];
+    entry->d_id = (uint32_t) d_ptr->d_id;
+    entry->desc = i_table_index(table, d_ptr->desc);
+    entry->assoc_tree = i_table_index(table, d_ptr->assoc_tree);
+    entry->first_child = 0;
+    entry->n_children = 0;
+}
+
+
+/**
+ * Appends d_ptr's children after the last entry, then each child's
+ * children, and so on.
+ */
+static void
+add_children(DescTable* table, uint32_t parent, const pst_desc_tree* d_ptr)
+{
+    uint32_t first = table->n_entries;
+    for (const pst_desc_tree* child = d_ptr->child; child; child = child->next) {
+        if (child->desc) set_entry(table, table->n_entries++, child);
+    }
+    table->entries[parent].first_child = first;
+    table->entries[parent].n_children = table->n_entries - first;
+
+    uint32_t i = first;
+    for (const pst_desc_tree* child = d_ptr->child; child; child = child->next) {
+        if (child->desc) add_children(table, i++, child);
+    }
+}
+
+
+static uint64_t
+free_tree(pst_desc_tree* d_ptr)
+{
+    uint64_t n = 0;
+    while (d_ptr) {
+        pst_desc_tree* next = d_ptr->next;
+        n += 1 + free_tree(d_ptr->child);
+        free(d_ptr);
+        d_ptr = next;
+    }
+    return n;
+}
+
+
+void
+desc_table_build(DescTable* table, pst_file* pstfile, pst_desc_tree* top_of_folders)
+{
+    table->i_table = pstfile->i_table;
+    table->n_entries = 0;
+    table->entries = malloc_or_die((1 + (size_t) count_nodes(top_of_folders->child)) * sizeof(DescEntry));
+
+    set_entry(table, table->n_entries++, top_of_folders);
+    add_children(table, 0, top_of_folders);
+
+    uint64_t n_nodes = free_tree(pstfile->d_head);
+    pstfile->d_head = NULL;
+    pstfile->d_tail = NULL;
+
+    stats_desc_table(
+        n_nodes,
+        n_nodes * (sizeof(pst_desc_tree) + MALLOC_OVERHEAD),
+        (uint64_t) table->n_entries * sizeof(DescEntry)
+    );
+}
+
+
+void
+desc_table_free(DescTable* table)
+{
+    free(table->entries);
+    table->entries = NULL;
+    table->n_entries = 0;
+}
+
+
+uint64_t
+desc_count_items(const DescTable* table, const DescEntry* folder)
+{
+    uint64_t n = 0;
+    for (uint32_t i = 0; i < folder->n_children; i++) {
+        const DescEntry* entry = desc_child(table, folder, i);
+        n += entry->n_children ? desc_count_items(table, entry) : 1;
+    }
+    return n;
+}
+
+
+void
+desc_node(const DescTable* table, const DescEntry* entry, pst_desc_tree* node)
+{
+    node->d_id        = entry->d_id;
+    node->parent_d_id = 0;
+    node->desc        = &table->i_table[entry->desc];
+    node->assoc_tree  = entry->assoc_tree == DESC_NONE ? NULL : &table->i_table[entry->assoc_tree];
+    node->no_child    = entry->n_children;
+    node->prev        = NULL;
+    node->next        = NULL;
+    node->parent      = NULL;
+    node->child       = NULL;
+    node->child_tail  = NULL;
+}
@@ -0,0 +1,79 @@
+/*
+ * A compact copy of libpst's descriptor tree.
+ *
+ * libpst loads each descriptor as its own 80-byte pst_desc_tree node,
+ * linked five ways. We need only the folders and items under the top of
+ * folders, and only a few fields of each, so we copy those into one array
+ * of 20-byte entries, each folder's children side by side, and free
+ * libpst's tree. Walking the folders is then a walk over an array.
+ *
+ * Descriptors without an index entry are left out: process() would skip
+ * them anyway.
+ */
+
+#ifndef DESC_H
+#define DESC_H
+
+#include <stdint.h>
+
+#include <libpst.h>
+
+#define DESC_NONE UINT32_MAX
+
+// MS-PST 2.2.2.1: a NID's low 5 bits are its type
+#define NID_TYPE_MASK 0x1f
+#define NID_TYPE_NORMAL_FOLDER 0x02
+#define NID_TYPE_SEARCH_FOLDER 0x03
+
+typedef struct {
+    uint32_t  d_id;
+    uint32_t  desc;         // index into pstfile->i_table
+    uint32_t  assoc_tree;   // index into pstfile->i_table, or DESC_NONE
+    uint32_t  first_child;  // index into DescTable.entries
+    uint32_t  n_children;
+} DescEntry;
+
+typedef struct {
+    DescEntry*    entries;      // entries[0] is the top of folders
+    uint32_t      n_entries;
+    pst_index_ll* i_table;
+} DescTable;
+
+/**
+ * Copies the tree under top_of_folders into table, then frees all of
+ * pstfile's descriptor tree. Call it after the last libpst call that needs
+ * the tree (pst_getTopOfFolders()).
+ */
+void      desc_table_build(DescTable* table, pst_file* pstfile, pst_desc_tree* top_of_folders);
+
+void      desc_table_free(DescTable* table);
+
+/**
+ * Returns the number of descriptors without children under folder, at any
+ * depth: the items process() visits in it.
+ */
+uint64_t  desc_count_items(const DescTable* table, const DescEntry* folder);
+
+/**
+ * Fills in *node from entry, for the libpst calls that take a
+ * pst_desc_tree. The node has no links.
+ */
+void      desc_node(const DescTable* table, const DescEntry* entry, pst_desc_tree* node);
+
+/**
+ * Returns nonzero if entry is a folder, even one without children.
+ */
+static inline int
+desc_is_folder(const DescEntry* entry)
+{
+    uint32_t type = entry->d_id & NID_TYPE_MASK;
+    return type == NID_TYPE_NORMAL_FOLDER || type == NID_TYPE_SEARCH_FOLDER;
+}
+
+static inline const DescEntry*
+desc_child(const DescTable* table, const DescEntry* entry, uint32_t i)
+{
+    return &table->entries[entry->first_child + i];
+}
+
+#endif
@@ -0,0 +1,154 @@
+/*
+ * XXH64. See digest.h, and the spec at
+ * https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+ */
+
+#include <string.h>
+
+#include "digest.h"
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+
+static inline uint64_t
+rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+
+static inline uint64_t
+read64(const unsigned char* p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+
+static inline uint32_t
+read32(const unsigned char* p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+
+static inline uint64_t
+round64(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+
+static inline uint64_t
+merge_round(uint64_t acc, uint64_t val)
+{
+    acc ^= round64(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+
+static inline void
+consume_stripe(uint64_t acc[4], const unsigned char* p)
+{
+    acc[0] = round64(acc[0], read64(p));
+    acc[1] = round64(acc[1], read64(p + 8));
+    acc[2] = round64(acc[2], read64(p + 16));
+    acc[3] = round64(acc[3], read64(p + 24));
+}
+
+
+void
+digest_init(Digest* digest, uint64_t seed)
+{
+    digest->acc[0] = seed + PRIME64_1 + PRIME64_2;
+    digest->acc[1] = seed + PRIME64_2;
+    digest->acc[2] = seed;
+    digest->acc[3] = seed - PRIME64_1;
+    digest->seed = seed;
+    digest->total_len = 0;
+    digest->buf_len = 0;
+}
+
+
+void
+digest_update(Digest* digest, const void* data, size_t len)
+{
+    const unsigned char* p = data;
+    digest->total_len += len;
+
+    if (digest->buf_len) {
+        size_t n = 32 - digest->buf_len;
+        if (n > len) n = len;
+        memcpy(digest->buf + digest->buf_len, p, n);
+        digest->buf_len += n;
+        p += n;
+        len -= n;
+        if (digest->buf_len < 32) return;
+        consume_stripe(digest->acc, digest->buf);
+        digest->buf_len = 0;
+    }
+
+    // the hot loop: whole stripes straight from the caller's buffer
+    uint64_t acc[4] = { digest->acc[0], digest->acc[1], digest->acc[2], digest->acc[3] };
+    for (; len >= 32; p += 32, len -= 32) {
+        consume_stripe(acc, p);
+    }
+    memcpy(digest->acc, acc, sizeof(acc));
+
+    memcpy(digest->buf, p, len);
+    digest->buf_len = len;
+}
+
+
+uint64_t
+digest_final(const Digest* digest)
+{
+    uint64_t h;
+    if (digest->total_len >= 32) {
+        const uint64_t* acc = digest->acc;
+        h = rotl64(acc[0], 1) + rotl64(acc[1], 7) + rotl64(acc[2], 12) + rotl64(acc[3], 18);
+        for (int i = 0; i < 4; i++) h = merge_round(h, acc[i]);
+    } else {
+        h = digest->seed + PRIME64_5;
+    }
+    h += digest->total_len;
+
+    const unsigned char* p = digest->buf;
+    size_t len = digest->buf_len;
+    for (; len >= 8; p += 8, len -= 8) {
+        h ^= round64(0, read64(p));
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+    }
+    if (len >= 4) {
+        h ^= (uint64_t) read32(p) * PRIME64_1;
+        h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+        len -= 4;
+    }
+    for (; len > 0; p++, len--) {
+        h ^= *p * PRIME64_5;
+        h = rotl64(h, 11) * PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
@@ -0,0 +1,31 @@
+/*
+ * XXH64, a fast non-cryptographic hash, computed incrementally.
+ *
+ * It identifies content (duplicate messages, say); it does not protect
+ * against anyone crafting collisions.
+ */
+
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    uint64_t      acc[4];
+    uint64_t      seed;
+    uint64_t      total_len;
+    unsigned char buf[32];      // input that doesn't fill a 32-byte stripe yet
+    size_t        buf_len;
+} Digest;
+
+void      digest_init(Digest* digest, uint64_t seed);
+void      digest_update(Digest* digest, const void* data, size_t len);
+
+/**
+ * Returns the hash of everything passed to digest_update(). The Digest is
+ * unchanged: more data may follow.
+ */
+uint64_t  digest_final(const Digest* digest);
+
+#endif
@@ -0,0 +1,83 @@
+/*
+ * Upfront cost estimate. See estimate.h.
+ */
+
+#include <inttypes.h>
+
+#include "estimate.h"
+#include "extract-pst.h"
+#include "output.h"
+#include "shard.h"
+
+/*
+ * The cost model. Each "estimate" part is a guess; bench/run prints it
+ * next to what the run actually took, and bench/fit-estimate refits these
+ * from bench/run's output when the converter gets faster or slower.
+ */
+
+// An .eml's headers, MIME boundaries and JSON part, beyond its data
+#define OUTPUT_BYTES_PER_ITEM 2000
+// Property contexts and long bodies hold bodies and headers, written out
+// about as they are, plus binary overhead that never reaches the output
+#define OUTPUT_BYTES_PER_PROPERTY_BYTE 0.8
+// Base64: 4 bytes per 3, plus a newline per 76 columns
+#define OUTPUT_BYTES_PER_ATTACHMENT_BYTE (4.0 / 3 * 77 / 76)
+
+// Parsing, MIME rendering and writing one item, apart from its bytes
+#define NS_PER_ITEM 40000
+// Reading, decrypting and decompressing input
+#define NS_PER_INPUT_BYTE 2.0
+// Encoding and writing output
+#define NS_PER_OUTPUT_BYTE 1.0
+
+
+void
+output_estimate(pst_file* pstfile, const DescTable* table)
+{
+    uint64_t n_items = 0;
+    uint64_t n_folders = 0;
+    uint64_t property_bytes = 0;
+    uint64_t attachment_bytes = 0;
+
+    // entries[0] is the top of folders itself
+    for (uint32_t i = 1; i < table->n_entries; i++) {
+        const DescEntry* entry = &table->entries[i];
+        if (entry->n_children || desc_is_folder(entry)) {
+            // An empty folder gets no part
+            n_folders++;
+            continue;
+        }
+        pst_desc_tree node;
+        desc_node(table, entry, &node);
+        uint64_t attachments = 0;
+        uint64_t bytes = item_stored_bytes(pstfile, &node, &attachments);
+        n_items++;
+        property_bytes += bytes - attachments;
+        attachment_bytes += attachments;
+    }
+
+    uint64_t input_bytes = 0;
+    for (size_t i = 0; i < pstfile->i_count; i++) {
+        input_bytes += pstfile->i_table[i].size;
+    }
+
+    uint64_t output_bytes = n_items * OUTPUT_BYTES_PER_ITEM
+        + (uint64_t) (property_bytes * OUTPUT_BYTES_PER_PROPERTY_BYTE)
+        + (uint64_t) (attachment_bytes * OUTPUT_BYTES_PER_ATTACHMENT_BYTE);
+    uint64_t runtime_ns = n_items * NS_PER_ITEM
+        + (uint64_t) (input_bytes * NS_PER_INPUT_BYTE)
+        + (uint64_t) (output_bytes * NS_PER_OUTPUT_BYTE);
+
+    output_part("estimate", "");
+    out_printf(
+        "{\"items\":%" PRIu64 ",\"folders\":%" PRIu64 ",\"inputBytes\":%" PRIu64 ",\"propertyBytes\":%" PRIu64
+        ",\"attachmentBytes\":%" PRIu64 ",\"outputBytes\":%" PRIu64 ",\"runtimeNs\":%" PRIu64 "}",
+        n_items,
+        n_folders,
+        input_bytes,
+        property_bytes,
+        attachment_bytes,
+        output_bytes,
+        runtime_ns
+    );
+}
@@ -0,0 +1,30 @@
+/*
+ * An upfront estimate of a conversion's size and cost, for schedulers.
+ *
+ * With EXTRACT_PST_ESTIMATE, right after the index is loaded and before any
+ * item is parsed, we write an "estimate" part:
+ *
+ *   {"items":...,"folders":...,"inputBytes":...,"propertyBytes":...,
+ *    "attachmentBytes":...,"outputBytes":...,"runtimeNs":...}
+ *
+ * It comes from the descriptor table and the block index, plus each item's
+ * XBLOCKs and subnode blocks, as shard planning reads them: no item is
+ * parsed. "items" counts descriptors without children that aren't folders.
+ * "inputBytes" is every block in the index. "attachmentBytes" is what
+ * items store under attachment subnodes; "propertyBytes" is the rest of
+ * what they store: property contexts, long bodies, recipient tables.
+ * "outputBytes" and "runtimeNs" apply per-item and per-byte costs (see
+ * estimate.c) to those counts. They describe the whole PST, even with
+ * EXTRACT_PST_SHARD.
+ */
+
+#ifndef ESTIMATE_H
+#define ESTIMATE_H
+
+#include <libpst.h>
+
+#include "desc.h"
+
+void      output_estimate(pst_file* pstfile, const DescTable* table);
+
+#endif
@@ -0,0 +1,239 @@
+/*
+ * Export mode. See export.h.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "export.h"
+#include "extract-pst.h"
+#include "options.h"
+#include "output.h"
+#include "stats.h"
+#include "uring.h"
+
+// Files being written at once. Each has at most one write queued, so the
+// rings never fill.
+#define QUEUE_DEPTH 64
+// Writes queued before we hand them to the kernel
+#define SUBMIT_BATCH 16
+// Linux writes at most about 2GB per call
+#define MAX_WRITE (1 << 30)
+
+typedef struct {
+    int          fd;        // -1 if the slot is free
+    char*        data;      // ours, to free() once it's written
+    uint64_t     len;
+    uint64_t     written;
+    struct iovec iov;       // what's left, for the queued write
+} FileWrite;
+
+static Ring      ring = { .fd = -1 };
+static FileWrite writes[QUEUE_DEPTH];
+static unsigned  n_in_flight;
+static uint64_t  bytes_in_flight;
+static int       started;
+static char*     last_dir;  // the last directory we made sure exists
+static size_t    last_dir_len;
+
+
+/**
+ * Returns options.export_dir plus filename. A folder may be named anything,
+ * so "." and ".." components become "_" and "__".
+ */
+static char*
+export_path(const char* filename)
+{
+    size_t dir_len = strlen(options.export_dir);
+    char* path = malloc_or_die(dir_len + strlen(filename) + 2);
+    memcpy(path, options.export_dir, dir_len);
+
+    char* o = path + dir_len;
+    const char* s = filename;
+    for (;;) {
+        while (*s == '/') s++;
+        if (!*s) break;
+        const char* end = strchrnul(s, '/');
+        size_t len = end - s;
+        int dots = len <= 2 && strspn(s, ".") >= len;
+        *o++ = '/';
+        for (; s < end; s++) *o++ = dots ? '_' : *s;
+    }
+    *o = '\0';
+    return path;
+}
+
+
+static void
+make_parent_dirs(char* path)
+{
+    size_t len = strrchr(path, '/') - path;
+    if (last_dir && len == last_dir_len && memcmp(path, last_dir, len) == 0) return;
+
+    for (char* p = path + 1; p <= path + len; p++) {
+        if (*p != '/') continue;
+        *p = '\0';
+        int err = mkdir(path, 0777) != 0 && errno != EEXIST;
+        *p = '/';
+        if (err) die("could not create a directory to export to");
+    }
+
+    free(last_dir);
+    last_dir = malloc_or_die(len);
+    memcpy(last_dir, path, len);
+    last_dir_len = len;
+}
+
+
+static void
+pwrite_all(int fd, const char* data, uint64_t len)
+{
+    for (uint64_t written = 0; written < len; ) {
+        size_t chunk = len - written < MAX_WRITE ? len - written : MAX_WRITE;
+        ssize_t n = pwrite(fd, data + written, chunk, written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) die("could not write an exported file: is the disk full?");
+        written += n;
+    }
+}
+
+
+/**
+ * Copies a capture that spilled to a temp file, kernel-side.
+ */
+static void
+copy_spill(int fd, int spill_fd, uint64_t len)
+{
+    off_t offset = 0;
+    while ((uint64_t) offset < len) {
+        uint64_t left = len - offset;
+        ssize_t n = sendfile(fd, spill_fd, &offset, left < MAX_WRITE ? left : MAX_WRITE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) die("could not write an exported file: is the disk full?");
+    }
+    close(spill_fd);
+}
+
+
+static void
+queue_write(unsigned slot)
+{
+    FileWrite* w = &writes[slot];
+    uint64_t left = w->len - w->written;
+    w->iov.iov_base = w->data + w->written;
+    w->iov.iov_len = left < MAX_WRITE ? left : MAX_WRITE;
+    ring_queue_write(&ring, w->fd, &w->iov, w->written, slot);
+}
+
+
+static void
+write_completed(uint64_t slot, int res)
+{
+    FileWrite* w = &writes[slot];
+    if (res == -EINTR || res == -EAGAIN) {
+        queue_write(slot);
+        return;
+    }
+    if (res <= 0) die("could not write an exported file: is the disk full?");
+
+    w->written += res;
+    if (w->written < w->len) {
+        queue_write(slot); // a short write: the rest
+        return;
+    }
+
+    close(w->fd);
+    free(w->data);
+    w->fd = -1;
+    n_in_flight -= 1;
+    bytes_in_flight -= w->len;
+}
+
+
+/**
+ * Queues a write of a whole file. fd and data are the ring's now.
+ */
+static void
+ring_write(int fd, char* data, uint64_t len)
+{
+    // Items in flight are in memory: hold them to what one item should take
+    while (n_in_flight == QUEUE_DEPTH || (n_in_flight > 0 && bytes_in_flight + len > options.item_memory_bytes)) {
+        ring_enter(&ring, 1);
+        ring_reap(&ring, write_completed);
+    }
+
+    unsigned slot = 0;
+    while (writes[slot].fd >= 0) slot++;
+    FileWrite* w = &writes[slot];
+    w->fd = fd;
+    w->data = data;
+    w->len = len;
+    w->written = 0;
+    n_in_flight += 1;
+    bytes_in_flight += len;
+    queue_write(slot);
+
+    if (ring.to_submit >= SUBMIT_BATCH) ring_enter(&ring, 0);
+    ring_reap(&ring, write_completed);
+}
+
+
+void
+export_capture(const char* filename)
+{
+    STATS_BEGIN(start);
+    if (!started) {
+        started = 1;
+        ring_open(&ring, QUEUE_DEPTH);
+        for (unsigned i = 0; i < QUEUE_DEPTH; i++) writes[i].fd = -1;
+        if (mkdir(options.export_dir, 0777) != 0 && errno != EEXIST) {
+            die("could not create EXTRACT_PST_EXPORT_DIR");
+        }
+    }
+
+    uint64_t len;
+    int spill_fd;
+    char* data = out_capture_take(&len, &spill_fd);
+
+    char* path = export_path(filename);
+    make_parent_dirs(path);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    free(path);
+    if (fd < 0) die("could not create an exported file");
+    // So the file is laid out in one go. A hint: if it fails, the write will
+    // say why.
+    if (len > 0) fallocate(fd, 0, 0, len);
+
+    if (spill_fd >= 0) {
+        copy_spill(fd, spill_fd, len);
+        close(fd);
+    } else if (ring.fd >= 0 && len > 0) {
+        ring_write(fd, data, len);
+    } else {
+        pwrite_all(fd, data, len);
+        close(fd);
+        free(data);
+    }
+    STATS_END(PHASE_EXPORT, start);
+}
+
+
+void
+export_finish(void)
+{
+    STATS_BEGIN(start);
+    while (n_in_flight > 0) {
+        ring_enter(&ring, 1);
+        ring_reap(&ring, write_completed);
+    }
+    STATS_END(PHASE_EXPORT, start);
+}
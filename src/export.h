@@ -0,0 +1,29 @@
+/*
+ * Export mode: each item goes to its own file under options.export_dir,
+ * at its filename ("/Inbox/0001.eml"), instead of into the multipart stream.
+ * stdout still carries everything else: progress, warnings, duplicates,
+ * stats and done.
+ *
+ * Items render just as they would for the stream, into a capture (see
+ * output.h), which we hand to the kernel whole. Writes go through io_uring
+ * when the kernel (and seccomp) allow it, many files at once, and each file
+ * is preallocated to its size first. Otherwise, we pwrite() each file as it
+ * comes.
+ */
+
+#ifndef EXPORT_H
+#define EXPORT_H
+
+/**
+ * Writes the output captured for the item filename (see out_capture_end())
+ * to its file, creating directories as needed. The write may still be in
+ * flight on return.
+ */
+void      export_capture(const char* filename);
+
+/**
+ * Waits for every write in flight, and closes their files.
+ */
+void      export_finish(void);
+
+#endif
@@ -10,9 +10,12 @@
 #include <ctype.h>
 #include <errno.h>
 #include <math.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <inttypes.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 // libpst includes:
 #include <libpst.h>
@@ -20,41 +23,53 @@
 #include <lzfu.h>
 #include <timeconv.h>
 
-// max size of the c_time char*. It will store the date of the email
-#define C_TIME_SIZE 500
-
-#define DEBUG_ENT(x)
-#define DEBUG_INFO(x)
-#define DEBUG_WARN(x)
-#define DEBUG_RET(x)
+#include "extract-pst.h"
+#include "batch.h"
+#include "census.h"
+#include "charset.h"
+#include "datetime.h"
+#include "dedup.h"
+#include "desc.h"
+#include "digest.h"
+#include "estimate.h"
+#include "export.h"
+#include "idindex.h"
+#include "itemarena.h"
+#include "limits.h"
+#include "options.h"
+#include "output.h"
+#include "prefetch.h"
+#include "shard.h"
+#include "stats.h"
+#include "trace.h"
 
 typedef struct {
     size_t n_processed;
     size_t n_total;
+    int    census_pending;  // n_total isn't in yet: wait for it before "progress"
 } Progress;
 
-size_t    process(pst_file *pstfile, pst_item *outeritem, pst_desc_tree *d_ptr, size_t starting_index, const char* outer_name, Progress* progress);
-void      removeCR(char *c);
+// XXH64s of an item's blob and of its attachments' data, in blob order
+typedef struct {
+    uint64_t  blob;
+    uint64_t* attachments;
+    size_t    n_attachments;
+    size_t    attachments_cap;
+} ContentHashes;
+
+size_t    process(pst_file *pstfile, pst_item *outeritem, const DescTable *table, const DescEntry *folder, size_t starting_index, const char* outer_name, Progress* progress);
 void      usage();
-char*     my_stristr(char *haystack, char *needle);
-void      write_embedded_message(pst_item_attach* attach, int mime_depth, pst_file* pstfile, char** extra_mime_headers);
+void      write_embedded_message(pst_item_attach* attach, int mime_depth, pst_file* pstfile, EmbeddedHeaders* embedded);
 void      write_inline_attachment(pst_item_attach* attach, int mime_depth, pst_file* pst);
 int       valid_headers(char *header);
-void      header_has_field(char *header, char *field, int *flag);
 void      header_get_subfield(char *field, const char *subfield, char *body_subfield, size_t size_subfield);
 char*     header_get_field(char *header, char *field);
 char*     header_end_field(char *field);
-void      header_strip_field(char *header, char *field);
-int       test_base64(const char *body, size_t len);
-void      find_rfc822_headers(char** extra_mime_headers);
 void      write_pst_string(pst_string *body, char *mime, char *charset, int mime_depth);
 void      write_schedule_part(pst_item* item, const char* sender, int mime_depth);
-void      write_normal_email(pst_item* item, pst_file* pst, int mime_depth, char** extra_mime_headers);
-void      write_vcard(pst_item *item, pst_item_contact* contact, char comment[]);
+void      write_normal_email(pst_item* item, pst_file* pst, int mime_depth, EmbeddedHeaders* embedded);
 int       write_extra_categories(pst_item* item);
 void      write_journal(pst_item* item);
-void      write_appointment(pst_item *item);
-char*     quote_string(char *inp);
 
 static size_t MIN_N_DIGITS = 4;
 #define MIN_N_DIGITS_S "4"
@@ -63,25 +78,39 @@ static size_t MIN_N_DIGITS = 4;
 #define MIME_TYPE_DEFAULT "application/octet-stream"
 #define RFC822            "message/rfc822"
 
+#define INPUT_PATH "input.blob"
+
+// Smaller attachments cost less to write than to look up
+#define MIN_DEDUP_ATTACHMENT_SIZE 1024
+
 const char* mime_boundary;
 const char* json_template;
 
+// With options.hashes: the hashes of the item being written
+static ContentHashes content_hashes;
+
 void
 die(const char* message)
 {
-	printf(
+	if (limits_in_item()) {
+		limits_exceeded(LIMIT_ERROR, message); // skip the item, not the run
+	}
+	out_capture_cancel();
+	out_printf(
 		"\r\n--%s\r\nContent-Disposition: form-data; name=error\r\n\r\n%s\r\n--%s--",
 		mime_boundary,
 		message,
 		mime_boundary
 	);
+	out_flush();
+	trace_close();
 	exit(0);
 }
 
 void
 output_done()
 {
-	printf(
+	out_printf(
 		"\r\n--%s\r\nContent-Disposition: form-data; name=done\r\n\r\n\r\n--%s--",
 		mime_boundary,
 		mime_boundary
@@ -91,7 +120,7 @@ output_done()
 void
 output_part(const char* name, const char* body)
 {
-	printf(
+	out_printf(
 		"\r\n--%s\r\nContent-Disposition: form-data; name=%s\r\n\r\n%s",
 		mime_boundary,
 		name,
@@ -102,7 +131,7 @@ output_part(const char* name, const char* body)
 void
 output_indexed_part(int index, const char* ext, const char* body)
 {
-	printf(
+	out_printf(
 		"\r\n--%s\r\nContent-Disposition: form-data; name=%d%s\r\n\r\n%s",
 		mime_boundary,
 		index,
@@ -112,7 +141,7 @@ output_indexed_part(int index, const char* ext, const char* body)
 }
 
 void
-output_json(int index, const char* filename, const char* content_type)
+output_json(int index, const char* filename, const char* content_type, const ContentHashes* hashes)
 {
 	const char* filename_pos = strstr(json_template, "FILENAME\",");
 	if (!filename_pos) {
@@ -120,62 +149,216 @@ output_json(int index, const char* filename, const char* content_type)
 	}
 
 	output_indexed_part(index, ".json", "");
-	fwrite(json_template, sizeof(char), filename_pos - json_template, stdout);
-	fprintf(
-		stdout,
-		"%s\",\"contentType\":\"%s%s",
+	out_write(json_template, filename_pos - json_template);
+	out_printf(
+		"%s\",\"contentType\":\"%s\"",
 		filename,
-		content_type,
-		filename_pos + strlen("FILENAME")
+		content_type
 	);
+	if (hashes) {
+		out_printf(",\"contentHash\":\"xxh64:%016" PRIx64 "\",\"attachmentHashes\":[", hashes->blob);
+		for (size_t i = 0; i < hashes->n_attachments; i++) {
+			out_printf("%s\"xxh64:%016" PRIx64 "\"", i ? "," : "", hashes->attachments[i]);
+		}
+		out_puts("]");
+	}
+	out_puts(filename_pos + strlen("FILENAME\""));
+}
+
+/**
+ * Returns the input's own filename, still JSON-escaped: what comes before
+ * FILENAME in json_template's "filename" string.
+ */
+static char*
+json_template_input(void)
+{
+    const char* end = strstr(json_template, "FILENAME\",");
+    if (!end) {
+        die("Expected placeholder 'FILENAME' to exist in JSON template");
+    }
+    const char* start = end;
+    for (;;) {
+        if (start == json_template) return strdup_or_die("");
+        start--;
+        if (*start != '"') continue;
+        // an escaped quote has an odd number of backslashes before it
+        size_t n_backslashes = 0;
+        while (start - n_backslashes > json_template && start[-1 - (ptrdiff_t) n_backslashes] == '\\') n_backslashes++;
+        if (n_backslashes % 2 == 0) break;
+    }
+    start++;
+    char* input = malloc_or_die(end - start + 1);
+    memcpy(input, start, end - start);
+    input[end - start] = '\0';
+    return input;
+}
+
+/**
+ * Starts an item's ".json" and ".blob" parts. With options.hashes, the
+ * ".json" must hold the blob's hash, so the blob is held back in memory
+ * (and hashed as it goes) until end_item_blob() writes both. So it is with
+ * limits, in case the item is skipped halfway, and with options.export_dir,
+ * where the blob goes to a file of its own and there are no parts.
+ */
+static void
+begin_item_blob(int index, const char* filename, const char* content_type)
+{
+    if (options.attachment_dedup) dedup_attachment_drop();
+    if (options.hashes || limits_enabled || options.export_dir) {
+        // with limits, we may have to drop a partly-written item
+        content_hashes.n_attachments = 0;
+        out_capture_begin();
+        if (limits_enabled) limits_begin_item();
+    } else {
+        output_json(index, filename, content_type, NULL);
+        output_indexed_part(index, ".blob", "");
+    }
+}
+
+static void
+end_item_blob(int index, const char* filename, const char* content_type)
+{
+    if (options.hashes || limits_enabled || options.export_dir) {
+        limits_end_item();
+        content_hashes.blob = out_capture_end();
+        if (options.export_dir) {
+            export_capture(filename);
+        } else {
+            output_json(index, filename, content_type, options.hashes ? &content_hashes : NULL);
+            output_indexed_part(index, ".blob", "");
+            out_capture_write();
+        }
+    }
+    // Only now are its attachments there for later copies to refer to
+    if (options.attachment_dedup) dedup_attachment_commit();
 }
 
 void
-increment_and_output_progress(Progress* progress)
+output_progress(size_t n_processed, size_t n_total)
 {
-    progress->n_processed += 1;
-	printf(
+	out_printf(
 		"\r\n--%s\r\nContent-Disposition: form-data; name=progress\r\n\r\n{\"children\":{\"nProcessed\":%lu,\"nTotal\":%lu}}",
 		mime_boundary,
-		progress->n_processed,
-		progress->n_total
+		n_processed,
+		n_total
 	);
 }
 
 void
+increment_and_output_progress(Progress* progress)
+{
+    progress->n_processed += 1;
+    if (progress->census_pending) {
+        // The first item is written while the census runs. From here on we
+        // need the count: every "progress" part has it, as in any run.
+        STATS_BEGIN(census_start);
+        progress->n_total = census_end();
+        progress->census_pending = 0;
+        STATS_END(PHASE_CENSUS, census_start);
+    }
+    output_progress(progress->n_processed, progress->n_total);
+}
+
+static const char* LIMIT_NAMES[] = { "time", "bytes", "depth", "error" };
+
+/**
+ * Writes a "warning" part in place of an item we skipped.
+ */
+void
+output_warning(const char* filename, Limit limit, const char* message)
+{
+    output_part("warning", "{\"filename\":");
+    out_json_string(filename);
+    out_printf(",\"limit\":\"%s\",\"message\":", LIMIT_NAMES[limit]);
+    out_json_string(message);
+    out_puts("}");
+}
+
+/**
+ * Drops what an item wrote before limits_exceeded() jumped out of it, and
+ * writes a warning instead. Returns 0, for "not written".
+ */
+static int
+skip_item(Progress* progress, const char* filename)
+{
+    out_capture_cancel();
+    if (options.attachment_dedup) dedup_attachment_drop();
+    stats_count_item(ITEM_SKIPPED);
+    output_warning(filename, limits_last_limit(), limits_last_message());
+    increment_and_output_progress(progress);
+    return 0;
+}
+
+int
 output_appointment(int index, Progress* progress, const char* filename, pst_item* item)
 {
-    output_json(index, filename, "text/calendar");
-    output_indexed_part(index, ".blob", "");
+    begin_item_blob(index, filename, "text/calendar");
+    if (setjmp(limits_env)) return skip_item(progress, filename); // see limits.h
+    TraceSpan span;
+    trace_begin(&span, "write_appointment");
     write_appointment(item);
+    trace_end(&span);
+    end_item_blob(index, filename, "text/calendar");
     increment_and_output_progress(progress);
+    return 1;
 }
 
-void
+int
 output_journal(int index, Progress* progress, const char* filename, pst_item* item)
 {
-    output_json(index, filename, "text/calendar");
-    output_indexed_part(index, ".blob", "");
+    begin_item_blob(index, filename, "text/calendar");
+    if (setjmp(limits_env)) return skip_item(progress, filename); // see limits.h
+    TraceSpan span;
+    trace_begin(&span, "write_journal");
     write_journal(item);
+    trace_end(&span);
+    end_item_blob(index, filename, "text/calendar");
     increment_and_output_progress(progress);
+    return 1;
 }
 
-void
+int
 output_vcard(int index, Progress* progress, const char* filename, pst_item* item)
 {
-    output_json(index, filename, "text/vcard");
-    output_indexed_part(index, ".blob", "");
+    begin_item_blob(index, filename, "text/vcard");
+    if (setjmp(limits_env)) return skip_item(progress, filename); // see limits.h
+    TraceSpan span;
+    trace_begin(&span, "write_vcard");
     write_vcard(item, item->contact, item->comment.str);
+    trace_end(&span);
+    end_item_blob(index, filename, "text/vcard");
     increment_and_output_progress(progress);
+    return 1;
 }
 
-void
+int
 output_email(int index, Progress* progress, const char* filename, pst_item* item, pst_file* pstfile)
 {
-    output_json(index, filename, "message/rfc822");
-    output_indexed_part(index, ".blob", "");
-    char *extra_mime_headers = NULL;
-    write_normal_email(item, pstfile, 1, &extra_mime_headers);
+    begin_item_blob(index, filename, "message/rfc822");
+    if (setjmp(limits_env)) return skip_item(progress, filename); // see limits.h
+    EmbeddedHeaders embedded = { NULL, 0, 0, NULL, 0 };
+    TraceSpan span;
+    trace_begin(&span, "write_normal_email");
+    write_normal_email(item, pstfile, 1, &embedded);
+    trace_end(&span);
+    end_item_blob(index, filename, "message/rfc822");
+    increment_and_output_progress(progress);
+    return 1;
+}
+
+/**
+ * Writes a "duplicate" part in place of an email whose copy, filename
+ * original from input original_input, has been written already (or in an
+ * earlier run). original_input is a JSON string's contents already.
+ */
+void
+output_duplicate(Progress* progress, const char* filename, const char* original, const char* original_input)
+{
+    output_part("duplicate", "{\"filename\":");
+    out_json_string(filename);
+    out_puts(",\"duplicateOf\":");
+    out_json_string(original);
+    out_printf(",\"duplicateOfInput\":\"%s\"}", original_input);
     increment_and_output_progress(progress);
 }
 
@@ -189,6 +372,18 @@ malloc_or_die(size_t size)
 	return ret;
 }
 
+int
+temp_file_or_die(void)
+{
+    char template[] = "extract-pst-spill-XXXXXX";
+    int fd = mkstemp(template);
+    if (fd < 0) {
+        die("could not create a temp file");
+    }
+    unlink(template);
+    return fd;
+}
+
 char*
 strdup_or_die(const char* s)
 {
@@ -222,32 +417,164 @@ strdup_parent_slash_num_dot_or_die(const char* parent, size_t n, const char* ext
     return ret;
 }
 
+/**
+ * Parses an item's own properties, but none of its subnodes. libpst reads
+ * every attachment's data (and long bodies) as it parses an item; this
+ * reads none of them, for items we won't render.
+ *
+ * The item may lack anything stored in a subnode: attachments, recipients,
+ * long bodies and headers. libpst may even fail to parse it.
+ */
+static pst_item*
+parse_item_properties(pst_file* pstfile, const pst_desc_tree* d_ptr)
+{
+    pst_desc_tree node = *d_ptr;
+    node.assoc_tree = NULL;
+    return pst_parse_item(pstfile, &node, NULL);
+}
+
+
+/**
+ * Returns nonzero if process() gives item a filename: if it's an email,
+ * contact, journal entry or appointment. process() tests for a folder
+ * first, so we do too.
+ */
+static int
+item_is_numbered(const pst_item* item)
+{
+    if (item->folder && item->file_as.str) return 0;
+    return (item->contact && item->type == PST_TYPE_CONTACT)
+        || (item->email && (item->type == PST_TYPE_NOTE || item->type == PST_TYPE_SCHEDULE || item->type == PST_TYPE_REPORT))
+        || (item->journal && item->type == PST_TYPE_JOURNAL)
+        || (item->appointment && item->type == PST_TYPE_APPOINTMENT);
+}
+
+
+static ItemClass
+class_of(const pst_item* item)
+{
+    return !item || (item->folder && item->file_as.str) ? ITEM_CLASS_NONE
+        : item_is_numbered(item) ? ITEM_CLASS_NUMBERED
+        : ITEM_CLASS_OTHER;
+}
+
+
+/**
+ * Returns the extension process() gives a numbered item's filename.
+ */
+static const char*
+item_extension(const pst_item* item)
+{
+    if (item->contact && item->type == PST_TYPE_CONTACT) return ".vcard";
+    if (item->email && (item->type == PST_TYPE_NOTE || item->type == PST_TYPE_SCHEDULE || item->type == PST_TYPE_REPORT)) return ".eml";
+    return ".ics";
+}
+
+
+ItemClass
+classify_item(pst_file* pstfile, pst_desc_tree* d_ptr)
+{
+    // What's missing from a properties-only parse can only make an item
+    // look like one we don't number: then we make sure.
+    pst_item* item = parse_item_properties(pstfile, d_ptr);
+    if (item && item_is_numbered(item)) {
+        pst_freeItem(item);
+        return ITEM_CLASS_NUMBERED;
+    }
+    if (item) pst_freeItem(item);
+
+    item = pst_parse_item(pstfile, d_ptr, NULL);
+    ItemClass class = class_of(item);
+    if (item) pst_freeItem(item);
+    return class;
+}
+
+
 /**
  * Outputs parts for the given item and returns starting_index + (nPartsOutput)
  */
 size_t
-process(pst_file *pstfile, pst_item *outeritem, pst_desc_tree *d_ptr, size_t starting_index, const char* outer_name, Progress* progress)
+process(pst_file *pstfile, pst_item *outeritem, const DescTable *table, const DescEntry *folder, size_t starting_index, const char* outer_name, Progress* progress)
 {
     pst_item *item = NULL;
     size_t item_number = 1;
     size_t index = starting_index;
+    uint32_t prefetched = 0; // children whose blocks we've started reading
 
     DEBUG_ENT("process");
 
-    for (; d_ptr; d_ptr = d_ptr->next) {
+    for (uint32_t i = 0; i < folder->n_children; i++) {
         DEBUG_INFO(("New item record\n"));
-        if (!d_ptr->desc) {
-            DEBUG_WARN(("ERROR item's desc record is NULL\n"));
+        const DescEntry* entry = desc_child(table, folder, i);
+        pst_desc_tree node;
+        desc_node(table, entry, &node);
+        pst_desc_tree* d_ptr = &node;
+        DEBUG_INFO(("Desc Email ID %#"PRIx64" [d_ptr->d_id = %#"PRIx64"]\n", d_ptr->desc->i_id, d_ptr->d_id));
+
+        // Items in earlier shards' ranges are counted, as the plan
+        // classified them, but not parsed: that keeps index and item_number
+        // as in a full run. Folders are parsed, for their names.
+        ShardRange range = entry->n_children ? shard_here() : shard_next_item();
+        if (range == SHARD_AFTER) break;
+        if (range == SHARD_MINE) {
+            // Only this shard's items: this one, if it's an item, and the
+            // ones left in the range after it
+            uint64_t items_left = shard_items_left();
+            if (!entry->n_children && items_left < UINT64_MAX) items_left += 1;
+            prefetched = prefetch_ahead(folder, i, prefetched, items_left);
+        }
+        if (range == SHARD_BEFORE && !entry->n_children) {
+            if (shard_item_numbered()) {
+                item_number += 1;
+                index += 1;
+            }
+            continue;
+        }
+        int render = range == SHARD_MINE;
+
+        TraceSpan item_span, parse_span;
+        trace_begin(&item_span, "item");
+        item_span.d_id = d_ptr->d_id;
+        item_span.path = *outer_name ? outer_name : "/";
+
+        if (render && !entry->n_children && !desc_is_folder(entry) && limits_max_bytes() < UINT64_MAX
+                && item_stored_bytes(pstfile, d_ptr, NULL) > limits_max_bytes()) {
+            // Too large to parse whole. Its own properties say what it is,
+            // so it's numbered (or not) as in a run without limits.
+            pst_item* properties = parse_item_properties(pstfile, d_ptr);
+            ItemClass class = class_of(properties);
+            if (class == ITEM_CLASS_NUMBERED) {
+                char* inner_name = strdup_parent_slash_num_dot_or_die(outer_name, item_number, item_extension(properties));
+                stats_count_item(ITEM_SKIPPED);
+                output_warning(inner_name, LIMIT_BYTES, "item stores more than EXTRACT_PST_ITEM_MAX_BYTES");
+                increment_and_output_progress(progress);
+                free(inner_name);
+                item_number += 1;
+                item_span.name = "skipped";
+            } else if (class == ITEM_CLASS_OTHER) {
+                // It would get no part anyway
+                stats_count_item(ITEM_OTHER);
+                progress->n_processed += 1;
+                item_span.name = "other";
+            }
+            if (properties) pst_freeItem(properties);
+            trace_end(&item_span);
             continue;
         }
-        DEBUG_INFO(("Desc Email ID %#"PRIx64" [d_ptr->d_id = %#"PRIx64"]\n", d_ptr->desc->i_id, d_ptr->d_id));
 
+        trace_begin(&parse_span, "pst_parse_item");
+        STATS_BEGIN(parse_start);
+        if (limits_enabled) limits_start_clock(); // the parse is on the item's time
         item = pst_parse_item(pstfile, d_ptr, NULL);
+        STATS_END(PHASE_PARSE_ITEM, parse_start);
+        trace_end(&parse_span);
         DEBUG_INFO(("About to process item\n"));
-        pst_convert_utf8(item, &item->file_as);
+        ItemArenaMark mark = item_arena_mark();
+        convert_utf8(item, &item->file_as);
 
         if (!item) {
             DEBUG_INFO(("A NULL item was seen\n"));
+            trace_end(&item_span);
             continue;
         }
 
@@ -257,51 +584,100 @@ process(pst_file *pstfile, pst_item *outeritem, pst_desc_tree *d_ptr, size_t sta
 
         if (item->folder && item->file_as.str) {
             DEBUG_INFO(("Processing Folder \"%s\"\n", item->file_as.str));
-            if (d_ptr->child) {
+            if (render) stats_count_item(ITEM_FOLDER);
+            item_span.name = "folder";
+            trace_end(&item_span);
+            if (entry->n_children) {
                 //if this is a non-empty folder other than deleted items, we want to recurse into it
                 char* inner_name = strdup_parent_sep_child_or_die(outer_name, "/", item->file_as.str);
-                index = process(pstfile, item, d_ptr->child, index, inner_name, progress);
+                index = process(pstfile, item, table, entry, index, inner_name, progress);
                 free(inner_name);
             }
         } else if (item->contact && (item->type == PST_TYPE_CONTACT)) {
             DEBUG_INFO(("Processing Contact\n"));
-            pst_convert_utf8_null(item, &item->comment);
-            char* inner_name = strdup_parent_slash_num_dot_or_die(outer_name, item_number, ".vcard");
-            output_vcard(index, progress, inner_name, item);
-            free(inner_name);
+            item_span.name = "contact";
+            int written = 1;
+            if (render) {
+                stats_count_item(ITEM_CONTACT);
+                convert_utf8_null(item, &item->comment);
+                char* inner_name = strdup_parent_slash_num_dot_or_die(outer_name, item_number, ".vcard");
+                written = output_vcard(index, progress, inner_name, item);
+                free(inner_name);
+            }
             item_number += 1;
-            index += 1;
+            if (written) index += 1;
         } else if (item->email && ((item->type == PST_TYPE_NOTE) || (item->type == PST_TYPE_SCHEDULE) || (item->type == PST_TYPE_REPORT))) {
             DEBUG_INFO(("Processing Email\n"));
-            char* inner_name = strdup_parent_slash_num_dot_or_die(outer_name, item_number, ".eml");
-            output_email(index, progress, inner_name, item, pstfile);
-            free(inner_name);
+            item_span.name = "email";
+            int written = 1;
+            if (render) {
+                char* inner_name = strdup_parent_slash_num_dot_or_die(outer_name, item_number, ".eml");
+                DedupKey key = { { 0, 0 } };
+                const char* original = NULL;
+                const char* original_input = NULL;
+                if (options.dedup) {
+                    key = dedup_email_key(item);
+                    original = dedup_find(key, &original_input);
+                }
+                if (original) {
+                    stats_count_item(ITEM_DUPLICATE_EMAIL);
+                    output_duplicate(progress, inner_name, original, original_input);
+                    written = 0;
+                } else {
+                    stats_count_item(ITEM_EMAIL);
+                    written = output_email(index, progress, inner_name, item, pstfile);
+                    // A skipped email isn't there to be a copy of
+                    if (written && options.dedup) dedup_add(key, inner_name);
+                }
+                free(inner_name);
+            }
             item_number += 1;
-            index += 1;
+            // A duplicate or skipped item takes no index: Overview expects
+            // indices without gaps.
+            if (written) index += 1;
         } else if (item->journal && (item->type == PST_TYPE_JOURNAL)) {
             DEBUG_INFO(("Processing Journal Entry\n"));
-            char* inner_name = strdup_parent_slash_num_dot_or_die(outer_name, item_number, ".ics");
-            output_journal(index, progress, inner_name, item);
-            free(inner_name);
+            item_span.name = "journal";
+            int written = 1;
+            if (render) {
+                stats_count_item(ITEM_JOURNAL);
+                char* inner_name = strdup_parent_slash_num_dot_or_die(outer_name, item_number, ".ics");
+                written = output_journal(index, progress, inner_name, item);
+                free(inner_name);
+            }
             item_number += 1;
-            index += 1;
+            if (written) index += 1;
         } else if (item->appointment && (item->type == PST_TYPE_APPOINTMENT)) {
             DEBUG_INFO(("Processing Appointment Entry\n"));
-            char* inner_name = strdup_parent_slash_num_dot_or_die(outer_name, item_number, ".ics");
-            output_appointment(index, progress, inner_name, item);
-            free(inner_name);
+            item_span.name = "appointment";
+            int written = 1;
+            if (render) {
+                stats_count_item(ITEM_APPOINTMENT);
+                char* inner_name = strdup_parent_slash_num_dot_or_die(outer_name, item_number, ".ics");
+                written = output_appointment(index, progress, inner_name, item);
+                free(inner_name);
+            }
             item_number += 1;
-            index += 1;
+            if (written) index += 1;
         } else if (item->message_store) {
             // there should only be one message_store, and we have already done it
             DEBUG_WARN(("item with message store content, type %i %s, skipping it\n", item->type, item->ascii_type));
-            progress->n_processed += 1;
+            item_span.name = "other";
+            if (render) {
+                stats_count_item(ITEM_OTHER);
+                progress->n_processed += 1;
+            }
         } else {
             DEBUG_WARN(("Unknown item type %i (%s) name (%s)\n",
                         item->type, item->ascii_type, item->file_as.str));
-            progress->n_processed += 1;
+            item_span.name = "other";
+            if (render) {
+                stats_count_item(ITEM_OTHER);
+                progress->n_processed += 1;
+            }
         }
-        pst_freeItem(item);
+        if (!item->folder || !item->file_as.str) trace_end(&item_span);
+        item_arena_free_item(item, mark);
     }
     DEBUG_RET();
 
@@ -349,11 +725,18 @@ char *my_stristr(char *haystack, char *needle) {
 }
 
 
-void write_embedded_message(pst_item_attach* attach, int mime_depth, pst_file* pstfile, char** extra_mime_headers)
+void write_embedded_message(pst_item_attach* attach, int mime_depth, pst_file* pstfile, EmbeddedHeaders* embedded)
 {
     pst_index_ll *ptr;
     DEBUG_ENT("write_embedded_message");
-    ptr = pst_getID(pstfile, attach->i_id);
+    if (limits_enabled) {
+        limits_check_depth(mime_depth);
+        limits_check_time();
+    }
+    TraceSpan span;
+    trace_begin(&span, "write_embedded_message");
+    ptr = id_index_get(pstfile, attach->i_id);
+    if (ptr) span.size = ptr->size;
 
     pst_desc_tree d_ptr;
     d_ptr.d_id        = 0;
@@ -367,7 +750,11 @@ void write_embedded_message(pst_item_attach* attach, int mime_depth, pst_file* p
     d_ptr.child       = NULL;
     d_ptr.child_tail  = NULL;
 
+    STATS_BEGIN(parse_start);
     pst_item *item = pst_parse_item(pstfile, &d_ptr, attach->id2_head);
+    STATS_END(PHASE_PARSE_ITEM, parse_start);
+    ItemArenaMark mark = item_arena_mark();
+    limits_hold(HELD_ITEM, item, mark.n_strings);
     // It appears that if the embedded message contains an appointment/
     // calendar item, pst_parse_item returns NULL due to the presence of
     // an unexpected reference type of 0x1048, which seems to represent
@@ -380,13 +767,15 @@ void write_embedded_message(pst_item_attach* attach, int mime_depth, pst_file* p
         if (!item->email) {
             DEBUG_WARN(("write_embedded_message: pst_parse_item returned type %d, not an email message", item->type));
         } else {
-            printf("\r\n--%s-%d\r\n", mime_boundary, mime_depth);
-            printf("Content-Type: %s\r\n\r\n", attach->mimetype.str);
-            write_normal_email(item, pstfile, mime_depth + 1, extra_mime_headers);
+            out_printf("\r\n--%s-%d\r\n", mime_boundary, mime_depth);
+            out_printf("Content-Type: %s\r\n\r\n", attach->mimetype.str);
+            write_normal_email(item, pstfile, mime_depth + 1, embedded);
         }
-        pst_freeItem(item);
+        limits_release(HELD_ITEM, item, mark.n_strings); // pst_freeItem()s it
+        item_arena_release(mark);
     }
 
+    trace_end(&span);
     DEBUG_RET();
 }
 
@@ -417,6 +806,66 @@ char *quote_string(char *inp) {
     return res;
 }
 
+static void
+add_attachment_hash(uint64_t hash)
+{
+    ContentHashes* hashes = &content_hashes;
+    if (hashes->n_attachments == hashes->attachments_cap) {
+        hashes->attachments_cap = hashes->attachments_cap ? hashes->attachments_cap * 2 : 16;
+        uint64_t* grown = realloc(hashes->attachments, hashes->attachments_cap * sizeof(uint64_t));
+        if (!grown) die("out of memory because a message had too many attachments");
+        hashes->attachments = grown;
+    }
+    hashes->attachments[hashes->n_attachments++] = hash;
+}
+
+/**
+ * Writes attachment data as base64, hashing it for the item's JSON if
+ * options.hashes is set.
+ */
+static void
+write_attachment_data(const char* data, size_t size)
+{
+    if (!options.hashes) {
+        out_base64(data, size);
+        return;
+    }
+
+    Digest digest;
+    digest_init(&digest, 0);
+    out_base64_digest(data, size, &digest);
+    add_attachment_hash(digest_final(&digest));
+}
+
+/**
+ * Copies a large attachment's data to a temp file, a block at a time, and
+ * maps it: we can then read it as if it were in memory, but the kernel can
+ * page it out. Sets *mapped (NULL if empty) and returns its size.
+ */
+static size_t
+spill_attachment(pst_file* pst, pst_item_attach* attach, void** mapped)
+{
+    int fd = temp_file_or_die();
+    FILE* f = fdopen(fd, "w+");
+    if (!f) {
+        close(fd);
+        die("could not open a temp file");
+    }
+    limits_hold(HELD_FILE, f, 0);
+    size_t size = pst_attach_to_file(pst, attach, f);
+    if (fflush(f) != 0) die("could not write a temp file: is the disk full?");
+
+    *mapped = NULL;
+    if (size > 0) {
+        *mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (*mapped == MAP_FAILED) die("could not map a temp file");
+        limits_hold(HELD_MAPPING, *mapped, size);
+        madvise(*mapped, size, MADV_SEQUENTIAL);
+    }
+    limits_release(HELD_FILE, f, 0); // the mapping stays
+    return size;
+}
+
 void write_inline_attachment(pst_item_attach* attach, int mime_depth, pst_file* pst)
 {
     DEBUG_ENT("write_inline_attachment");
@@ -424,7 +873,7 @@ void write_inline_attachment(pst_item_attach* attach, int mime_depth, pst_file*
 
     if (!attach->data.data) {
         // make sure we can fetch data from the id
-        pst_index_ll *ptr = pst_getID(pst, attach->i_id);
+        pst_index_ll *ptr = id_index_get(pst, attach->i_id);
         if (!ptr) {
             DEBUG_WARN(("Couldn't find ID pointer. Cannot save attachment to file\n"));
             DEBUG_RET();
@@ -432,12 +881,55 @@ void write_inline_attachment(pst_item_attach* attach, int mime_depth, pst_file*
         }
     }
 
-    printf("\r\n--%s-%d\r\n", mime_boundary, mime_depth);
-    printf("Content-Type: %s\r\n", attach->mimetype.str ? attach->mimetype.str : MIME_TYPE_DEFAULT);
-    printf("Content-Transfer-Encoding: base64\r\n");
+    TraceSpan span;
+    trace_begin(&span, "write_inline_attachment");
+
+    char* fetched = NULL;
+    void* mapped = NULL;
+    const char* data = attach->data.data;
+    size_t size = attach->data.size;
+    if (!data && stored_data_bytes(pst, attach->i_id) > options.spill_bytes) {
+        size = spill_attachment(pst, attach, &mapped);
+        data = mapped;
+    } else if (!data) {
+        size = pst_attach_to_mem(pst, attach, &fetched);
+        data = fetched;
+        limits_hold(HELD_MEMORY, fetched, size);
+    }
+    span.size = size;
+
+    // With attachment dedup, a copy of an attachment we've written becomes a
+    // reference to its hash (RFC 2046 message/external-body), with no data.
+    int hashed = options.attachment_dedup && size >= MIN_DEDUP_ATTACHMENT_SIZE;
+    int seen = 0;
+    uint64_t hash = 0;
+    if (hashed) {
+        Digest digest;
+        digest_init(&digest, 0);
+        digest_update(&digest, data, size);
+        hash = digest_final(&digest);
+        seen = dedup_attachment_seen(hash, size);
+    }
+
+    out_printf("\r\n--%s-%d\r\n", mime_boundary, mime_depth);
+    if (seen) {
+        out_printf(
+            "Content-Type: message/external-body; access-type=x-content-hash;\r\n"
+            "        hash=\"xxh64:%016" PRIx64 "\"; size=%zu\r\n\r\n",
+            hash,
+            size
+        );
+    }
+    out_printf("Content-Type: %s\r\n", attach->mimetype.str ? attach->mimetype.str : MIME_TYPE_DEFAULT);
+    if (!seen) {
+        out_printf("Content-Transfer-Encoding: base64\r\n");
+    }
+    if (hashed && !seen) {
+        out_printf("X-Content-Hash: xxh64:%016" PRIx64 "\r\n", hash);
+    }
 
     if (attach->content_id.str) {
-        printf("Content-ID: <%s>\r\n", attach->content_id.str);
+        out_printf("Content-ID: <%s>\r\n", attach->content_id.str);
     }
 
     if (attach->filename2.str) {
@@ -447,8 +939,9 @@ void write_inline_attachment(pst_item_attach* attach, int mime_depth, pst_file*
         // (since this header should be ASCII) but is almost always handled correctly (and in fact this is the only
         // way to get MS Outlook to correctly read a UTF8 filename, AFAICT, which is why we're doing it).
         char *escaped = quote_string(attach->filename2.str);
+        item_arena_detach(&attach->filename2);
         pst_rfc2231(&attach->filename2);
-        printf(
+        out_printf(
             "Content-Disposition: attachment; \r\n"
             "        filename*=%s;\r\n"
             "        filename=\"%s\"\r\n",
@@ -459,15 +952,26 @@ void write_inline_attachment(pst_item_attach* attach, int mime_depth, pst_file*
     }
     else if (attach->filename1.str) {
         // short filename never needs encoding
-        printf("Content-Disposition: attachment; filename=\"%s\"\r\n", attach->filename1.str);
+        out_printf("Content-Disposition: attachment; filename=\"%s\"\r\n", attach->filename1.str);
     }
     else {
         // no filename is inline
-        printf("Content-Disposition: inline\r\n");
+        out_printf("Content-Disposition: inline\r\n");
     }
-    printf("\r\n");
+    out_printf("\r\n");
 
-    pst_attach_to_file_base64(pst, attach, stdout);
+    if (!hashed) {
+        write_attachment_data(data, size);
+    } else {
+        if (!seen) out_base64(data, size);
+        if (options.hashes) add_attachment_hash(hash);
+    }
+    limits_release(HELD_MEMORY, fetched, size);
+    limits_release(HELD_MAPPING, mapped, size);
+    // libpst read it with the item: give it back now, not with the item
+    free(attach->data.data);
+    attach->data.data = NULL;
+    trace_end(&span);
     DEBUG_RET();
 }
 
@@ -578,6 +1082,7 @@ void header_strip_field(char *header, char *field)
 {
     char *t;
     while ((t = header_get_field(header, field))) {
+        if (limits_enabled) limits_check_time();
         char *e = header_end_field(t);
         if (e) {
             if (t == header) e++;   // if *t is not \n, we don't want to keep the \n at *e either.
@@ -614,41 +1119,69 @@ int test_base64(const char *body, size_t len)
 }
 
 
-void find_rfc822_headers(char** extra_mime_headers)
+/**
+ * Returns nonzero if a block of MIME part headers has Content-Type
+ * message/rfc822.
+ */
+static int
+is_rfc822_part(char* headers)
 {
-    DEBUG_ENT("find_rfc822_headers");
-    char *headers = *extra_mime_headers;
-    if (headers) {
-        char *temp, *t;
-        while ((temp = strstr(headers, "\n\n"))) {
-            temp[1] = '\0';
-            t = header_get_field(headers, "\nContent-Type:");
-            if (t) {
-                t++;
-                DEBUG_INFO(("found content type header\n"));
-                char *n = strchr(t, '\n');
-                char *s = strstr(t, ": ");
-                char *e = strchr(t, ';');
-                if (!e || (e > n)) e = n;
-                if (s && (s < e)) {
-                    s += 2;
-                    if (!strncasecmp(s, RFC822, e-s)) {
-                        headers = temp+2;   // found rfc822 header
-                        DEBUG_INFO(("found 822 headers\n%s\n", headers));
-                        break;
-                    }
-                }
-            }
-            //DEBUG_INFO(("skipping to next block after\n%s\n", headers));
-            headers = temp+2;   // skip to next chunk of headers
+    char* t = header_get_field(headers, "\nContent-Type:");
+    if (!t) return 0;
+    t++;
+    DEBUG_INFO(("found content type header\n"));
+    char *n = strchr(t, '\n');
+    char *s = strstr(t, ": ");
+    char *e = strchr(t, ';');
+    if (!e || (e > n)) e = n;
+    return s && (s < e) && !strncasecmp(s + 2, RFC822, e - (s + 2));
+}
+
+
+void index_embedded_headers(EmbeddedHeaders* embedded, char* mime_headers)
+{
+    DEBUG_ENT("index_embedded_headers");
+    embedded->indexed = 1;
+
+    // One email at a time has an index, so they can share the array
+    static char** blocks = NULL;
+    static size_t blocks_cap = 0;
+    size_t n_blocks = 1;
+    for (char* temp = mime_headers; (temp = strstr(temp, "\n\n")); temp += 2) n_blocks++;
+    if (n_blocks > blocks_cap) {
+        free(blocks);
+        blocks_cap = n_blocks * 2;
+        blocks = malloc_or_die(blocks_cap * sizeof(char*));
+    }
+    embedded->blocks = blocks;
+    embedded->n_blocks = 0;
+    embedded->next = 0;
+
+    // Split into blocks at blank lines. The block after each
+    // message/rfc822 block is that message's headers.
+    int after_rfc822 = 0;
+    for (char* headers = mime_headers; headers; ) {
+        char* temp = strstr(headers, "\n\n");
+        if (temp) temp[1] = '\0';
+        if (after_rfc822) {
+            DEBUG_INFO(("found 822 headers\n%s\n", headers));
+            embedded->blocks[embedded->n_blocks++] = headers;
         }
-        *extra_mime_headers = headers;
+        after_rfc822 = temp && is_rfc822_part(headers);
+        headers = temp ? temp + 2 : NULL;
     }
     DEBUG_RET();
 }
 
 
-static void
+char* next_embedded_headers(EmbeddedHeaders* embedded)
+{
+    embedded->current = embedded->next < embedded->n_blocks ? embedded->blocks[embedded->next++] : NULL;
+    return embedded->current;
+}
+
+
+void
 write_pst_string_with_len(
         const char* string,
         size_t len,
@@ -657,28 +1190,25 @@ write_pst_string_with_len(
         int mime_depth
 )
 {
-    printf("\r\n--%s-%d\r\n", mime_boundary, mime_depth);
+    out_printf("\r\n--%s-%d\r\n", mime_boundary, mime_depth);
 
     if (mime != NULL && charset_or_null != NULL) {
-        printf("Content-Type: %s; charset=\"%s\"\r\n", mime, charset_or_null);
+        out_printf("Content-Type: %s; charset=\"%s\"\r\n", mime, charset_or_null);
     } else if (mime != NULL) {
-        printf("Content-Type: %s\n", mime);
+        out_printf("Content-Type: %s\n", mime);
     } else {
-        printf("Content-Type: application/octet-stream");
+        out_printf("Content-Type: application/octet-stream");
     }
 
     int base64 = test_base64(string, len);
-    if (base64) printf("Content-Transfer-Encoding: base64\r\n");
+    if (base64) out_printf("Content-Transfer-Encoding: base64\r\n");
 
-    printf("\r\n");
+    out_printf("\r\n");
 
     if (base64) {
-        char *enc = pst_base64_encode((char*)string, len);
-        if (!enc) die("out of memory while base64-encoding");
-        fputs(enc, stdout);
-        free(enc);
+        out_base64(string, len);
     } else {
-        fwrite(string, len, 1, stdout);
+        out_write(string, len);
     }
 }
 
@@ -703,11 +1233,11 @@ void write_schedule_part(pst_item* item, const char* sender, int mime_depth)
     const char* charset = "utf-8";
     if (!item->appointment) return;
 
-    printf("\r\n--%s-%d\r\n", mime_boundary, mime_depth);
-    printf("Content-Type: %s; charset=\"%s\"; name=\"appointment.ics\"\r\n", "text/calendar", "utf-8");
-    printf("Content-Disposition: attachment; filename=\"appointment.ics\"\r\n\r\n");
+    out_printf("\r\n--%s-%d\r\n", mime_boundary, mime_depth);
+    out_printf("Content-Type: %s; charset=\"%s\"; name=\"appointment.ics\"\r\n", "text/calendar", "utf-8");
+    out_printf("Content-Disposition: attachment; filename=\"appointment.ics\"\r\n\r\n");
 
-    printf(
+    out_printf(
         "BEGIN:VCALENDAR\n"
         "PRODID:LibPST\n"
         "METHOD:REQUEST\n"
@@ -716,19 +1246,19 @@ void write_schedule_part(pst_item* item, const char* sender, int mime_depth)
 
     if (sender) {
         if (item->email->outlook_sender_name.str) {
-            printf("ORGANIZER;CN=\"%s\":MAILTO:%s\n", item->email->outlook_sender_name.str, sender);
+            out_printf("ORGANIZER;CN=\"%s\":MAILTO:%s\n", item->email->outlook_sender_name.str, sender);
         } else {
-            printf("ORGANIZER;CN=\"\":MAILTO:%s\n", sender);
+            out_printf("ORGANIZER;CN=\"\":MAILTO:%s\n", sender);
         }
     }
 
     write_appointment(item);
 
-    printf("END:VCALENDAR\n");
+    out_printf("END:VCALENDAR\n");
 }
 
 
-void write_normal_email(pst_item* item, pst_file* pst, int mime_depth, char** extra_mime_headers)
+void write_normal_email(pst_item* item, pst_file* pst, int mime_depth, EmbeddedHeaders* embedded)
 {
     char body_charset[30];
     char buffer_charset[30];
@@ -736,16 +1266,14 @@ void write_normal_email(pst_item* item, pst_file* pst, int mime_depth, char** ex
     char sender[60];
     int  sender_known = 0;
     char *temp = NULL;
-    time_t em_time;
-    char *c_time;
     char *headers = NULL;
     int has_from, has_subject, has_to, has_cc, has_date, has_msgid;
     has_from = has_subject = has_to = has_cc = has_date = has_msgid = 0;
     DEBUG_ENT("write_normal_email");
 
-    pst_convert_utf8_null(item, &item->email->header);
+    convert_utf8_null(item, &item->email->header);
     headers = valid_headers(item->email->header.str) ? item->email->header.str :
-              valid_headers(*extra_mime_headers)     ? *extra_mime_headers     :
+              valid_headers(embedded->current)       ? embedded->current       :
               NULL;
 
     // setup default body character set and report type
@@ -755,7 +1283,7 @@ void write_normal_email(pst_item* item, pst_file* pst, int mime_depth, char** ex
     body_report[sizeof(body_report)-1] = '\0';
 
     // setup default sender
-    pst_convert_utf8(item, &item->email->sender_address);
+    convert_utf8(item, &item->email->sender_address);
     if (item->email->sender_address.str && strchr(item->email->sender_address.str, '@')) {
         temp = item->email->sender_address.str;
         sender_known = 1;
@@ -766,18 +1294,8 @@ void write_normal_email(pst_item* item, pst_file* pst, int mime_depth, char** ex
     strncpy(sender, temp, sizeof(sender));
     sender[sizeof(sender)-1] = '\0';
 
-    // convert the sent date if it exists, or set it to a fixed date
-    if (item->email->sent_date) {
-        em_time = pst_fileTimeToUnixTime(item->email->sent_date);
-        c_time = ctime(&em_time);
-        if (c_time)
-            c_time[strlen(c_time)-1] = '\0'; //remove end \n
-        else
-            c_time = "Thu Jan 1 00:00:00 1970";
-    } else
-        c_time = "Thu Jan 1 00:00:00 1970";
-
     // we will always look at the headers to discover some stuff
+    STATS_BEGIN(headers_start);
     if (headers ) {
         char *t;
         removeCR(headers);
@@ -789,7 +1307,7 @@ void write_normal_email(pst_item* item, pst_file* pst, int mime_depth, char** ex
             // pointer to all the embedded MIME headers.
             // we use these to find the actual rfc822 headers for embedded message/rfc822 mime parts
             // but only for the outermost message
-            if (!*extra_mime_headers) *extra_mime_headers = temp+2;
+            if (!embedded->indexed) index_embedded_headers(embedded, temp+2);
             DEBUG_INFO(("Found extra mime headers\n%s\n", temp+2));
         }
 
@@ -833,11 +1351,12 @@ void write_normal_email(pst_item* item, pst_file* pst, int mime_depth, char** ex
         header_strip_field(headers, "\nX-MimeOLE:");
         header_strip_field(headers, "\nX-From_:");
     }
+    STATS_END(PHASE_HEADERS, headers_start);
 
     DEBUG_INFO(("About to print Header\n"));
 
     if (item && item->subject.str) {
-        pst_convert_utf8(item, &item->subject);
+        convert_utf8(item, &item->subject);
         DEBUG_INFO(("item->subject = %s\n", item->subject.str));
     }
 
@@ -845,9 +1364,9 @@ void write_normal_email(pst_item* item, pst_file* pst, int mime_depth, char** ex
     if (headers) {
         int len = strlen(headers);
         if (len > 0) {
-            printf("%s", headers);
+            out_write(headers, len);
             // make sure the headers end with a \n
-            if (headers[len-1] != '\n') printf("\n");
+            if (headers[len-1] != '\n') out_printf("\n");
             //char *h = headers;
             //while (*h) {
             //    char *e = strchr(h, '\n');
@@ -857,7 +1376,7 @@ void write_normal_email(pst_item* item, pst_file* pst, int mime_depth, char** ex
             //        d = 0;
             //    }
             //    // we could do rfc2047 encoding here if needed
-            //    printf("%.*s\n", (int)(e-h), h);
+            //    out_printf("%.*s\n", (int)(e-h), h);
             //    h = e + d;
             //}
         }
@@ -865,82 +1384,86 @@ void write_normal_email(pst_item* item, pst_file* pst, int mime_depth, char** ex
 
     // record read status
     if ((item->flags & PST_FLAG_READ) == PST_FLAG_READ) {
-        printf("Status: RO\n");
+        out_printf("Status: RO\n");
     }
 
     // create required header fields that are not already written
 
     if (!has_from) {
         if (item->email->outlook_sender_name.str){
+            item_arena_detach(&item->email->outlook_sender_name);
             pst_rfc2047(item, &item->email->outlook_sender_name, 1);
-            printf("From: %s <%s>\n", item->email->outlook_sender_name.str, sender);
+            out_printf("From: %s <%s>\n", item->email->outlook_sender_name.str, sender);
         } else {
-            printf("From: <%s>\n", sender);
+            out_printf("From: <%s>\n", sender);
         }
     }
 
     if (!has_subject) {
         if (item->subject.str) {
+            item_arena_detach(&item->subject);
             pst_rfc2047(item, &item->subject, 0);
-            printf("Subject: %s\n", item->subject.str);
+            out_printf("Subject: %s\n", item->subject.str);
         } else {
-            printf("Subject: \n");
+            out_printf("Subject: \n");
         }
     }
 
     if (!has_to && item->email->sentto_address.str) {
+        item_arena_detach(&item->email->sentto_address);
         pst_rfc2047(item, &item->email->sentto_address, 0);
-        printf("To: %s\n", item->email->sentto_address.str);
+        out_printf("To: %s\n", item->email->sentto_address.str);
     }
 
     if (!has_cc && item->email->cc_address.str) {
+        item_arena_detach(&item->email->cc_address);
         pst_rfc2047(item, &item->email->cc_address, 0);
-        printf("Cc: %s\n", item->email->cc_address.str);
+        out_printf("Cc: %s\n", item->email->cc_address.str);
     }
 
     if (!has_date && item->email->sent_date) {
-        char c_time[C_TIME_SIZE];
-        struct tm stm;
-        gmtime_r(&em_time, &stm);
-        strftime(c_time, C_TIME_SIZE, "%a, %d %b %Y %H:%M:%S %z", &stm);
-        printf("Date: %s\n", c_time);
+        char date[DATETIME_SIZE];
+        size_t len = format_filetime(item->email->sent_date, DATETIME_RFC2822, date);
+        out_puts("Date: ");
+        out_write(date, len);
+        out_write("\n", 1);
     }
 
     if (!has_msgid && item->email->messageid.str) {
-        pst_convert_utf8(item, &item->email->messageid);
-        printf("Message-Id: %s\n", item->email->messageid.str);
+        convert_utf8(item, &item->email->messageid);
+        out_printf("Message-Id: %s\n", item->email->messageid.str);
     }
 
     // add forensic headers to capture some .pst stuff that is not really
     // needed or used by mail clients
-    pst_convert_utf8_null(item, &item->email->sender_address);
+    convert_utf8_null(item, &item->email->sender_address);
     if (item->email->sender_address.str && !strchr(item->email->sender_address.str, '@')
                                         && strcmp(item->email->sender_address.str, ".")
                                         && (strlen(item->email->sender_address.str) > 0)) {
-        printf("X-libpst-forensic-sender: %s\n", item->email->sender_address.str);
+        out_printf("X-libpst-forensic-sender: %s\n", item->email->sender_address.str);
     }
 
     if (item->email->bcc_address.str) {
-        pst_convert_utf8(item, &item->email->bcc_address);
-        printf("X-libpst-forensic-bcc: %s\n", item->email->bcc_address.str);
+        convert_utf8(item, &item->email->bcc_address);
+        out_printf("X-libpst-forensic-bcc: %s\n", item->email->bcc_address.str);
     }
 
     // add our own mime headers
-    printf("MIME-Version: 1.0\n");
+    out_printf("MIME-Version: 1.0\n");
     if (item->type == PST_TYPE_REPORT) {
         // multipart/report for DSN/MDN reports
-        printf("Content-Type: multipart/report; report-type=%s;\n\tboundary=\"%s-%d\"\n", body_report, mime_boundary, mime_depth);
+        out_printf("Content-Type: multipart/report; report-type=%s;\n\tboundary=\"%s-%d\"\n", body_report, mime_boundary, mime_depth);
     }
     else {
-        printf("Content-Type: multipart/mixed;\n\tboundary=\"%s-%d\"\n", mime_boundary, mime_depth);
+        out_printf("Content-Type: multipart/mixed;\n\tboundary=\"%s-%d\"\n", mime_boundary, mime_depth);
     }
-    printf("\n");    // end of headers, start of body
+    out_printf("\n");    // end of headers, start of body
 
     int mime_alternative_depth = mime_depth + 1;
 
     // now dump the body parts in a multipart/alternative
     // They go from least-preferred to most-preferred
-    printf(
+    out_printf(
         "\r\n--%s-%d\r\n"
         "Content-Type: multipart/alternative;\r\n"
         "\tboundary=\"%s-%d\"\r\n",
@@ -963,11 +1486,17 @@ void write_normal_email(pst_item* item, pst_file* pst, int mime_depth, char** ex
 
     if (item->email->rtf_compressed.data) {
         size_t size;
+        TraceSpan span;
+        trace_begin(&span, "pst_lzfu_decompress");
+        span.size = item->email->rtf_compressed.size;
+        STATS_BEGIN(rtf_start);
         char* rtf_data = pst_lzfu_decompress(
             item->email->rtf_compressed.data,
             item->email->rtf_compressed.size,
             &size
         );
+        STATS_END(PHASE_RTF, rtf_start);
+        trace_end(&span);
         if (!rtf_data) die("out of memory while decompressing RTF message body");
         /*
          * Outlook stores an RTF with each email. If the email arrived as HTML,
@@ -1007,7 +1536,7 @@ void write_normal_email(pst_item* item, pst_file* pst, int mime_depth, char** ex
         item->email->encrypted_htmlbody.data = NULL;
     }
 
-    printf("\r\n--%s-%d--", mime_boundary, mime_alternative_depth);
+    out_printf("\r\n--%s-%d--", mime_boundary, mime_alternative_depth);
 
     if (item->type == PST_TYPE_SCHEDULE) {
         write_schedule_part(item, sender, mime_depth);
@@ -1018,20 +1547,21 @@ void write_normal_email(pst_item* item, pst_file* pst, int mime_depth, char** ex
         pst_item_attach* attach;
         int attach_num = 0;
         for (attach = item->attach; attach; attach = attach->next) {
-            pst_convert_utf8_null(item, &attach->filename1);
-            pst_convert_utf8_null(item, &attach->filename2);
-            pst_convert_utf8_null(item, &attach->mimetype);
+            convert_utf8_null(item, &attach->filename1);
+            convert_utf8_null(item, &attach->filename2);
+            convert_utf8_null(item, &attach->mimetype);
             DEBUG_INFO(("Attempting Attachment encoding\n"));
             if (attach->method == PST_ATTACH_EMBEDDED) {
                 DEBUG_INFO(("have an embedded rfc822 message attachment\n"));
                 if (attach->mimetype.str) {
                     DEBUG_INFO(("which already has a mime-type of %s\n", attach->mimetype.str));
-                    free(attach->mimetype.str);
                 }
-                attach->mimetype.str = strdup(RFC822);
+                char* mimetype = item_arena_alloc(sizeof(RFC822));
+                memcpy(mimetype, RFC822, sizeof(RFC822));
+                item_arena_set_string(&attach->mimetype, mimetype);
                 attach->mimetype.is_utf8 = 1;
-                find_rfc822_headers(extra_mime_headers);
-                write_embedded_message(attach, mime_depth, pst, extra_mime_headers);
+                next_embedded_headers(embedded);
+                write_embedded_message(attach, mime_depth, pst, embedded);
             }
             else if (attach->data.data || attach->i_id) {
                 write_inline_attachment(attach, mime_depth, pst);
@@ -1039,165 +1569,198 @@ void write_normal_email(pst_item* item, pst_file* pst, int mime_depth, char** ex
         }
     }
 
-    printf("\r\n--%s-%d--\r\n\r\n", mime_boundary, mime_depth);
+    out_printf("\r\n--%s-%d--\r\n\r\n", mime_boundary, mime_depth);
     DEBUG_RET();
 }
 
 
-void write_vcard(pst_item* item, pst_item_contact* contact, char comment[])
+// Offset of a pst_string in pst_item_contact
+#define CONTACT(field) offsetof(pst_item_contact, field)
+// A structured value's component that we never have
+#define NO_FIELD SIZE_MAX
+
+// A vCard property whose value is one of the contact's strings
+typedef struct {
+    const char* prefix;         // name, parameters and ':'
+    size_t      field;
+} VCardProperty;
+
+// An ADR property and its LABEL, written if the contact has the label
+typedef struct {
+    const char* adr_prefix;
+    const char* label_prefix;
+    size_t      label;
+    size_t      components[7];  // post office box, extended address, street,
+                                // city, region, postal code, country
+} VCardAddress;
+
+static const size_t VCARD_NAME[] = {
+    CONTACT(surname), CONTACT(first_name), CONTACT(middle_name),
+    CONTACT(display_name_prefix), CONTACT(suffix),
+};
+
+static const VCardProperty VCARD_EMAILS[] = {
+    { "NICKNAME:",              CONTACT(nickname) },
+    { "EMAIL:",                 CONTACT(address1) },
+    { "EMAIL:",                 CONTACT(address2) },
+    { "EMAIL:",                 CONTACT(address3) },
+};
+
+static const VCardAddress VCARD_ADDRESSES[] = {
+    { "ADR;TYPE=home:",   "LABEL;TYPE=home:",   CONTACT(home_address), {
+        CONTACT(home_po_box), NO_FIELD, CONTACT(home_street), CONTACT(home_city),
+        CONTACT(home_state), CONTACT(home_postal_code), CONTACT(home_country),
+    } },
+    { "ADR;TYPE=work:",   "LABEL;TYPE=work:",   CONTACT(business_address), {
+        CONTACT(business_po_box), NO_FIELD, CONTACT(business_street), CONTACT(business_city),
+        CONTACT(business_state), CONTACT(business_postal_code), CONTACT(business_country),
+    } },
+    { "ADR;TYPE=postal:", "LABEL;TYPE=postal:", CONTACT(other_address), {
+        CONTACT(other_po_box), NO_FIELD, CONTACT(other_street), CONTACT(other_city),
+        CONTACT(other_state), CONTACT(other_postal_code), CONTACT(other_country),
+    } },
+};
+
+static const VCardProperty VCARD_PHONES_AND_ROLES[] = {
+    { "TEL;TYPE=work,fax:",     CONTACT(business_fax) },
+    { "TEL;TYPE=work,voice:",   CONTACT(business_phone) },
+    { "TEL;TYPE=work,voice:",   CONTACT(business_phone2) },
+    { "TEL;TYPE=car,voice:",    CONTACT(car_phone) },
+    { "TEL;TYPE=home,fax:",     CONTACT(home_fax) },
+    { "TEL;TYPE=home,voice:",   CONTACT(home_phone) },
+    { "TEL;TYPE=home,voice:",   CONTACT(home_phone2) },
+    { "TEL;TYPE=isdn:",         CONTACT(isdn_phone) },
+    { "TEL;TYPE=cell,voice:",   CONTACT(mobile_phone) },
+    { "TEL;TYPE=msg:",          CONTACT(other_phone) },
+    { "TEL;TYPE=pager:",        CONTACT(pager_phone) },
+    { "TEL;TYPE=fax,pref:",     CONTACT(primary_fax) },
+    { "TEL;TYPE=phone,pref:",   CONTACT(primary_phone) },
+    { "TEL;TYPE=pcs:",          CONTACT(radio_phone) },
+    { "TEL;TYPE=bbs:",          CONTACT(telex) },
+    { "TITLE:",                 CONTACT(job_title) },
+    { "ROLE:",                  CONTACT(profession) },
+};
+
+static const VCardProperty VCARD_AGENT[] = {
+    { "FN:",                    CONTACT(assistant_name) },
+    { "TEL:",                   CONTACT(assistant_phone) },
+};
+
+static const char* const APPOINTMENT_CATEGORIES[] = {
+    [PST_APP_LABEL_IMPORTANT]   = "CATEGORIES:IMPORTANT\n",
+    [PST_APP_LABEL_BUSINESS]    = "CATEGORIES:BUSINESS\n",
+    [PST_APP_LABEL_PERSONAL]    = "CATEGORIES:PERSONAL\n",
+    [PST_APP_LABEL_VACATION]    = "CATEGORIES:VACATION\n",
+    [PST_APP_LABEL_MUST_ATTEND] = "CATEGORIES:MUST-ATTEND\n",
+    [PST_APP_LABEL_TRAVEL_REQ]  = "CATEGORIES:TRAVEL-REQUIRED\n",
+    [PST_APP_LABEL_NEEDS_PREP]  = "CATEGORIES:NEEDS-PREPARATION\n",
+    [PST_APP_LABEL_BIRTHDAY]    = "CATEGORIES:BIRTHDAY\n",
+    [PST_APP_LABEL_ANNIVERSARY] = "CATEGORIES:ANNIVERSARY\n",
+    [PST_APP_LABEL_PHONE_CALL]  = "CATEGORIES:PHONE-CALL\n",
+};
+
+
+static pst_string*
+contact_string(pst_item_contact* contact, size_t field)
 {
-    char*  result = NULL;
-    size_t resultlen = 0;
-    char   time_buffer[30];
-    // We can only call rfc escape once per printf, since the second call
-    // may free the buffer returned by the first call.
-    // I had tried to place those into a single printf - Carl.
+    return (pst_string*) ((char*) contact + field);
+}
+
+
+/**
+ * Writes "PREFIX:value\n", with value in utf-8 and escaped, if value is set.
+ */
+static void
+write_vproperty(pst_item* item, const char* prefix, pst_string* value)
+{
+    if (!value->str) return;
+    convert_utf8(item, value);
+    out_puts(prefix);
+    out_vtext(value->str);
+    out_write("\n", 1);
+}
 
-    DEBUG_ENT("write_vcard");
 
-    // make everything utf8
-    pst_convert_utf8_null(item, &contact->fullname);
-    pst_convert_utf8_null(item, &contact->surname);
-    pst_convert_utf8_null(item, &contact->first_name);
-    pst_convert_utf8_null(item, &contact->middle_name);
-    pst_convert_utf8_null(item, &contact->display_name_prefix);
-    pst_convert_utf8_null(item, &contact->suffix);
-    pst_convert_utf8_null(item, &contact->nickname);
-    pst_convert_utf8_null(item, &contact->address1);
-    pst_convert_utf8_null(item, &contact->address2);
-    pst_convert_utf8_null(item, &contact->address3);
-    pst_convert_utf8_null(item, &contact->home_po_box);
-    pst_convert_utf8_null(item, &contact->home_street);
-    pst_convert_utf8_null(item, &contact->home_city);
-    pst_convert_utf8_null(item, &contact->home_state);
-    pst_convert_utf8_null(item, &contact->home_postal_code);
-    pst_convert_utf8_null(item, &contact->home_country);
-    pst_convert_utf8_null(item, &contact->home_address);
-    pst_convert_utf8_null(item, &contact->business_po_box);
-    pst_convert_utf8_null(item, &contact->business_street);
-    pst_convert_utf8_null(item, &contact->business_city);
-    pst_convert_utf8_null(item, &contact->business_state);
-    pst_convert_utf8_null(item, &contact->business_postal_code);
-    pst_convert_utf8_null(item, &contact->business_country);
-    pst_convert_utf8_null(item, &contact->business_address);
-    pst_convert_utf8_null(item, &contact->other_po_box);
-    pst_convert_utf8_null(item, &contact->other_street);
-    pst_convert_utf8_null(item, &contact->other_city);
-    pst_convert_utf8_null(item, &contact->other_state);
-    pst_convert_utf8_null(item, &contact->other_postal_code);
-    pst_convert_utf8_null(item, &contact->other_country);
-    pst_convert_utf8_null(item, &contact->other_address);
-    pst_convert_utf8_null(item, &contact->business_fax);
-    pst_convert_utf8_null(item, &contact->business_phone);
-    pst_convert_utf8_null(item, &contact->business_phone2);
-    pst_convert_utf8_null(item, &contact->car_phone);
-    pst_convert_utf8_null(item, &contact->home_fax);
-    pst_convert_utf8_null(item, &contact->home_phone);
-    pst_convert_utf8_null(item, &contact->home_phone2);
-    pst_convert_utf8_null(item, &contact->isdn_phone);
-    pst_convert_utf8_null(item, &contact->mobile_phone);
-    pst_convert_utf8_null(item, &contact->other_phone);
-    pst_convert_utf8_null(item, &contact->pager_phone);
-    pst_convert_utf8_null(item, &contact->primary_fax);
-    pst_convert_utf8_null(item, &contact->primary_phone);
-    pst_convert_utf8_null(item, &contact->radio_phone);
-    pst_convert_utf8_null(item, &contact->telex);
-    pst_convert_utf8_null(item, &contact->job_title);
-    pst_convert_utf8_null(item, &contact->profession);
-    pst_convert_utf8_null(item, &contact->assistant_name);
-    pst_convert_utf8_null(item, &contact->assistant_phone);
-    pst_convert_utf8_null(item, &contact->company_name);
-    pst_convert_utf8_null(item, &item->body);
+static void
+write_vdatetime(const char* prefix, const FILETIME* filetime, DateTimeFormat format)
+{
+    char buffer[DATETIME_SIZE];
+    size_t len = format_filetime(filetime, format, buffer);
+    out_puts(prefix);
+    out_write(buffer, len);
+    out_write("\n", 1);
+}
+
+
+static void
+write_vcard_properties(pst_item* item, pst_item_contact* contact, const VCardProperty* properties, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        write_vproperty(item, properties[i].prefix, contact_string(contact, properties[i].field));
+    }
+}
+
+
+/**
+ * Writes a structured value: the fields, escaped, separated by ';'.
+ */
+static void
+write_vcard_components(pst_item* item, pst_item_contact* contact, const size_t* fields, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        if (i) out_write(";", 1);
+        if (fields[i] == NO_FIELD) continue;
+        pst_string* value = contact_string(contact, fields[i]);
+        if (!value->str) continue;
+        convert_utf8(item, value);
+        out_vtext(value->str);
+    }
+}
+
+
+void write_vcard(pst_item* item, pst_item_contact* contact, char comment[])
+{
+    DEBUG_ENT("write_vcard");
 
     // the specification I am following is (hopefully) RFC2426 vCard Mime Directory Profile
-    printf("BEGIN:VCARD\n");
-    printf("FN:%s\n", pst_rfc2426_escape(contact->fullname.str, &result, &resultlen));
-
-    //printf("N:%s;%s;%s;%s;%s\n",
-    printf("N:%s;", (!contact->surname.str)             ? "" : pst_rfc2426_escape(contact->surname.str, &result, &resultlen));
-    printf("%s;",   (!contact->first_name.str)          ? "" : pst_rfc2426_escape(contact->first_name.str, &result, &resultlen));
-    printf("%s;",   (!contact->middle_name.str)         ? "" : pst_rfc2426_escape(contact->middle_name.str, &result, &resultlen));
-    printf("%s;",   (!contact->display_name_prefix.str) ? "" : pst_rfc2426_escape(contact->display_name_prefix.str, &result, &resultlen));
-    printf("%s\n",  (!contact->suffix.str)              ? "" : pst_rfc2426_escape(contact->suffix.str, &result, &resultlen));
-
-    if (contact->nickname.str)
-        printf("NICKNAME:%s\n", pst_rfc2426_escape(contact->nickname.str, &result, &resultlen));
-    if (contact->address1.str)
-        printf("EMAIL:%s\n", pst_rfc2426_escape(contact->address1.str, &result, &resultlen));
-    if (contact->address2.str)
-        printf("EMAIL:%s\n", pst_rfc2426_escape(contact->address2.str, &result, &resultlen));
-    if (contact->address3.str)
-        printf("EMAIL:%s\n", pst_rfc2426_escape(contact->address3.str, &result, &resultlen));
-    if (contact->birthday)
-        printf("BDAY:%s\n", pst_rfc2425_datetime_format(contact->birthday, sizeof(time_buffer), time_buffer));
-
-    if (contact->home_address.str) {
-        //printf("ADR;TYPE=home:%s;%s;%s;%s;%s;%s;%s\n",
-        printf("ADR;TYPE=home:%s;",  (!contact->home_po_box.str)      ? "" : pst_rfc2426_escape(contact->home_po_box.str, &result, &resultlen));
-        printf("%s;",                ""); // extended Address
-        printf("%s;",                (!contact->home_street.str)      ? "" : pst_rfc2426_escape(contact->home_street.str, &result, &resultlen));
-        printf("%s;",                (!contact->home_city.str)        ? "" : pst_rfc2426_escape(contact->home_city.str, &result, &resultlen));
-        printf("%s;",                (!contact->home_state.str)       ? "" : pst_rfc2426_escape(contact->home_state.str, &result, &resultlen));
-        printf("%s;",                (!contact->home_postal_code.str) ? "" : pst_rfc2426_escape(contact->home_postal_code.str, &result, &resultlen));
-        printf("%s\n",               (!contact->home_country.str)     ? "" : pst_rfc2426_escape(contact->home_country.str, &result, &resultlen));
-        printf("LABEL;TYPE=home:%s\n", pst_rfc2426_escape(contact->home_address.str, &result, &resultlen));
-    }
-
-    if (contact->business_address.str) {
-        //printf("ADR;TYPE=work:%s;%s;%s;%s;%s;%s;%s\n",
-        printf("ADR;TYPE=work:%s;",  (!contact->business_po_box.str)      ? "" : pst_rfc2426_escape(contact->business_po_box.str, &result, &resultlen));
-        printf("%s;",                ""); // extended Address
-        printf("%s;",                (!contact->business_street.str)      ? "" : pst_rfc2426_escape(contact->business_street.str, &result, &resultlen));
-        printf("%s;",                (!contact->business_city.str)        ? "" : pst_rfc2426_escape(contact->business_city.str, &result, &resultlen));
-        printf("%s;",                (!contact->business_state.str)       ? "" : pst_rfc2426_escape(contact->business_state.str, &result, &resultlen));
-        printf("%s;",                (!contact->business_postal_code.str) ? "" : pst_rfc2426_escape(contact->business_postal_code.str, &result, &resultlen));
-        printf("%s\n",               (!contact->business_country.str)     ? "" : pst_rfc2426_escape(contact->business_country.str, &result, &resultlen));
-        printf("LABEL;TYPE=work:%s\n", pst_rfc2426_escape(contact->business_address.str, &result, &resultlen));
-    }
-
-    if (contact->other_address.str) {
-        //printf("ADR;TYPE=postal:%s;%s;%s;%s;%s;%s;%s\n",
-        printf("ADR;TYPE=postal:%s;",(!contact->other_po_box.str)       ? "" : pst_rfc2426_escape(contact->other_po_box.str, &result, &resultlen));
-        printf("%s;",                ""); // extended Address
-        printf("%s;",                (!contact->other_street.str)       ? "" : pst_rfc2426_escape(contact->other_street.str, &result, &resultlen));
-        printf("%s;",                (!contact->other_city.str)         ? "" : pst_rfc2426_escape(contact->other_city.str, &result, &resultlen));
-        printf("%s;",                (!contact->other_state.str)        ? "" : pst_rfc2426_escape(contact->other_state.str, &result, &resultlen));
-        printf("%s;",                (!contact->other_postal_code.str)  ? "" : pst_rfc2426_escape(contact->other_postal_code.str, &result, &resultlen));
-        printf("%s\n",               (!contact->other_country.str)      ? "" : pst_rfc2426_escape(contact->other_country.str, &result, &resultlen));
-        printf("LABEL;TYPE=postal:%s\n", pst_rfc2426_escape(contact->other_address.str, &result, &resultlen));
-    }
-
-    if (contact->business_fax.str)      printf("TEL;TYPE=work,fax:%s\n",         pst_rfc2426_escape(contact->business_fax.str, &result, &resultlen));
-    if (contact->business_phone.str)    printf("TEL;TYPE=work,voice:%s\n",       pst_rfc2426_escape(contact->business_phone.str, &result, &resultlen));
-    if (contact->business_phone2.str)   printf("TEL;TYPE=work,voice:%s\n",       pst_rfc2426_escape(contact->business_phone2.str, &result, &resultlen));
-    if (contact->car_phone.str)         printf("TEL;TYPE=car,voice:%s\n",        pst_rfc2426_escape(contact->car_phone.str, &result, &resultlen));
-    if (contact->home_fax.str)          printf("TEL;TYPE=home,fax:%s\n",         pst_rfc2426_escape(contact->home_fax.str, &result, &resultlen));
-    if (contact->home_phone.str)        printf("TEL;TYPE=home,voice:%s\n",       pst_rfc2426_escape(contact->home_phone.str, &result, &resultlen));
-    if (contact->home_phone2.str)       printf("TEL;TYPE=home,voice:%s\n",       pst_rfc2426_escape(contact->home_phone2.str, &result, &resultlen));
-    if (contact->isdn_phone.str)        printf("TEL;TYPE=isdn:%s\n",             pst_rfc2426_escape(contact->isdn_phone.str, &result, &resultlen));
-    if (contact->mobile_phone.str)      printf("TEL;TYPE=cell,voice:%s\n",       pst_rfc2426_escape(contact->mobile_phone.str, &result, &resultlen));
-    if (contact->other_phone.str)       printf("TEL;TYPE=msg:%s\n",              pst_rfc2426_escape(contact->other_phone.str, &result, &resultlen));
-    if (contact->pager_phone.str)       printf("TEL;TYPE=pager:%s\n",            pst_rfc2426_escape(contact->pager_phone.str, &result, &resultlen));
-    if (contact->primary_fax.str)       printf("TEL;TYPE=fax,pref:%s\n",         pst_rfc2426_escape(contact->primary_fax.str, &result, &resultlen));
-    if (contact->primary_phone.str)     printf("TEL;TYPE=phone,pref:%s\n",       pst_rfc2426_escape(contact->primary_phone.str, &result, &resultlen));
-    if (contact->radio_phone.str)       printf("TEL;TYPE=pcs:%s\n",              pst_rfc2426_escape(contact->radio_phone.str, &result, &resultlen));
-    if (contact->telex.str)             printf("TEL;TYPE=bbs:%s\n",              pst_rfc2426_escape(contact->telex.str, &result, &resultlen));
-    if (contact->job_title.str)         printf("TITLE:%s\n",                     pst_rfc2426_escape(contact->job_title.str, &result, &resultlen));
-    if (contact->profession.str)        printf("ROLE:%s\n",                      pst_rfc2426_escape(contact->profession.str, &result, &resultlen));
+    out_puts("BEGIN:VCARD\n");
+    out_puts("FN:");
+    convert_utf8_null(item, &contact->fullname);
+    out_vtext(contact->fullname.str);
+    out_puts("\nN:");
+    write_vcard_components(item, contact, VCARD_NAME, sizeof(VCARD_NAME) / sizeof(VCARD_NAME[0]));
+    out_write("\n", 1);
+
+    write_vcard_properties(item, contact, VCARD_EMAILS, sizeof(VCARD_EMAILS) / sizeof(VCARD_EMAILS[0]));
+    if (contact->birthday) write_vdatetime("BDAY:", contact->birthday, DATETIME_RFC2425);
+
+    for (size_t i = 0; i < sizeof(VCARD_ADDRESSES) / sizeof(VCARD_ADDRESSES[0]); i++) {
+        const VCardAddress* address = &VCARD_ADDRESSES[i];
+        pst_string* label = contact_string(contact, address->label);
+        if (!label->str) continue;
+        out_puts(address->adr_prefix);
+        write_vcard_components(item, contact, address->components, sizeof(address->components) / sizeof(address->components[0]));
+        out_write("\n", 1);
+        write_vproperty(item, address->label_prefix, label);
+    }
+
+    write_vcard_properties(item, contact, VCARD_PHONES_AND_ROLES, sizeof(VCARD_PHONES_AND_ROLES) / sizeof(VCARD_PHONES_AND_ROLES[0]));
     if (contact->assistant_name.str || contact->assistant_phone.str) {
-        printf("AGENT:BEGIN:VCARD\n");
-        if (contact->assistant_name.str)    printf("FN:%s\n",                    pst_rfc2426_escape(contact->assistant_name.str, &result, &resultlen));
-        if (contact->assistant_phone.str)   printf("TEL:%s\n",                   pst_rfc2426_escape(contact->assistant_phone.str, &result, &resultlen));
+        out_puts("AGENT:BEGIN:VCARD\n");
+        write_vcard_properties(item, contact, VCARD_AGENT, sizeof(VCARD_AGENT) / sizeof(VCARD_AGENT[0]));
     }
-    if (contact->company_name.str)      printf("ORG:%s\n",                       pst_rfc2426_escape(contact->company_name.str, &result, &resultlen));
-    if (comment)                        printf("NOTE:%s\n",                      pst_rfc2426_escape(comment, &result, &resultlen));
-    if (item->body.str)                 printf("NOTE:%s\n",                      pst_rfc2426_escape(item->body.str, &result, &resultlen));
+    write_vproperty(item, "ORG:", &contact->company_name);
+    if (comment) {
+        out_puts("NOTE:");
+        out_vtext(comment);
+        out_write("\n", 1);
+    }
+    write_vproperty(item, "NOTE:", &item->body);
 
     write_extra_categories(item);
 
-    printf("VERSION: 3.0\n");
-    printf("END:VCARD\n\n");
-    if (result) free(result);
+    out_puts("VERSION: 3.0\n");
+    out_puts("END:VCARD\n\n");
     DEBUG_RET();
 }
 
@@ -1210,200 +1773,163 @@ void write_vcard(pst_item* item, pst_item_contact* contact, char comment[])
  */
 int write_extra_categories(pst_item* item)
 {
-    char*  result = NULL;
-    size_t resultlen = 0;
     pst_item_extra_field *ef = item->extra_fields;
-    const char *fmt = "CATEGORIES:%s";
+    const char *separator = "CATEGORIES:";
     int category_started = 0;
     while (ef) {
         if (strcmp(ef->field_name, "Keywords") == 0) {
-            printf(fmt, pst_rfc2426_escape(ef->value, &result, &resultlen));
-            fmt = ", %s";
+            out_puts(separator);
+            out_vtext(ef->value);
+            separator = ", ";
             category_started = 1;
         }
         ef = ef->next;
     }
-    if (category_started) printf("\n");
-    if (result) free(result);
+    if (category_started) out_write("\n", 1);
     return category_started;
 }
 
 
 void write_journal(pst_item* item)
 {
-    char*  result = NULL;
-    size_t resultlen = 0;
-    char   time_buffer[30];
     pst_item_journal* journal = item->journal;
 
-    // make everything utf8
-    pst_convert_utf8_null(item, &item->subject);
-    pst_convert_utf8_null(item, &item->body);
-
-    printf("BEGIN:VJOURNAL\n");
-    if (item->create_date)
-        printf("CREATED:%s\n",                 pst_rfc2445_datetime_format(item->create_date, sizeof(time_buffer), time_buffer));
-    if (item->modify_date)
-        printf("LAST-MOD:%s\n",                pst_rfc2445_datetime_format(item->modify_date, sizeof(time_buffer), time_buffer));
-    if (item->subject.str)
-        printf("SUMMARY:%s\n",                 pst_rfc2426_escape(item->subject.str, &result, &resultlen));
-    if (item->body.str)
-        printf("DESCRIPTION:%s\n",             pst_rfc2426_escape(item->body.str, &result, &resultlen));
-    if (journal && journal->start)
-        printf("DTSTART;VALUE=DATE-TIME:%s\n", pst_rfc2445_datetime_format(journal->start, sizeof(time_buffer), time_buffer));
-    printf("END:VJOURNAL\n");
-    if (result) free(result);
+    out_puts("BEGIN:VJOURNAL\n");
+    if (item->create_date)        write_vdatetime("CREATED:", item->create_date, DATETIME_RFC2445);
+    if (item->modify_date)        write_vdatetime("LAST-MOD:", item->modify_date, DATETIME_RFC2445);
+    write_vproperty(item, "SUMMARY:", &item->subject);
+    write_vproperty(item, "DESCRIPTION:", &item->body);
+    if (journal && journal->start) write_vdatetime("DTSTART;VALUE=DATE-TIME:", journal->start, DATETIME_RFC2445);
+    out_puts("END:VJOURNAL\n");
 }
 
 
 void write_appointment(pst_item* item)
 {
-    char*  result = NULL;
-    size_t resultlen = 0;
-    char   time_buffer[30];
     pst_item_appointment* appointment = item->appointment;
 
-    // make everything utf8
-    pst_convert_utf8_null(item, &item->subject);
-    pst_convert_utf8_null(item, &item->body);
-    pst_convert_utf8_null(item, &appointment->location);
-
-    printf("UID:%#"PRIx64"\n", item->block_id);
-    if (item->create_date)
-        printf("CREATED:%s\n",                 pst_rfc2445_datetime_format(item->create_date, sizeof(time_buffer), time_buffer));
-    if (item->modify_date)
-        printf("LAST-MOD:%s\n",                pst_rfc2445_datetime_format(item->modify_date, sizeof(time_buffer), time_buffer));
-    if (item->subject.str)
-        printf("SUMMARY:%s\n",                 pst_rfc2426_escape(item->subject.str, &result, &resultlen));
-    if (item->body.str)
-        printf("DESCRIPTION:%s\n",             pst_rfc2426_escape(item->body.str, &result, &resultlen));
-    if (appointment && appointment->start)
-        printf("DTSTART;VALUE=DATE-TIME:%s\n", pst_rfc2445_datetime_format(appointment->start, sizeof(time_buffer), time_buffer));
-    if (appointment && appointment->end)
-        printf("DTEND;VALUE=DATE-TIME:%s\n",   pst_rfc2445_datetime_format(appointment->end, sizeof(time_buffer), time_buffer));
-    if (appointment && appointment->location.str)
-        printf("LOCATION:%s\n",                pst_rfc2426_escape(appointment->location.str, &result, &resultlen));
+    out_printf("UID:%#"PRIx64"\n", item->block_id);
+    if (item->create_date)        write_vdatetime("CREATED:", item->create_date, DATETIME_RFC2445);
+    if (item->modify_date)        write_vdatetime("LAST-MOD:", item->modify_date, DATETIME_RFC2445);
+    write_vproperty(item, "SUMMARY:", &item->subject);
+    write_vproperty(item, "DESCRIPTION:", &item->body);
+    if (appointment && appointment->start) write_vdatetime("DTSTART;VALUE=DATE-TIME:", appointment->start, DATETIME_RFC2445);
+    if (appointment && appointment->end)   write_vdatetime("DTEND;VALUE=DATE-TIME:", appointment->end, DATETIME_RFC2445);
+    if (appointment) write_vproperty(item, "LOCATION:", &appointment->location);
     if (appointment) {
         switch (appointment->showas) {
             case PST_FREEBUSY_TENTATIVE:
-                printf("STATUS:TENTATIVE\n");
+                out_puts("STATUS:TENTATIVE\n");
                 break;
             case PST_FREEBUSY_FREE:
                 // mark as transparent and as confirmed
-                printf("TRANSP:TRANSPARENT\n");
+                out_puts("TRANSP:TRANSPARENT\n");
             case PST_FREEBUSY_BUSY:
             case PST_FREEBUSY_OUT_OF_OFFICE:
-                printf("STATUS:CONFIRMED\n");
+                out_puts("STATUS:CONFIRMED\n");
                 break;
         }
         if (appointment->is_recurring) {
             const char* rules[] = {"DAILY", "WEEKLY", "MONTHLY", "YEARLY"};
             const char* days[]  = {"SU", "MO", "TU", "WE", "TH", "FR", "SA"};
             pst_recurrence *rdata = pst_convert_recurrence(appointment);
-            printf("RRULE:FREQ=%s", rules[rdata->type]);
-            if (rdata->count)       printf(";COUNT=%u",      rdata->count);
+            out_printf("RRULE:FREQ=%s", rules[rdata->type]);
+            if (rdata->count)       out_printf(";COUNT=%u",      rdata->count);
             if ((rdata->interval != 1) &&
-                (rdata->interval))  printf(";INTERVAL=%u",   rdata->interval);
-            if (rdata->dayofmonth)  printf(";BYMONTHDAY=%d", rdata->dayofmonth);
-            if (rdata->monthofyear) printf(";BYMONTH=%d",    rdata->monthofyear);
-            if (rdata->position)    printf(";BYSETPOS=%d",   rdata->position);
+                (rdata->interval))  out_printf(";INTERVAL=%u",   rdata->interval);
+            if (rdata->dayofmonth)  out_printf(";BYMONTHDAY=%d", rdata->dayofmonth);
+            if (rdata->monthofyear) out_printf(";BYMONTH=%d",    rdata->monthofyear);
+            if (rdata->position)    out_printf(";BYSETPOS=%d",   rdata->position);
             if (rdata->bydaymask) {
                 int empty = 1;
                 for (int i = 0; i < 7; i++) {
                     int bit = 1 << i;
                     if (bit & rdata->bydaymask) {
-                    	printf("%s%s", empty ? ";BYDAY=" : ",", days[i]);
+                    	out_printf("%s%s", empty ? ";BYDAY=" : ",", days[i]);
                     	empty = 0;
                     }
                 }
             }
-            printf("\n");
+            out_printf("\n");
             pst_free_recurrence(rdata);
         }
-        switch (appointment->label) {
-            case PST_APP_LABEL_NONE:
-                if (!write_extra_categories(item)) printf("CATEGORIES:NONE\n");
-                break;
-            case PST_APP_LABEL_IMPORTANT:
-                printf("CATEGORIES:IMPORTANT\n");
-                break;
-            case PST_APP_LABEL_BUSINESS:
-                printf("CATEGORIES:BUSINESS\n");
-                break;
-            case PST_APP_LABEL_PERSONAL:
-                printf("CATEGORIES:PERSONAL\n");
-                break;
-            case PST_APP_LABEL_VACATION:
-                printf("CATEGORIES:VACATION\n");
-                break;
-            case PST_APP_LABEL_MUST_ATTEND:
-                printf("CATEGORIES:MUST-ATTEND\n");
-                break;
-            case PST_APP_LABEL_TRAVEL_REQ:
-                printf("CATEGORIES:TRAVEL-REQUIRED\n");
-                break;
-            case PST_APP_LABEL_NEEDS_PREP:
-                printf("CATEGORIES:NEEDS-PREPARATION\n");
-                break;
-            case PST_APP_LABEL_BIRTHDAY:
-                printf("CATEGORIES:BIRTHDAY\n");
-                break;
-            case PST_APP_LABEL_ANNIVERSARY:
-                printf("CATEGORIES:ANNIVERSARY\n");
-                break;
-            case PST_APP_LABEL_PHONE_CALL:
-                printf("CATEGORIES:PHONE-CALL\n");
-                break;
+        if (appointment->label == PST_APP_LABEL_NONE) {
+            if (!write_extra_categories(item)) out_puts("CATEGORIES:NONE\n");
+        } else if (appointment->label > 0
+                   && (size_t) appointment->label < sizeof(APPOINTMENT_CATEGORIES) / sizeof(APPOINTMENT_CATEGORIES[0])) {
+            out_puts(APPOINTMENT_CATEGORIES[appointment->label]);
         }
         // ignore bogus alarms
         if (appointment->alarm && (appointment->alarm_minutes >= 0) && (appointment->alarm_minutes < 1440)) {
-            printf("BEGIN:VALARM\n");
-            printf("TRIGGER:-PT%dM\n", appointment->alarm_minutes);
-            printf("ACTION:DISPLAY\n");
-            printf("DESCRIPTION:Reminder\n");
-            printf("END:VALARM\n");
+            out_printf("BEGIN:VALARM\nTRIGGER:-PT%dM\n", appointment->alarm_minutes);
+            out_puts("ACTION:DISPLAY\nDESCRIPTION:Reminder\nEND:VALARM\n");
         }
     }
-    printf("END:VEVENT\n");
-    if (result) free(result);
+    out_puts("END:VEVENT\n");
 }
 
 
-static size_t
-count_items_in_top_of_folders(pst_file* pstfile, pst_desc_tree* d_ptr)
+#ifndef EXTRACT_PST_NO_MAIN
+
+/**
+ * Copies the node of the named property map (descriptor 0x61), which
+ * pst_load_extended_attributes() finds in libpst's tree -- a tree
+ * desc_table_build() frees. Returns 0 if the PST has none.
+ */
+static int
+find_named_property_map(pst_file* pstfile, pst_desc_tree* node)
 {
-    size_t n = 0;
+    pst_desc_tree* found = pst_getDptr(pstfile, 0x61);
+    if (!found) return 0;
+    memset(node, 0, sizeof(*node));
+    node->d_id = found->d_id;
+    node->parent_d_id = found->parent_d_id;
+    node->desc = found->desc;
+    node->assoc_tree = found->assoc_tree;
+    return 1;
+}
 
-    // No need to recurse: top-level folders count all children (right? TODO check)
-    for (pst_desc_tree *child = d_ptr->child; child != NULL; child = child->next) {
-        pst_item* item = pst_parse_item(pstfile, child, NULL);
-        if (item->folder && item->file_as.str && item->folder->item_count) {
-            n += item->folder->item_count;
-        }
-        pst_freeItem(item);
-    }
 
-    return n;
+/**
+ * Loads the named property map from the node find_named_property_map()
+ * copied, so pst_parse_item() can map items' named properties.
+ */
+static void
+load_named_property_map(pst_file* pstfile, pst_desc_tree* node)
+{
+    pst_desc_tree* d_head = pstfile->d_head;
+    pst_desc_tree* d_tail = pstfile->d_tail;
+    pstfile->d_head = pstfile->d_tail = node;
+    pst_load_extended_attributes(pstfile);
+    pstfile->d_head = d_head;
+    pstfile->d_tail = d_tail;
 }
 
 
-int main(int argc, char* const* argv) {
+/**
+ * Converts the PST at path, writing a part per item. Item filenames start
+ * with outer_name.
+ */
+static void
+convert(const char* path, const char* outer_name)
+{
     pst_item *item = NULL;
     pst_desc_tree *d_ptr;
-    int c,x;
-    char *temp = NULL;               //temporary char pointer
-
-    mime_boundary = argv[1];
-    json_template = argv[2];
 
     pst_file pstfile;
-    if (pst_open(&pstfile, "input.blob", NULL)) {
+    STATS_BEGIN(index_start);
+    if (pst_open(&pstfile, path, NULL)) {
     	    die("error opening PST");
     }
     if (pst_load_index(&pstfile)) {
     	    die("error loading PST index");
     }
-    pst_load_extended_attributes(&pstfile);
+    id_index_build(&pstfile);
+    STATS_END(PHASE_INDEX_LOAD, index_start);
+
+    // Items need the named property map, but nothing before them does
+    pst_desc_tree named_properties;
+    int has_named_properties = find_named_property_map(&pstfile, &named_properties);
 
     d_ptr = pstfile.d_head; // first record is main record
     item  = pst_parse_item(&pstfile, d_ptr, NULL);
@@ -1425,16 +1951,132 @@ int main(int argc, char* const* argv) {
         die("Top of folders record not found.");
     }
 
+    // From here on, we walk the table, not libpst's (larger) tree
+    DescTable table;
+    desc_table_build(&table, &pstfile, d_ptr);
+
     Progress progress;
     progress.n_processed = 0;
-    progress.n_total = count_items_in_top_of_folders(&pstfile, d_ptr);
+    progress.n_total = 0;
+    progress.census_pending = 0;
+    if (options.n_shards == 1) {
+        STATS_BEGIN(census_start);
+        census_begin(&pstfile, &table, path);
+        progress.census_pending = 1;
+        STATS_END(PHASE_CENSUS, census_start);
+    }
 
-    process(&pstfile, item, d_ptr->child, 0, "", &progress);    // do the children of TOPF
+    if (options.estimate) output_estimate(&pstfile, &table);
 
-    output_done();
+    if (has_named_properties) {
+        STATS_BEGIN(named_properties_start);
+        load_named_property_map(&pstfile, &named_properties);
+        STATS_END(PHASE_INDEX_LOAD, named_properties_start);
+    }
+
+    if (options.n_shards > 1) {
+        // The plan classifies items, and an item's class may hang on its
+        // named properties
+        STATS_BEGIN(census_start);
+        shard_plan(&pstfile, &table, options.shard_index, options.n_shards);
+        progress.n_total = shard_n_items();
+        STATS_END(PHASE_CENSUS, census_start);
+    }
+
+    if (options.n_shards == 1 || progress.n_total > 0) {
+        prefetch_begin(&pstfile, &table);
+        process(&pstfile, item, &table, &table.entries[0], 0, outer_name, &progress);    // do the children of TOPF
+        prefetch_end();
+    }
 
+    // No item was written: reap the census all the same
+    if (progress.census_pending) census_end();
+
+    if (options.export_dir) export_finish();
+
+    desc_table_free(&table);
+    id_index_free();
     pst_freeItem(item);
     pst_close(&pstfile);
+}
+
+
+/**
+ * Converts one input of a batch, in its own process: see batch.h. Its
+ * items' filenames start with "/" and its path.
+ */
+static void
+convert_batch_input(const char* path, size_t input_index)
+{
+    // stats and traces are per input
+    if (options.stats) stats_enable();
+    if (options.trace_path) {
+        char trace_path[4096];
+        snprintf(trace_path, sizeof(trace_path), "%s.%zu", options.trace_path, input_index);
+        trace_open(trace_path);
+    }
+
+    // inputs run one at a time with dedup; each hands the set to the next
+    if (options.dedup) dedup_load(options.dedup_path);
+
+    char* outer_name = strdup_parent_sep_child_or_die("", "/", path);
+    convert(path, outer_name);
+    free(outer_name);
+
+    if (options.dedup) dedup_save(options.dedup_path);
+    if (options.stats) output_stats(path);
+    trace_close();
+}
+
+
+int main(int argc, char* const* argv) {
+    mime_boundary = argv[1];
+    json_template = argv[2];
+
+    options_load();
+    if (options.stats) stats_enable();
+    out_init();
+    limits_enable();
+    if (options.dedup) {
+        // duplicateOf may name a file from another input, in a later run
+        char* input = json_template_input();
+        dedup_set_input(input);
+        free(input);
+    }
+
+    if (argc > 3) {
+        // extract-pst MIME-BOUNDARY JSON INPUT...: a batch
+        if (options.n_shards > 1) {
+            die("EXTRACT_PST_SHARD works on one PST at a time, not a batch");
+        }
+        char dedup_template[] = "extract-pst-dedup-XXXXXX";
+        if (options.dedup) {
+            // The inputs share one dedup set, so they take turns. The set
+            // passes from each to the next through a file.
+            options.jobs = 1;
+            if (!options.dedup_path) {
+                int fd = mkstemp(dedup_template);
+                if (fd < 0) die("could not create a temp file for the dedup set");
+                close(fd);
+                unlink(dedup_template); // dedup_load() takes "missing" for "empty"
+                options.dedup_path = dedup_template;
+            }
+        }
+        batch_run(argv + 3, argc - 3, options.jobs, convert_batch_input);
+        if (options.dedup_path == dedup_template) unlink(dedup_template);
+    } else {
+        if (options.trace_path) trace_open(options.trace_path);
+        if (options.dedup_path) dedup_load(options.dedup_path);
+        convert(INPUT_PATH, "");
+        if (options.dedup_path) dedup_save(options.dedup_path);
+        if (options.stats) output_stats(INPUT_PATH);
+    }
+
+    output_done();
+    out_flush();
+    trace_close();
 
     return 0;
 }
+
+#endif
@@ -0,0 +1,80 @@
+/*
+ * Declarations shared between the extract-pst translation units.
+ */
+
+#ifndef EXTRACT_PST_H
+#define EXTRACT_PST_H
+
+#include <stddef.h>
+
+#include <libpst.h>
+
+#define DEBUG_ENT(x)
+#define DEBUG_INFO(x)
+#define DEBUG_WARN(x)
+#define DEBUG_RET(x)
+
+extern const char* mime_boundary;
+extern const char* json_template;
+
+void      die(const char* message);
+void*     malloc_or_die(size_t size);
+char*     strdup_or_die(const char* s);
+
+/**
+ * Returns a read/write temp file in the current directory, already
+ * unlinked, so it vanishes when closed.
+ */
+int       temp_file_or_die(void);
+void      output_part(const char* name, const char* body);
+void      output_progress(size_t n_processed, size_t n_total);
+void      output_done();
+
+/**
+ * How process() counts an item: as a folder or an item libpst can't parse
+ * (not at all), as an item with no part (in "progress" only), or as an
+ * email, contact, journal entry or appointment (a filename and a part).
+ */
+typedef enum {
+    ITEM_CLASS_NONE,
+    ITEM_CLASS_OTHER,
+    ITEM_CLASS_NUMBERED,
+} ItemClass;
+
+/**
+ * Classifies the item at d_ptr without rendering it. Reads its properties,
+ * and its subnodes only if it must.
+ */
+ItemClass classify_item(pst_file* pstfile, pst_desc_tree* d_ptr);
+
+/*
+ * MIME rendering primitives. They live in extract-pst.c; bench/micro.c
+ * measures them one at a time.
+ */
+void      removeCR(char *c);
+char*     my_stristr(char *haystack, char *needle);
+void      header_has_field(char *header, char *field, int *flag);
+void      header_strip_field(char *header, char *field);
+int       test_base64(const char *body, size_t len);
+
+/*
+ * The MIME part headers after an email's own headers, split once into the
+ * headers of its message/rfc822 parts, in order. Each embedded message, in
+ * the order we render them, takes the next block.
+ */
+typedef struct {
+    char**    blocks;       // each NUL-terminated in place
+    size_t    n_blocks;
+    size_t    next;
+    char*     current;      // the block the last embedded message took
+    int       indexed;
+} EmbeddedHeaders;
+
+void      index_embedded_headers(EmbeddedHeaders* embedded, char* mime_headers);
+char*     next_embedded_headers(EmbeddedHeaders* embedded);
+char*     quote_string(char *inp);
+void      write_pst_string_with_len(const char* string, size_t len, const char* mime, const char* charset_or_null, int mime_depth);
+void      write_vcard(pst_item *item, pst_item_contact* contact, char comment[]);
+void      write_appointment(pst_item *item);
+
+#endif
@@ -0,0 +1,77 @@
+/*
+ * Block ID hash index. See idindex.h.
+ */
+
+#include <stdlib.h>
+
+#include "extract-pst.h"
+#include "idindex.h"
+#include "stats.h"
+
+// Grow the table past this fill, in percent. Lower means shorter probes.
+#define MAX_LOAD 50
+
+static pst_index_ll*  i_table;      // the pstfile->i_table we indexed
+static uint32_t*      slots;        // i_table index + 1; 0 is empty
+static unsigned       shift;        // 64 - log2(n_slots)
+static uint64_t       mask;
+
+
+static inline uint64_t
+slot_of(uint64_t i_id)
+{
+    // Fibonacci hashing: BIDs are multiples of 4, so the low bits alone
+    // would cluster.
+    return (i_id * 0x9E3779B97F4A7C15ULL) >> shift;
+}
+
+
+void
+id_index_build(pst_file* pstfile)
+{
+    id_index_free();
+    if (pstfile->i_count >= UINT32_MAX) return; // pst_getID() will do
+
+    unsigned bits = 10;
+    while (((uint64_t) 1 << bits) * MAX_LOAD < (uint64_t) pstfile->i_count * 100) bits++;
+    slots = calloc((size_t) 1 << bits, sizeof(uint32_t));
+    if (!slots) return; // pst_getID() will do
+    shift = 64 - bits;
+    mask = ((uint64_t) 1 << bits) - 1;
+    i_table = pstfile->i_table;
+
+    for (size_t i = 0; i < pstfile->i_count; i++) {
+        uint64_t slot = slot_of(i_table[i].i_id);
+        while (slots[slot]) slot = (slot + 1) & mask;
+        slots[slot] = (uint32_t) i + 1;
+    }
+}
+
+
+void
+id_index_free(void)
+{
+    free(slots);
+    slots = NULL;
+    i_table = NULL;
+}
+
+
+pst_index_ll*
+id_index_get(pst_file* pstfile, uint64_t i_id)
+{
+    if (!slots || pstfile->i_table != i_table) return pst_getID(pstfile, i_id);
+    if (i_id == 0) return NULL;
+
+    i_id -= i_id & 1; // as pst_getID() does: the low bit is a flag
+    unsigned probes = 1;
+    for (uint64_t slot = slot_of(i_id); slots[slot]; slot = (slot + 1) & mask, probes++) {
+        pst_index_ll* ptr = &i_table[slots[slot] - 1];
+        if (ptr->i_id == i_id) {
+            if (stats_enabled) stats_count_lookup(probes);
+            return ptr;
+        }
+    }
+    if (stats_enabled) stats_count_lookup(probes);
+    return NULL;
+}
@@ -0,0 +1,32 @@
+/*
+ * A hash index over the PST's block IDs.
+ *
+ * pst_getID() binary-searches pstfile->i_table: O(log n) cache misses per
+ * lookup, and we look up every item's blocks, every attachment and every
+ * embedded message. After pst_load_index(), id_index_build() hashes each
+ * block ID to its i_table entry, so a lookup is usually one probe.
+ *
+ * libpst's own lookups (pst_parse_item(), pst_ff_getIDblock_dec() and so
+ * on) still binary-search: we can only speed up ours.
+ */
+
+#ifndef IDINDEX_H
+#define IDINDEX_H
+
+#include <stdint.h>
+
+#include <libpst.h>
+
+/**
+ * Indexes pstfile->i_table. Call it after pst_load_index().
+ */
+void            id_index_build(pst_file* pstfile);
+
+void            id_index_free(void);
+
+/**
+ * Does what pst_getID() does, with the index if it was built for pstfile.
+ */
+pst_index_ll*   id_index_get(pst_file* pstfile, uint64_t i_id);
+
+#endif
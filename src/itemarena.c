@@ -0,0 +1,176 @@
+/*
+ * Per-item string arena. See itemarena.h.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "extract-pst.h"
+#include "itemarena.h"
+
+#define CHUNK_SIZE (64 * 1024)
+#define ALIGN 16
+
+typedef struct {
+    char*     data;
+    size_t    size;
+} Chunk;
+
+static Chunk*       chunks;
+static size_t       n_chunks;
+static size_t       chunks_cap;
+static size_t       chunk;      // the chunk we allocate from
+static size_t       used;       // bytes used in chunks[chunk]
+
+static pst_string** strings;    // the undo log
+static size_t       n_strings;
+static size_t       strings_cap;
+
+
+ItemArenaMark
+item_arena_mark(void)
+{
+    ItemArenaMark mark = { chunk, used, n_strings };
+    return mark;
+}
+
+
+void*
+item_arena_alloc(size_t size)
+{
+    size = (size + ALIGN - 1) & ~(size_t) (ALIGN - 1);
+
+    if (n_chunks == 0 || used + size > chunks[chunk].size) {
+        // Move on to the next chunk that fits. Skipped chunks stay empty
+        // until the release that rewinds past them.
+        size_t next = n_chunks ? chunk + 1 : 0;
+        while (next < n_chunks && chunks[next].size < size) next++;
+        if (next == n_chunks) {
+            if (n_chunks == chunks_cap) {
+                chunks_cap = chunks_cap ? chunks_cap * 2 : 16;
+                Chunk* grown = realloc(chunks, chunks_cap * sizeof(Chunk));
+                if (!grown) die("out of memory converting strings");
+                chunks = grown;
+            }
+            chunks[n_chunks].size = size > CHUNK_SIZE ? size : CHUNK_SIZE;
+            chunks[n_chunks].data = malloc_or_die(chunks[n_chunks].size);
+            n_chunks++;
+        }
+        chunk = next;
+        used = 0;
+    }
+
+    void* ret = chunks[chunk].data + used;
+    used += size;
+    return ret;
+}
+
+
+// stands in for a pst_string that has left the undo log
+static pst_string   detached;
+
+
+/**
+ * Returns str's entry in the undo log, or NULL.
+ */
+static pst_string**
+find_logged(const pst_string* str)
+{
+    for (size_t i = n_strings; i > 0; i--) {
+        if (strings[i - 1] == str) return &strings[i - 1];
+    }
+    return NULL;
+}
+
+
+void
+item_arena_set_string(pst_string* str, char* s)
+{
+    if (find_logged(str)) {
+        str->str = s;
+        return;
+    }
+
+    free(str->str);
+    str->str = s;
+    if (n_strings == strings_cap) {
+        strings_cap = strings_cap ? strings_cap * 2 : 256;
+        pst_string** grown = realloc(strings, strings_cap * sizeof(pst_string*));
+        if (!grown) die("out of memory converting strings");
+        strings = grown;
+    }
+    strings[n_strings++] = str;
+}
+
+
+void
+item_arena_detach(pst_string* str)
+{
+    pst_string** logged = find_logged(str);
+    if (!logged) return;
+    str->str = strdup_or_die(str->str);
+    *logged = &detached;
+}
+
+
+#ifndef NDEBUG
+/**
+ * Returns nonzero if s points into one of our chunks.
+ */
+static int
+in_arena(const char* s)
+{
+    for (size_t i = 0; i < n_chunks; i++) {
+        if (s >= chunks[i].data && s < chunks[i].data + chunks[i].size) return 1;
+    }
+    return 0;
+}
+#endif
+
+
+void
+item_arena_forget(size_t mark_strings)
+{
+    for (size_t i = mark_strings; i < n_strings; i++) {
+        assert(strings[i] == &detached || in_arena(strings[i]->str)); // see item_arena_release()
+        strings[i]->str = NULL;
+    }
+    n_strings = mark_strings;
+}
+
+
+void
+item_arena_release(ItemArenaMark mark)
+{
+    for (size_t i = mark.n_strings; i < n_strings; i++) {
+        // If not, a libpst call freed or replaced a string we never
+        // detached (see charset.h), and pst_freeItem() won't free the new one
+        assert(strings[i] == &detached || in_arena(strings[i]->str));
+        strings[i]->str = NULL;
+    }
+    n_strings = mark.n_strings;
+    chunk = mark.chunk;
+    used = mark.used;
+
+    if (n_strings == 0 && chunk == 0 && used == 0) {
+        // Between items: give back chunks grown for one huge string
+        size_t kept = 0;
+        for (size_t i = 0; i < n_chunks; i++) {
+            if (chunks[i].size > CHUNK_SIZE) {
+                free(chunks[i].data);
+            } else {
+                chunks[kept++] = chunks[i];
+            }
+        }
+        n_chunks = kept;
+    }
+}
+
+
+void
+item_arena_free_item(pst_item* item, ItemArenaMark mark)
+{
+    item_arena_release(mark);
+    pst_freeItem(item);
+}
@@ -0,0 +1,70 @@
+/*
+ * Memory for the strings we convert in each item.
+ *
+ * pst_parse_item() mallocs a fresh pst_item for every item, and
+ * convert_utf8() used to malloc a fresh buffer for every string it
+ * converted, all freed again by pst_freeItem(). We can't change the former,
+ * but the latter now come from this arena: chunks that are kept from item
+ * to item, so once the arena has grown to fit the largest item, converting
+ * strings costs no malloc() or free() at all.
+ *
+ * pst_freeItem() would free() those strings, so the arena keeps an undo log
+ * of the pst_strings it has filled in. item_arena_release() sets them back
+ * to NULL before pst_freeItem() sees them.
+ *
+ * Items nest (an email's embedded messages are items too), so release is
+ * to a mark: take one right after pst_parse_item() and release it just
+ * before pst_freeItem().
+ */
+
+#ifndef ITEMARENA_H
+#define ITEMARENA_H
+
+#include <stddef.h>
+
+#include <libpst.h>
+
+typedef struct {
+    size_t    chunk;
+    size_t    used;
+    size_t    n_strings;
+} ItemArenaMark;
+
+ItemArenaMark item_arena_mark(void);
+
+/**
+ * Returns size bytes that last until the enclosing release.
+ */
+void*     item_arena_alloc(size_t size);
+
+/**
+ * Sets str->str to s, which must come from item_arena_alloc(), freeing
+ * what str held before.
+ */
+void      item_arena_set_string(pst_string* str, char* s);
+
+/**
+ * Moves str out of the arena, for libpst functions like pst_rfc2047() that
+ * free() and replace the string they're given.
+ */
+void      item_arena_detach(pst_string* str);
+
+/**
+ * Sets each pst_string filled in since mark back to NULL, and frees what
+ * was allocated since mark for reuse.
+ */
+void      item_arena_release(ItemArenaMark mark);
+
+/**
+ * Sets each pst_string filled in since mark.n_strings back to NULL, but
+ * leaves the memory to the next item_arena_release(): for a nested item
+ * that limits.h frees with pst_freeItem().
+ */
+void      item_arena_forget(size_t n_strings);
+
+/**
+ * Does item_arena_release() and pst_freeItem().
+ */
+void      item_arena_free_item(pst_item* item, ItemArenaMark mark);
+
+#endif
@@ -0,0 +1,184 @@
+/*
+ * Per-item limits. See limits.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "extract-pst.h"
+#include "itemarena.h"
+#include "limits.h"
+#include "options.h"
+#include "stats.h"
+
+typedef struct {
+    Held      kind;
+    void*     ptr;
+    size_t    len;
+} Holding;
+
+int limits_enabled = 0;
+jmp_buf limits_env;
+
+static int      in_item = 0;
+static uint64_t start_ns;       // 0: the clock hasn't started
+static uint64_t deadline_ns;
+static Limit    last_limit;
+static char     last_message[256];
+static Holding* holdings;       // what the current item holds
+static size_t   n_holdings;
+static size_t   holdings_cap;
+
+
+void
+limits_enable(void)
+{
+    limits_enabled = options.item_timeout_ns || options.item_max_bytes || options.item_max_depth;
+}
+
+
+void
+limits_start_clock(void)
+{
+    start_ns = options.item_timeout_ns ? stats_now() : 0;
+}
+
+
+void
+limits_begin_item(void)
+{
+    in_item = 1;
+    if (options.item_timeout_ns && !start_ns) start_ns = stats_now();
+    deadline_ns = options.item_timeout_ns ? start_ns + options.item_timeout_ns : 0;
+}
+
+
+void
+limits_end_item(void)
+{
+    in_item = 0;
+    start_ns = 0;
+    n_holdings = 0; // anything left is the caller's to release
+}
+
+
+static void
+release(const Holding* holding)
+{
+    switch (holding->kind) {
+        case HELD_MEMORY: free(holding->ptr); break;
+        case HELD_MAPPING: munmap(holding->ptr, holding->len); break;
+        case HELD_FILE: fclose(holding->ptr); break;
+        case HELD_ITEM:
+            // Its arena strings aren't pst_freeItem()'s to free
+            item_arena_forget(holding->len);
+            pst_freeItem(holding->ptr);
+            break;
+    }
+}
+
+
+void
+limits_hold(Held kind, void* ptr, size_t len)
+{
+    if (!in_item || !ptr) return;
+    if (n_holdings == holdings_cap) {
+        size_t cap = holdings_cap ? holdings_cap * 2 : 16;
+        Holding* grown = realloc(holdings, cap * sizeof(Holding));
+        if (!grown) {
+            // Release it rather than leak it: die() skips the item
+            Holding holding = { kind, ptr, len };
+            release(&holding);
+            die("out of memory because a message had too many attachments");
+        }
+        holdings = grown;
+        holdings_cap = cap;
+    }
+    holdings[n_holdings++] = (Holding) { kind, ptr, len };
+}
+
+
+void
+limits_release(Held kind, void* ptr, size_t len)
+{
+    if (!ptr) return;
+    for (size_t i = n_holdings; i > 0; i--) {
+        if (holdings[i - 1].ptr == ptr) {
+            holdings[i - 1] = holdings[--n_holdings];
+            break;
+        }
+    }
+    Holding holding = { kind, ptr, len };
+    release(&holding);
+}
+
+
+int
+limits_in_item(void)
+{
+    return in_item;
+}
+
+
+void
+limits_exceeded(Limit limit, const char* message)
+{
+    in_item = 0;
+    start_ns = 0;
+    last_limit = limit;
+    // message may be on the stack we're about to leave
+    snprintf(last_message, sizeof(last_message), "%s", message);
+    for (size_t i = 0; i < n_holdings; i++) release(&holdings[i]);
+    n_holdings = 0;
+    longjmp(limits_env, 1);
+}
+
+
+void
+limits_check_time(void)
+{
+    if (in_item && deadline_ns && stats_now() > deadline_ns) {
+        limits_exceeded(LIMIT_TIME, "item took longer than EXTRACT_PST_ITEM_TIMEOUT");
+    }
+}
+
+
+void
+limits_check_bytes(uint64_t len)
+{
+    if (in_item && options.item_max_bytes && len > options.item_max_bytes) {
+        limits_exceeded(LIMIT_BYTES, "item is larger than EXTRACT_PST_ITEM_MAX_BYTES");
+    }
+}
+
+
+void
+limits_check_depth(int depth)
+{
+    if (in_item && options.item_max_depth && (unsigned) depth > options.item_max_depth) {
+        limits_exceeded(LIMIT_DEPTH, "item nests messages deeper than EXTRACT_PST_ITEM_MAX_DEPTH");
+    }
+}
+
+
+Limit
+limits_last_limit(void)
+{
+    return last_limit;
+}
+
+
+const char*
+limits_last_message(void)
+{
+    return last_message;
+}
+
+
+uint64_t
+limits_max_bytes(void)
+{
+    return options.item_max_bytes ? options.item_max_bytes : UINT64_MAX;
+}
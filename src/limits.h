@@ -0,0 +1,121 @@
+/*
+ * Per-item limits, so one pathological item can't stall or abort a run.
+ *
+ * Off unless an EXTRACT_PST_ITEM_* limit is set. When on, each item is
+ * written after limits_begin_item() and setjmp(limits_env). If the item
+ * runs past a limit -- or calls die() -- limits_exceeded() longjmps back,
+ * the caller drops what the item wrote and writes a "warning" part instead,
+ * and the run goes on.
+ *
+ * Limits are checked cooperatively, at points that can't be deep inside
+ * malloc() or libpst: each time output leaves the output buffer, each pass
+ * of header_strip_field(), each embedded message. The clock starts before
+ * the item is parsed, with limits_start_clock(), so a slow parse counts.
+ *
+ * Whatever a skipped item had allocated stays allocated, except what it
+ * held with limits_hold(): the large things, attachment data and the temp
+ * files and mappings it spills to, and embedded messages' items. Those are
+ * released as we jump out.
+ */
+
+#ifndef LIMITS_H
+#define LIMITS_H
+
+#include <setjmp.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+    LIMIT_TIME,     // EXTRACT_PST_ITEM_TIMEOUT
+    LIMIT_BYTES,    // EXTRACT_PST_ITEM_MAX_BYTES
+    LIMIT_DEPTH,    // EXTRACT_PST_ITEM_MAX_DEPTH
+    LIMIT_ERROR,    // die() while writing the item
+} Limit;
+
+typedef enum {
+    HELD_MEMORY,    // free() it
+    HELD_MAPPING,   // munmap() it
+    HELD_FILE,      // fclose() it
+    HELD_ITEM,      // pst_freeItem() it; len is its mark's n_strings
+} Held;
+
+extern int limits_enabled;
+
+/**
+ * Turns limits on if options set any.
+ */
+void        limits_enable(void);
+
+/**
+ * limits_exceeded() longjmps here. Call setjmp(limits_env) right after
+ * limits_begin_item(), from a frame that outlives the item.
+ */
+extern jmp_buf limits_env;
+
+/**
+ * Starts the next item's clock. Call it before parsing the item.
+ */
+void        limits_start_clock(void);
+
+/**
+ * Starts an item, and its clock if limits_start_clock() didn't.
+ */
+void        limits_begin_item(void);
+
+/**
+ * Ends the item, whichever way it went.
+ */
+void        limits_end_item(void);
+
+/**
+ * Returns nonzero between limits_begin_item() and limits_end_item(), where
+ * limits_exceeded() won't return.
+ */
+int         limits_in_item(void);
+
+/**
+ * Notes that the current item holds ptr (of len bytes, for a mapping), to
+ * release if the item is skipped. Does nothing outside an item.
+ */
+void        limits_hold(Held kind, void* ptr, size_t len);
+
+/**
+ * Releases ptr now, whether or not it was held. NULL is nothing.
+ */
+void        limits_release(Held kind, void* ptr, size_t len);
+
+/**
+ * Skips the current item, releasing what it holds. Only call it if
+ * limits_in_item().
+ */
+void        limits_exceeded(Limit limit, const char* message) __attribute__((noreturn));
+
+/**
+ * Skips the current item if it has used up its time.
+ */
+void        limits_check_time(void);
+
+/**
+ * Skips the current item if its output so far, len bytes, is too large.
+ */
+void        limits_check_bytes(uint64_t len);
+
+/**
+ * Skips the current item if an embedded message at this depth (1 is an
+ * email's own attachment) is too deep.
+ */
+void        limits_check_depth(int depth);
+
+/**
+ * The limit that limits_exceeded() skipped the last item for, and why.
+ */
+Limit       limits_last_limit(void);
+const char* limits_last_message(void);
+
+/**
+ * Returns the largest item, by the bytes the PST stores for it, that
+ * EXTRACT_PST_ITEM_MAX_BYTES allows: UINT64_MAX if there is no limit.
+ */
+uint64_t    limits_max_bytes(void);
+
+#endif
@@ -0,0 +1,185 @@
+/*
+ * Optional behavior. See options.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "extract-pst.h"
+#include "options.h"
+#include "resources.h"
+
+// Keeps shard arithmetic within 64 bits for PSTs of any realistic size
+#define MAX_SHARDS 4096
+
+// One attachment (or item) may take this fraction of the memory budget:
+// with an explicit budget, past it, it goes to a temp file. The rest leaves
+// room for libpst's copies of the item, the index and the output buffers.
+#define SPILL_FRACTION 16
+#define MIN_SPILL_BYTES (1024 * 1024)
+
+// A batch job takes about this much memory (libpst's index and items, our
+// buffers), so we don't run more at once than the budget has room for
+#define JOB_MEMORY_BYTES (256ULL * 1024 * 1024)
+
+// The output buffer and the stdout pipe get these fractions of the memory
+// budget, within bounds. A pipe can't be larger than 1MB, unprivileged, by
+// default (/proc/sys/fs/pipe-max-size).
+#define OUTPUT_BUFFER_FRACTION 4096
+#define MIN_OUTPUT_BUFFER_BYTES (64 * 1024)
+#define MAX_OUTPUT_BUFFER_BYTES (1024 * 1024)
+#define PIPE_FRACTION 1024
+#define MIN_PIPE_BYTES (64 * 1024)
+#define MAX_PIPE_BYTES (1024 * 1024)
+
+#define DEFAULT_PREFETCH_ITEMS 0
+
+Options options;
+
+// What EXTRACT_PST_* set explicitly. 0 means "derive it".
+static int      budget_limited;  // set, or a cgroup's limit
+static unsigned jobs_set;
+static unsigned encode_threads_set;
+static uint64_t output_buffer_set;
+static uint64_t pipe_set;
+
+
+static int
+env_flag(const char* name)
+{
+    const char* value = getenv(name);
+    return value && (
+        strcmp(value, "1") == 0
+        || strcasecmp(value, "true") == 0
+        || strcasecmp(value, "yes") == 0
+    );
+}
+
+
+static const char*
+env_string(const char* name)
+{
+    const char* value = getenv(name);
+    return value && *value ? value : NULL;
+}
+
+
+static uint64_t
+env_number(const char* name)
+{
+    const char* value = env_string(name);
+    return value ? strtoull(value, NULL, 10) : 0;
+}
+
+
+static uint64_t
+fraction_within(uint64_t budget, uint64_t fraction, uint64_t min, uint64_t max)
+{
+    uint64_t bytes = budget / fraction;
+    return bytes < min ? min : bytes > max ? max : bytes;
+}
+
+
+/**
+ * Derives, from options.cpus and options.memory_budget, whatever wasn't
+ * set explicitly.
+ */
+static void
+derive_from_resources(void)
+{
+    uint64_t budget = options.memory_budget;
+    // Spilling trades a copy through a temp file for memory. Physical RAM
+    // isn't ours alone and swaps rather than kills, so only a budget someone
+    // chose or a cgroup's limit turns it on.
+    options.item_memory_bytes = budget ? budget / SPILL_FRACTION : UINT64_MAX;
+    if (options.item_memory_bytes < MIN_SPILL_BYTES) options.item_memory_bytes = MIN_SPILL_BYTES;
+    options.spill_bytes = budget_limited ? options.item_memory_bytes : UINT64_MAX;
+
+    options.jobs = jobs_set;
+    if (!options.jobs) {
+        options.jobs = options.cpus;
+        if (budget && budget / JOB_MEMORY_BYTES < options.jobs) options.jobs = budget / JOB_MEMORY_BYTES;
+        if (!options.jobs) options.jobs = 1;
+    }
+    options.encode_threads = encode_threads_set ? encode_threads_set : options.cpus;
+
+    // With no budget to go by, what we used before we had one
+    options.output_buffer_bytes = output_buffer_set ? output_buffer_set
+        : budget ? fraction_within(budget, OUTPUT_BUFFER_FRACTION, MIN_OUTPUT_BUFFER_BYTES, MAX_OUTPUT_BUFFER_BYTES)
+        : MIN_OUTPUT_BUFFER_BYTES;
+    options.pipe_bytes = pipe_set ? pipe_set
+        : budget ? fraction_within(budget, PIPE_FRACTION, MIN_PIPE_BYTES, MAX_PIPE_BYTES)
+        : MAX_PIPE_BYTES;
+}
+
+
+void
+options_load(void)
+{
+    options.stats = env_flag("EXTRACT_PST_STATS");
+    options.trace_path = env_string("EXTRACT_PST_TRACE");
+    options.estimate = env_flag("EXTRACT_PST_ESTIMATE");
+    options.hashes = env_flag("EXTRACT_PST_HASHES");
+
+    options.shard_index = 0;
+    options.n_shards = 1;
+    const char* shard = env_string("EXTRACT_PST_SHARD");
+    if (shard) {
+        char extra;
+        if (sscanf(shard, "%u/%u%c", &options.shard_index, &options.n_shards, &extra) != 2
+                || options.n_shards == 0
+                || options.n_shards > MAX_SHARDS
+                || options.shard_index >= options.n_shards) {
+            die("EXTRACT_PST_SHARD must look like i/N, with 0 <= i < N <= 4096");
+        }
+    }
+
+    const char* budget = env_string("EXTRACT_PST_MEMORY_BUDGET");
+    options.memory_budget = budget ? strtoull(budget, NULL, 10) : resources_memory_limit(&budget_limited);
+    if (budget) budget_limited = 1;
+    options.cpus = (unsigned) env_number("EXTRACT_PST_CPUS");
+    if (options.cpus == 0) options.cpus = resources_cpu_limit();
+    jobs_set = (unsigned) env_number("EXTRACT_PST_JOBS");
+    encode_threads_set = (unsigned) env_number("EXTRACT_PST_ENCODE_THREADS");
+    output_buffer_set = env_number("EXTRACT_PST_OUTPUT_BUFFER");
+    pipe_set = env_number("EXTRACT_PST_PIPE_BUFFER");
+    derive_from_resources();
+
+    const char* timeout = env_string("EXTRACT_PST_ITEM_TIMEOUT");
+    double timeout_s = timeout ? strtod(timeout, NULL) : 0;
+    options.item_timeout_ns = timeout_s > 0 ? (uint64_t) (timeout_s * 1e9) : 0;
+    const char* max_bytes = env_string("EXTRACT_PST_ITEM_MAX_BYTES");
+    options.item_max_bytes = max_bytes ? strtoull(max_bytes, NULL, 10) : 0;
+    const char* max_depth = env_string("EXTRACT_PST_ITEM_MAX_DEPTH");
+    options.item_max_depth = max_depth ? (unsigned) strtoul(max_depth, NULL, 10) : 0;
+
+    const char* prefetch = env_string("EXTRACT_PST_PREFETCH");
+    options.prefetch_items = prefetch ? (unsigned) strtoul(prefetch, NULL, 10) : DEFAULT_PREFETCH_ITEMS;
+    options.export_dir = env_string("EXTRACT_PST_EXPORT_DIR");
+
+    options.dedup_path = env_string("EXTRACT_PST_DEDUP_FILE");
+    options.dedup = env_flag("EXTRACT_PST_DEDUP") || options.dedup_path;
+    options.attachment_dedup = env_flag("EXTRACT_PST_ATTACHMENT_DEDUP");
+    if (options.dedup && options.n_shards > 1) {
+        // Each shard would see only its own emails, and they'd all save
+        // the set to the same file.
+        die("EXTRACT_PST_DEDUP does not work with EXTRACT_PST_SHARD");
+    }
+    if ((options.item_timeout_ns || options.item_max_bytes || options.item_max_depth) && options.n_shards > 1) {
+        // A skipped item takes no index, and a shard can't know which
+        // items before its range a full run would skip
+        die("EXTRACT_PST_ITEM_* limits do not work with EXTRACT_PST_SHARD");
+    }
+}
+
+
+void
+options_share(unsigned n)
+{
+    if (n <= 1) return;
+    options.cpus = options.cpus > n ? options.cpus / n : 1;
+    options.memory_budget /= n;
+    derive_from_resources();
+}
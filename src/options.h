@@ -0,0 +1,50 @@
+/*
+ * Optional behavior, configured through EXTRACT_PST_* environment variables.
+ *
+ * do-convert-stream-to-mime-multipart also maps the input JSON's "options"
+ * object onto these variables: {"options":{"stats":true}} sets
+ * EXTRACT_PST_STATS=true.
+ */
+
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include <stdint.h>
+
+typedef struct {
+    int stats;                  // EXTRACT_PST_STATS: emit a "stats" part before "done"
+    const char* trace_path;     // EXTRACT_PST_TRACE: write a Chrome trace to this file
+    int estimate;               // EXTRACT_PST_ESTIMATE: emit an "estimate" part before the first item. See estimate.h.
+    unsigned shard_index;       // EXTRACT_PST_SHARD=i/N: render only shard i ...
+    unsigned n_shards;          // ... of N. See shard.h.
+    unsigned cpus;              // EXTRACT_PST_CPUS: CPUs to plan for (default: our cgroup's quota, or the CPUs we may run on)
+    unsigned jobs;              // EXTRACT_PST_JOBS: batch inputs to convert at once (default: CPUs, as memory allows)
+    unsigned encode_threads;    // EXTRACT_PST_ENCODE_THREADS: threads to base64-encode one large attachment (default: CPUs)
+    int dedup;                  // EXTRACT_PST_DEDUP: replace repeated emails with "duplicate" parts
+    const char* dedup_path;     // EXTRACT_PST_DEDUP_FILE: keep the dedup set here, across runs. See dedup.h.
+    int attachment_dedup;       // EXTRACT_PST_ATTACHMENT_DEDUP: write each attachment's data once
+    int hashes;                 // EXTRACT_PST_HASHES: put XXH64s of each blob and attachment in its JSON
+    uint64_t memory_budget;     // EXTRACT_PST_MEMORY_BUDGET: bytes (default: our cgroup's limit) ...
+    uint64_t item_memory_bytes; // ... of which one attachment or item should hold in memory
+    uint64_t spill_bytes;       // past which it goes to a temp file: item_memory_bytes if the budget was set or is a cgroup's, else no limit
+    uint64_t output_buffer_bytes; // EXTRACT_PST_OUTPUT_BUFFER: output gathered per write (default: from the memory budget)
+    uint64_t pipe_bytes;        // EXTRACT_PST_PIPE_BUFFER: what to ask of a stdout pipe (default: from the memory budget)
+    unsigned prefetch_items;    // EXTRACT_PST_PREFETCH: items to read ahead of the one being parsed (default 0: off). See prefetch.h.
+    const char* export_dir;     // EXTRACT_PST_EXPORT_DIR: write items to files here, not to stdout. See export.h.
+    uint64_t item_timeout_ns;   // EXTRACT_PST_ITEM_TIMEOUT: seconds one item may take ...
+    uint64_t item_max_bytes;    // EXTRACT_PST_ITEM_MAX_BYTES: bytes one item may store or render ...
+    unsigned item_max_depth;    // EXTRACT_PST_ITEM_MAX_DEPTH: messages one item may nest ...
+                                // ... or be skipped. 0 means no limit. See limits.h.
+} Options;
+
+extern Options options;
+
+void      options_load(void);
+
+/**
+ * Splits the CPUs and memory budget among n processes running at once --
+ * batch mode's children -- and derives again whatever defaults from them.
+ */
+void      options_share(unsigned n);
+
+#endif
@@ -0,0 +1,601 @@
+/*
+ * Buffered writer for stdout. See output.h.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "digest.h"
+#include "extract-pst.h"
+#include "limits.h"
+#include "options.h"
+#include "output.h"
+#include "stats.h"
+
+// Until out_init() sizes the buffer from options.output_buffer_bytes
+#define DEFAULT_OUTPUT_BUFFER_SIZE (64 * 1024)
+// Below this, writes get small for no saving worth having
+#define MIN_OUTPUT_BUFFER_SIZE (4 * 1024)
+// Keeps F_SETPIPE_SZ's argument an int; the kernel allows far less anyway
+#define MAX_PIPE_SIZE (1 << 30)
+
+// 57 input bytes make one 76-column base64 line
+#define BASE64_LINE_INPUT 57
+#define BASE64_LINE_OUTPUT 77 /* 76 + "\n" */
+
+static const char BASE64_ALPHABET[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// A multiple of BASE64_LINE_INPUT, small enough to stay in L1 between
+// hashing and encoding
+#define BASE64_HASH_BLOCK (BASE64_LINE_INPUT * 64)
+
+// Data this large is base64-encoded on several threads (options.encode_threads)
+#define PARALLEL_BASE64_MIN (4 * 1024 * 1024)
+// Each thread encodes this many whole lines at a time
+#define PARALLEL_BASE64_CHUNK (BASE64_LINE_INPUT * 16384)
+#define PARALLEL_BASE64_CHUNK_OUTPUT (BASE64_LINE_OUTPUT * 16384)
+#define MAX_ENCODE_THREADS 64
+
+static char     default_buffer[DEFAULT_OUTPUT_BUFFER_SIZE];
+static char*    buffer = default_buffer;
+static size_t   buffer_size = DEFAULT_OUTPUT_BUFFER_SIZE;
+static size_t   buffer_len = 0;
+static uint64_t n_bytes = 0;
+static int      stdout_pipe_size = 0;   // 0 if stdout isn't a pipe
+
+// Between out_capture_begin() and out_capture_end(), output goes here: to
+// memory, and then, past options.spill_bytes, to a temp file
+static int      capturing = 0;
+static char*    capture;
+static uint64_t capture_len;
+static size_t   capture_cap;
+static int      capture_fd = -1;
+static Digest   capture_digest;
+
+
+static void
+resize_buffer(size_t size)
+{
+    if (size < MIN_OUTPUT_BUFFER_SIZE) size = MIN_OUTPUT_BUFFER_SIZE;
+    if (size == buffer_size) return;
+
+    out_flush();
+    char* resized = size == DEFAULT_OUTPUT_BUFFER_SIZE ? default_buffer : malloc(size);
+    if (!resized) return; // keep the buffer we have
+    if (buffer != default_buffer) free(buffer);
+    buffer = resized;
+    buffer_size = size;
+}
+
+
+void
+out_init(void)
+{
+    uint64_t size_wanted = options.output_buffer_bytes ? options.output_buffer_bytes : DEFAULT_OUTPUT_BUFFER_SIZE;
+    resize_buffer(size_wanted < SIZE_MAX ? (size_t) size_wanted : SIZE_MAX);
+
+    struct stat st;
+    stdout_pipe_size = 0;
+    if (fstat(STDOUT_FILENO, &st) != 0 || !S_ISFIFO(st.st_mode)) return;
+
+    // Failing that, we keep the pipe we have. Linux's default is 64KB, so
+    // the reader falling a buffer behind would stall us.
+    int pipe_wanted = options.pipe_bytes < MAX_PIPE_SIZE ? (int) options.pipe_bytes : MAX_PIPE_SIZE;
+    int size = fcntl(STDOUT_FILENO, F_GETPIPE_SZ);
+    if (size >= 0 && size < pipe_wanted && fcntl(STDOUT_FILENO, F_SETPIPE_SZ, pipe_wanted) >= 0) {
+        size = fcntl(STDOUT_FILENO, F_GETPIPE_SZ);
+    }
+    stdout_pipe_size = size > 0 ? size : 0;
+    if (stats_enabled) stats_stdout_pipe(stdout_pipe_size);
+}
+
+
+/**
+ * Returns nonzero if the stdout pipe hasn't room for len more bytes: a
+ * write would wait on the reader.
+ */
+static int
+stdout_pipe_full(size_t len)
+{
+    int queued;
+    if (!stdout_pipe_size || ioctl(STDOUT_FILENO, FIONREAD, &queued) != 0) return 0;
+    return (size_t) (stdout_pipe_size - queued) < len;
+}
+
+
+static void
+write_all_iov(struct iovec* iov, int n_iov)
+{
+    STATS_BEGIN(start);
+    int blocked = 0;
+    if (stats_enabled) {
+        stats_first_byte();
+        size_t len = 0;
+        for (int i = 0; i < n_iov; i++) len += iov[i].iov_len;
+        blocked = stdout_pipe_full(len);
+    }
+
+    while (n_iov > 0) {
+        ssize_t n = writev(STDOUT_FILENO, iov, n_iov);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            // The reader is gone. There is nobody left to report an error to.
+            exit(1);
+        }
+        while (n_iov > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            n_iov--;
+        }
+        if (n_iov > 0) {
+            iov->iov_base = (char*) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    if (stats_enabled) stats_stdout_write(stats_now() - start, blocked);
+    STATS_END(PHASE_STDOUT_WRITE, start);
+}
+
+
+static void
+write_all(const char* data, size_t len)
+{
+    struct iovec iov = { (void*) data, len };
+    write_all_iov(&iov, 1);
+}
+
+
+static void
+write_spill(const char* data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(capture_fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            out_capture_cancel(); // so die() can write
+            die("could not write a temp file: is the disk full?");
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+
+static void
+append_capture(const char* data, size_t len)
+{
+    if (limits_enabled) {
+        limits_check_bytes(capture_len + len);
+        limits_check_time();
+    }
+
+    if (capture_fd < 0 && capture_len + len > options.spill_bytes) {
+        capture_fd = temp_file_or_die();
+        write_spill(capture, capture_len);
+    }
+
+    if (capture_fd >= 0) {
+        write_spill(data, len);
+    } else {
+        if (capture_len + len > capture_cap) {
+            size_t cap = capture_cap ? capture_cap : DEFAULT_OUTPUT_BUFFER_SIZE;
+            while (cap < capture_len + len) cap *= 2;
+            char* grown = realloc(capture, cap);
+            if (!grown) {
+                out_capture_cancel(); // so die() can write
+                die("out of memory because a message was too large");
+            }
+            capture = grown;
+            capture_cap = cap;
+        }
+        memcpy(capture + capture_len, data, len);
+    }
+    capture_len += len;
+    // hashed on its way out of the output buffer, while it's still in cache
+    digest_update(&capture_digest, data, len);
+}
+
+
+/**
+ * Sends data on: to stdout, or to the capture.
+ */
+static void
+sink(const char* data, size_t len)
+{
+    if (capturing) {
+        append_capture(data, len);
+    } else {
+        write_all(data, len);
+    }
+}
+
+
+void
+out_flush(void)
+{
+    if (buffer_len) {
+        sink(buffer, buffer_len);
+        buffer_len = 0;
+    }
+}
+
+
+void
+out_write(const void* data, size_t len)
+{
+    n_bytes += len;
+    if (len <= buffer_size - buffer_len) {
+        memcpy(buffer + buffer_len, data, len);
+        buffer_len += len;
+        return;
+    }
+
+    if (len >= buffer_size && !capturing) {
+        // the buffer and data in one system call
+        struct iovec iov[2] = { { buffer, buffer_len }, { (void*) data, len } };
+        write_all_iov(iov, 2);
+        buffer_len = 0;
+        return;
+    }
+
+    out_flush();
+    if (len < buffer_size) {
+        memcpy(buffer, data, len);
+        buffer_len = len;
+    } else {
+        sink(data, len);
+    }
+}
+
+
+void
+out_puts(const char* s)
+{
+    out_write(s, strlen(s));
+}
+
+
+void
+out_printf(const char* format, ...)
+{
+    va_list args;
+    size_t space = buffer_size - buffer_len;
+
+    va_start(args, format);
+    int n = vsnprintf(buffer + buffer_len, space, format, args);
+    va_end(args);
+    if (n < 0) die("error formatting output");
+
+    if ((size_t) n < space) {
+        buffer_len += n;
+        n_bytes += n;
+        return;
+    }
+
+    // It didn't fit. vsnprintf() wrote a truncated copy past buffer_len, which
+    // we ignore.
+    char* s = malloc_or_die(n + 1);
+    va_start(args, format);
+    vsnprintf(s, n + 1, format, args);
+    va_end(args);
+    out_write(s, n);
+    free(s);
+}
+
+
+void
+out_json_string(const char* s)
+{
+    out_write("\"", 1);
+    const char* run = s;
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c != '"' && c != '\\' && c >= 0x20) continue;
+        out_write(run, s - run);
+        if (c == '"' || c == '\\') {
+            out_printf("\\%c", c);
+        } else {
+            out_printf("\\u%04x", c);
+        }
+        run = s + 1;
+    }
+    out_write(run, s - run);
+    out_write("\"", 1);
+}
+
+
+void
+out_vtext(const char* s)
+{
+    if (!s) return;
+    const char* run = s;
+    for (; *s; s++) {
+        char c = *s;
+        if (c != '\\' && c != ';' && c != ',' && c != '\n' && c != '\r') continue;
+        out_write(run, s - run);
+        if (c == '\n') {
+            out_write("\\n", 2);
+        } else if (c != '\r') {
+            char escaped[2] = { '\\', c };
+            out_write(escaped, 2);
+        }
+        run = s + 1;
+    }
+    out_write(run, s - run);
+}
+
+
+static char*
+encode_base64_group(char* o, const unsigned char* in)
+{
+    *o++ = BASE64_ALPHABET[in[0] >> 2];
+    *o++ = BASE64_ALPHABET[((in[0] & 0x03) << 4) | (in[1] >> 4)];
+    *o++ = BASE64_ALPHABET[((in[1] & 0x0f) << 2) | (in[2] >> 6)];
+    *o++ = BASE64_ALPHABET[in[2] & 0x3f];
+    return o;
+}
+
+
+typedef struct {
+    const unsigned char* in;
+    size_t    len;          // a multiple of BASE64_LINE_INPUT
+    char*     out;
+    size_t    out_len;
+} Base64Chunk;
+
+
+static void*
+encode_base64_chunk(void* arg)
+{
+    Base64Chunk* chunk = arg;
+    const unsigned char* in = chunk->in;
+    char* o = chunk->out;
+    for (size_t len = chunk->len; len > 0; len -= BASE64_LINE_INPUT) {
+        for (int i = 0; i < BASE64_LINE_INPUT; i += 3) {
+            o = encode_base64_group(o, in + i);
+        }
+        *o++ = '\n';
+        in += BASE64_LINE_INPUT;
+    }
+    chunk->out_len = o - chunk->out;
+    return NULL;
+}
+
+
+/**
+ * Encodes len bytes, a multiple of BASE64_LINE_INPUT, as out_base64()
+ * would: a chunk per thread at a time, then each chunk's lines in order.
+ *
+ * Output is sent on only while no other thread runs, so a limit or die()
+ * in sink() leaves nothing running behind it.
+ */
+static void
+base64_lines_parallel(const unsigned char* in, size_t len, unsigned n_threads)
+{
+    static char* out = NULL;
+    static unsigned out_threads = 0;
+    if (n_threads > out_threads) {
+        free(out);
+        out = malloc_or_die((size_t) n_threads * PARALLEL_BASE64_CHUNK_OUTPUT);
+        out_threads = n_threads;
+    }
+
+    out_flush();
+    while (len > 0) {
+        Base64Chunk chunks[MAX_ENCODE_THREADS];
+        pthread_t threads[MAX_ENCODE_THREADS];
+        int started[MAX_ENCODE_THREADS];
+        unsigned n = 0;
+        for (; n < n_threads && len > 0; n++) {
+            size_t chunk_len = len < PARALLEL_BASE64_CHUNK ? len : PARALLEL_BASE64_CHUNK;
+            chunks[n].in = in;
+            chunks[n].len = chunk_len;
+            chunks[n].out = out + (size_t) n * PARALLEL_BASE64_CHUNK_OUTPUT;
+            in += chunk_len;
+            len -= chunk_len;
+        }
+
+        // We encode the first chunk ourselves, and any chunk whose thread
+        // didn't start
+        for (unsigned i = 1; i < n; i++) {
+            started[i] = pthread_create(&threads[i], NULL, encode_base64_chunk, &chunks[i]) == 0;
+        }
+        encode_base64_chunk(&chunks[0]);
+        for (unsigned i = 1; i < n; i++) {
+            if (started[i]) {
+                pthread_join(threads[i], NULL);
+            } else {
+                encode_base64_chunk(&chunks[i]);
+            }
+        }
+
+        if (capturing) {
+            for (unsigned i = 0; i < n; i++) {
+                sink(chunks[i].out, chunks[i].out_len);
+            }
+        } else {
+            struct iovec iov[MAX_ENCODE_THREADS];
+            for (unsigned i = 0; i < n; i++) {
+                iov[i].iov_base = chunks[i].out;
+                iov[i].iov_len = chunks[i].out_len;
+            }
+            write_all_iov(iov, n);
+        }
+    }
+}
+
+
+void
+out_base64(const void* data, size_t len)
+{
+    const unsigned char* in = data;
+
+    STATS_BEGIN(start);
+    n_bytes += (len / 3 + (len % 3 ? 1 : 0)) * 4 + len / BASE64_LINE_INPUT;
+
+    if (len >= PARALLEL_BASE64_MIN && options.encode_threads > 1) {
+        size_t lines_len = len - len % BASE64_LINE_INPUT;
+        unsigned n_threads = options.encode_threads < MAX_ENCODE_THREADS ? options.encode_threads : MAX_ENCODE_THREADS;
+        base64_lines_parallel(in, lines_len, n_threads);
+        in += lines_len;
+        len -= lines_len;
+    }
+
+    while (len >= BASE64_LINE_INPUT) {
+        if (buffer_size - buffer_len < BASE64_LINE_OUTPUT) out_flush();
+        char* o = buffer + buffer_len;
+        for (int i = 0; i < BASE64_LINE_INPUT; i += 3) {
+            o = encode_base64_group(o, in + i);
+        }
+        *o = '\n';
+        buffer_len += BASE64_LINE_OUTPUT;
+        in += BASE64_LINE_INPUT;
+        len -= BASE64_LINE_INPUT;
+    }
+
+    if (len > 0) {
+        // the last, partial line: never ends in "\n"
+        if (buffer_size - buffer_len < BASE64_LINE_OUTPUT) out_flush();
+        char* o = buffer + buffer_len;
+        while (len >= 3) {
+            o = encode_base64_group(o, in);
+            in += 3;
+            len -= 3;
+        }
+        if (len > 0) {
+            unsigned char last[3] = { in[0], len > 1 ? in[1] : 0, 0 };
+            o = encode_base64_group(o, last);
+            o[-1] = '=';
+            if (len == 1) o[-2] = '=';
+        }
+        buffer_len = o - buffer;
+    }
+    STATS_END(PHASE_BASE64, start);
+}
+
+
+void
+out_base64_digest(const void* data, size_t len, Digest* digest)
+{
+    const unsigned char* in = data;
+    if (len >= PARALLEL_BASE64_MIN && options.encode_threads > 1) {
+        // Too large to stay in cache anyway: hash it, then encode it on
+        // several threads
+        digest_update(digest, in, len);
+        out_base64(in, len);
+        return;
+    }
+
+    // Whole lines at a time, so the output is the same as out_base64()'s
+    while (len > BASE64_HASH_BLOCK) {
+        digest_update(digest, in, BASE64_HASH_BLOCK);
+        out_base64(in, BASE64_HASH_BLOCK);
+        in += BASE64_HASH_BLOCK;
+        len -= BASE64_HASH_BLOCK;
+    }
+    digest_update(digest, in, len);
+    out_base64(in, len);
+}
+
+
+void
+out_capture_begin(void)
+{
+    out_flush();
+    capturing = 1;
+    capture_len = 0;
+    digest_init(&capture_digest, 0);
+}
+
+
+uint64_t
+out_capture_end(void)
+{
+    out_flush();
+    capturing = 0;
+    // Writing the capture will count these bytes again
+    n_bytes -= capture_len;
+    return digest_final(&capture_digest);
+}
+
+
+static void
+close_spill(void)
+{
+    if (capture_fd >= 0) {
+        close(capture_fd);
+        capture_fd = -1;
+    }
+}
+
+
+void
+out_capture_write(void)
+{
+    if (capture_fd < 0) {
+        out_write(capture, capture_len);
+        return;
+    }
+
+    // Through our buffer, a buffer at a time, so memory stays bounded
+    out_flush();
+    n_bytes += capture_len;
+    for (uint64_t offset = 0; offset < capture_len; ) {
+        ssize_t n = pread(capture_fd, buffer, buffer_size, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            close_spill();
+            die("could not read back a temp file");
+        }
+        write_all(buffer, n);
+        offset += n;
+    }
+    close_spill();
+}
+
+
+char*
+out_capture_take(uint64_t* len, int* fd)
+{
+    *len = capture_len;
+    n_bytes += capture_len;
+    *fd = capture_fd;
+    capture_fd = -1;
+    if (*fd >= 0) return NULL;
+
+    // The next capture starts a buffer of its own
+    char* data = capture;
+    capture = NULL;
+    capture_cap = 0;
+    return data;
+}
+
+
+void
+out_capture_cancel(void)
+{
+    if (capturing) {
+        buffer_len = 0;
+        capturing = 0;
+    }
+    close_spill();
+}
+
+
+uint64_t
+out_n_bytes(void)
+{
+    return n_bytes;
+}
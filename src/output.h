@@ -0,0 +1,91 @@
+/*
+ * Buffered writer for stdout.
+ *
+ * Every byte extract-pst emits goes through here rather than through stdio,
+ * so we can count it and time the writes.
+ */
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "digest.h"
+
+/**
+ * Looks at what stdout is, and if it's a pipe, enlarges it. Call it first
+ * thing, and again whenever stdout changes.
+ */
+void      out_init(void);
+
+void      out_write(const void* data, size_t len);
+void      out_puts(const char* s);
+void      out_printf(const char* format, ...) __attribute__((format(printf, 1, 2)));
+
+/**
+ * Writes s as a JSON string, quotes included.
+ */
+void      out_json_string(const char* s);
+
+/**
+ * Writes s as vCard/iCalendar text: "\", ";" and "," get a backslash,
+ * newlines become "\n" and CRs are dropped, even from a string with
+ * nothing else to escape. That is what the libpst we build against
+ * (0.6.72) does in pst_rfc2426_escape(), which counts CRs among the
+ * characters that make a copy; check it again before moving to another
+ * release. NULL writes nothing.
+ */
+void      out_vtext(const char* s);
+
+/**
+ * Writes data as base64, in 76-column lines separated by "\n" -- exactly as
+ * libpst's pst_base64_encode() would.
+ */
+void      out_base64(const void* data, size_t len);
+
+/**
+ * Writes data as out_base64() does, and adds data to digest as it goes.
+ */
+void      out_base64_digest(const void* data, size_t len, Digest* digest);
+
+void      out_flush(void);
+
+/**
+ * Holds output back, instead of writing it, until out_capture_end(). The
+ * capture is kept in memory up to options.spill_bytes, and in a temp file
+ * past that. Captures don't nest.
+ */
+void      out_capture_begin(void);
+
+/**
+ * Ends the capture and returns the XXH64 of its output.
+ */
+uint64_t  out_capture_end(void);
+
+/**
+ * Writes the output captured between out_capture_begin() and
+ * out_capture_end(). Call it once per capture.
+ */
+void      out_capture_write(void);
+
+/**
+ * Hands over the output captured between out_capture_begin() and
+ * out_capture_end(), instead of writing it, and sets *len to its size.
+ * Returns it in memory, for the caller to free(). Or, if it spilled, returns
+ * NULL and sets *fd to its temp file, for the caller to close(); else *fd is
+ * -1. Call it once per capture, in place of out_capture_write().
+ */
+char*     out_capture_take(uint64_t* len, int* fd);
+
+/**
+ * Drops the capture and anything still buffered: for die(), mid-item.
+ */
+void      out_capture_cancel(void);
+
+/**
+ * Returns the number of bytes passed to out_*() so far.
+ */
+uint64_t  out_n_bytes(void);
+
+#endif
@@ -0,0 +1,266 @@
+/*
+ * Block prefetching. See prefetch.h.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "extract-pst.h"
+#include "idindex.h"
+#include "options.h"
+#include "prefetch.h"
+#include "stats.h"
+#include "uring.h"
+
+// Block reads in flight
+#define PREFETCH_READS 64
+// Block reads waiting for room. More are dropped.
+#define MAX_PENDING 4096
+// As in shard.c: SLBLOCKs nest one level, plus one per embedded message
+#define MAX_DEPTH 8
+// Blocks are at most 8KB (MS-PST 2.2.2.8); anything larger we don't follow
+#define MAX_FOLLOWED_BLOCK (64 * 1024)
+// Where blocks we don't follow land. Reads may share it: nobody looks.
+#define SCRATCH_SIZE (64 * 1024)
+
+#define BTYPE_XBLOCK 0x01
+#define BTYPE_SLBLOCK 0x02
+// MS-PST 2.2.2.8.3.1: internal blocks (XBLOCKs, SLBLOCKs) have this BID
+// bit. They aren't encrypted, so we can follow them as they are.
+#define BID_INTERNAL 0x02
+
+typedef enum {
+    BLOCK_DATA,         // data, or an XBLOCK or XXBLOCK listing data blocks
+    BLOCK_SUBNODES,     // an SLBLOCK or SIBLOCK
+} BlockKind;
+
+typedef struct {
+    uint64_t  bid;
+    BlockKind kind;
+    int       depth;
+} BlockRequest;
+
+typedef struct {
+    BlockRequest request;
+    int          busy;
+    char*        buf;       // a block to follow; NULL if it went to scratch
+    struct iovec iov;
+} BlockRead;
+
+static int              active;
+static pst_file*        pst;
+static const DescTable* desc_table;
+static int              pst_fd = -1;
+static Ring             ring = { .fd = -1 };
+static int              ring_tried;
+static BlockRead        reads[PREFETCH_READS];
+static unsigned         n_in_flight;
+static BlockRequest     pending[MAX_PENDING];  // a FIFO
+static size_t           pending_head;
+static size_t           n_pending;
+static char             scratch[SCRATCH_SIZE];
+
+static uint64_t         n_reads;
+static uint64_t         n_read_bytes;
+static uint64_t         n_dropped;
+
+
+static uint64_t
+read_le(const unsigned char* p, size_t size)
+{
+    uint64_t v = 0;
+    for (size_t i = size; i > 0; i--) v = (v << 8) | p[i - 1];
+    return v;
+}
+
+
+static void
+request_block(uint64_t bid, BlockKind kind, int depth)
+{
+    if (!bid || depth > MAX_DEPTH) return;
+    if (n_pending == MAX_PENDING) {
+        n_dropped += 1;
+        return;
+    }
+    BlockRequest* request = &pending[(pending_head + n_pending) % MAX_PENDING];
+    request->bid = bid;
+    request->kind = kind;
+    request->depth = depth;
+    n_pending += 1;
+}
+
+
+/**
+ * Requests the blocks that a block we read lists.
+ */
+static void
+follow_block(const BlockRequest* request, const unsigned char* p, size_t len)
+{
+    size_t id_size = pst->do_read64 ? 8 : 4;
+    if (len < 4) return;
+    size_t n_entries = read_le(p + 2, 2);
+
+    if (p[0] == BTYPE_XBLOCK) {
+        // XBLOCK: btype, cLevel, cEnt, lcbTotal, then BIDs of data blocks
+        // (of XBLOCKs, in an XXBLOCK)
+        size_t header_size = 8;
+        for (size_t i = 0; i < n_entries && header_size + (i + 1) * id_size <= len; i++) {
+            request_block(read_le(p + header_size + i * id_size, id_size), BLOCK_DATA, request->depth + 1);
+        }
+    } else if (p[0] == BTYPE_SLBLOCK && request->kind == BLOCK_SUBNODES) {
+        size_t header_size = pst->do_read64 ? 8 : 4;
+        int level = p[1];
+        size_t entry_size = (level ? 2 : 3) * id_size;
+        for (size_t i = 0; i < n_entries && header_size + (i + 1) * entry_size <= len; i++) {
+            const unsigned char* entry = p + header_size + i * entry_size;
+            if (level) {
+                // SIENTRY: nid, bid of an SLBLOCK
+                request_block(read_le(entry + id_size, id_size), BLOCK_SUBNODES, request->depth + 1);
+            } else {
+                // SLENTRY: nid, bidData, bidSub
+                request_block(read_le(entry + id_size, id_size), BLOCK_DATA, request->depth + 1);
+                request_block(read_le(entry + 2 * id_size, id_size), BLOCK_SUBNODES, request->depth + 1);
+            }
+        }
+    }
+}
+
+
+static void
+read_completed(uint64_t slot, int res)
+{
+    BlockRead* read = &reads[slot];
+    read->busy = 0;
+    n_in_flight -= 1;
+    if (read->buf) {
+        if (res > 0) follow_block(&read->request, (unsigned char*) read->buf, res);
+        free(read->buf);
+        read->buf = NULL;
+    }
+}
+
+
+static void
+start_read(const BlockRequest* request)
+{
+    pst_index_ll* ptr = id_index_get(pst, request->bid);
+    if (!ptr || !ptr->size) return;
+
+    int follow = request->kind == BLOCK_SUBNODES || (request->bid & BID_INTERNAL);
+    if (follow && ptr->size > MAX_FOLLOWED_BLOCK) return;
+
+    unsigned slot = 0;
+    while (reads[slot].busy) slot++;
+    BlockRead* read = &reads[slot];
+    read->request = *request;
+    read->buf = follow ? malloc(ptr->size) : NULL;
+    if (follow && !read->buf) return;
+    read->iov.iov_base = follow ? read->buf : scratch;
+    read->iov.iov_len = ptr->size < SCRATCH_SIZE || follow ? ptr->size : SCRATCH_SIZE;
+    read->busy = 1;
+    ring_queue_read(&ring, pst_fd, &read->iov, ptr->offset, slot);
+    n_in_flight += 1;
+    n_reads += 1;
+    n_read_bytes += read->iov.iov_len;
+}
+
+
+/**
+ * Asks the kernel to read a block ahead: without io_uring, the best we
+ * can do.
+ */
+static void
+advise_block(const pst_index_ll* ptr)
+{
+    if (!ptr->size) return;
+    posix_fadvise(pst_fd, ptr->offset, ptr->size, POSIX_FADV_WILLNEED);
+    n_reads += 1;
+    n_read_bytes += ptr->size;
+}
+
+
+static void
+prefetch_entry(const DescEntry* entry)
+{
+    const pst_index_ll* desc = &desc_table->i_table[entry->desc];
+    const pst_index_ll* assoc = entry->assoc_tree == DESC_NONE ? NULL : &desc_table->i_table[entry->assoc_tree];
+    if (ring.fd >= 0) {
+        request_block(desc->i_id, BLOCK_DATA, 0);
+        if (assoc) request_block(assoc->i_id, BLOCK_SUBNODES, 0);
+    } else {
+        advise_block(desc);
+        if (assoc) advise_block(assoc);
+    }
+}
+
+
+void
+prefetch_begin(pst_file* pstfile, const DescTable* table)
+{
+    active = options.prefetch_items > 0;
+    if (!active) return;
+
+    pst = pstfile;
+    desc_table = table;
+    pst_fd = fileno(pstfile->fp);
+    if (!ring_tried) {
+        ring_tried = 1;
+        ring_open(&ring, PREFETCH_READS);
+    }
+    pending_head = 0;
+    n_pending = 0;
+    n_reads = 0;
+    n_read_bytes = 0;
+    n_dropped = 0;
+}
+
+
+uint32_t
+prefetch_ahead(const DescEntry* folder, uint32_t i, uint32_t next, uint64_t items_left)
+{
+    if (!active) return next;
+    if (ring.fd >= 0) ring_reap(&ring, read_completed);
+
+    uint64_t end = (uint64_t) i + options.prefetch_items + 1;
+    uint64_t n_items = 0; // from child i on, in process() order
+    for (uint32_t j = i; j < folder->n_children && j < end; j++) {
+        const DescEntry* entry = desc_child(desc_table, folder, j);
+        if (entry->n_children) {
+            // A folder's items are prefetched when process() gets to them,
+            // but they come before the children after it
+            if (items_left < UINT64_MAX) n_items += desc_count_items(desc_table, entry);
+            continue;
+        }
+        if (n_items++ >= items_left) break;
+        if (j < next) continue;
+        prefetch_entry(entry);
+        next = j + 1;
+    }
+
+    if (ring.fd >= 0) {
+        while (n_pending > 0 && n_in_flight < PREFETCH_READS) {
+            BlockRequest request = pending[pending_head];
+            pending_head = (pending_head + 1) % MAX_PENDING;
+            n_pending -= 1;
+            start_read(&request);
+        }
+        if (ring.to_submit) ring_enter(&ring, 0);
+    }
+    return next;
+}
+
+
+void
+prefetch_end(void)
+{
+    if (!active) return;
+    // Reads in flight are into our buffers
+    while (n_in_flight > 0) {
+        ring_enter(&ring, 1);
+        ring_reap(&ring, read_completed);
+    }
+    n_pending = 0;
+    active = 0;
+    if (stats_enabled) stats_prefetch(n_reads, n_read_bytes, n_dropped, ring.fd >= 0);
+}
@@ -0,0 +1,54 @@
+/*
+ * Block prefetching: reading the next items' blocks before libpst asks.
+ *
+ * pst_parse_item() reads an item's blocks one at a time, with fseeko() and
+ * fread(). On a slow disk or a network volume each read is a round trip,
+ * and there is only ever one in flight. So as process() reaches each item,
+ * prefetch_ahead() starts reading the blocks of the next several: each
+ * item's property block and its subnodes (recipients, attachments, long
+ * bodies). Reads go through io_uring, up to 64 at once, into the page
+ * cache, where libpst's reads then find them.
+ *
+ * XBLOCKs and subnode blocks list more blocks, so we read those ourselves
+ * and follow them when they arrive, a few levels deep. Without io_uring
+ * (see uring.h), we can only ask the kernel to read ahead each item's own
+ * two blocks, with posix_fadvise().
+ *
+ * A prefetch is a hint: one that fails, or that we have no room for, is
+ * dropped. It is off unless EXTRACT_PST_PREFETCH asks for it: on a local
+ * disk the kernel's own readahead does about as well, and the reads only
+ * add work. With EXTRACT_PST_SHARD, only items in this process's range are
+ * prefetched.
+ */
+
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <stdint.h>
+
+#include <libpst.h>
+
+#include "desc.h"
+
+/**
+ * Starts prefetching for pstfile, whose items are in table.
+ */
+void      prefetch_begin(pst_file* pstfile, const DescTable* table);
+
+/**
+ * Call it as process() reaches folder's child i. Starts reading the blocks
+ * of the children up to options.prefetch_items past it, from child next
+ * on, and returns the child to go on from next time (start at 0). Reads
+ * no more than items_left items, counting from child i in process() order
+ * (UINT64_MAX for no limit): a shard's range ends there. Also follows the
+ * blocks that have arrived since the last call. Doesn't block.
+ */
+uint32_t  prefetch_ahead(const DescEntry* folder, uint32_t i, uint32_t next, uint64_t items_left);
+
+/**
+ * Waits for the reads in flight and drops the rest. Call it before
+ * closing the PST.
+ */
+void      prefetch_end(void);
+
+#endif
@@ -0,0 +1,97 @@
+/*
+ * Resource discovery. See resources.h.
+ */
+
+#define _GNU_SOURCE
+
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "resources.h"
+
+// cgroup v1 says "no limit" with a number near INT64_MAX, rounded to pages
+#define CGROUP_V1_UNLIMITED (1ULL << 60)
+
+
+/**
+ * Reads a file holding one number. Returns 0 if it's missing, or holds
+ * something else ("max").
+ */
+static uint64_t
+read_number(const char* path)
+{
+    FILE* f = fopen(path, "r");
+    if (!f) return 0;
+    unsigned long long value = 0;
+    if (fscanf(f, "%llu", &value) != 1) value = 0;
+    fclose(f);
+    return value;
+}
+
+
+uint64_t
+resources_memory_limit(int* from_cgroup)
+{
+    *from_cgroup = 1;
+    uint64_t limit = read_number("/sys/fs/cgroup/memory.max");
+    if (limit) return limit;
+
+    limit = read_number("/sys/fs/cgroup/memory/memory.limit_in_bytes");
+    if (limit && limit < CGROUP_V1_UNLIMITED) return limit;
+
+    *from_cgroup = 0;
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGESIZE);
+    return pages > 0 && page_size > 0 ? (uint64_t) pages * page_size : 0;
+}
+
+
+/**
+ * Reads a CFS quota, as cgroup v2's cpu.max has it ("max 100000" or
+ * "150000 100000"), or from cgroup v1's two files ("-1" is no quota).
+ * Returns 0 if there is no quota.
+ */
+static unsigned
+cpu_quota(void)
+{
+    long long quota = -1, period = 0;
+    char max[16];
+
+    FILE* f = fopen("/sys/fs/cgroup/cpu.max", "r");
+    if (f) {
+        if (fscanf(f, "%15s %lld", max, &period) == 2 && strcmp(max, "max") != 0) {
+            sscanf(max, "%lld", &quota);
+        }
+        fclose(f);
+    } else {
+        f = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r");
+        if (f) {
+            if (fscanf(f, "%lld", &quota) != 1) quota = -1;
+            fclose(f);
+        }
+        f = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r");
+        if (f) {
+            if (fscanf(f, "%lld", &period) != 1) period = 0;
+            fclose(f);
+        }
+    }
+
+    if (quota <= 0 || period <= 0) return 0;
+    return (unsigned) ((quota + period - 1) / period);
+}
+
+
+unsigned
+resources_cpu_limit(void)
+{
+    unsigned n = 1;
+    cpu_set_t cpus;
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0 && CPU_COUNT(&cpus) > 0) {
+        n = CPU_COUNT(&cpus);
+    }
+
+    unsigned quota = cpu_quota();
+    return quota && quota < n ? quota : n;
+}
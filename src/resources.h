@@ -0,0 +1,23 @@
+/*
+ * What the container (or, failing that, the machine) lets us use.
+ */
+
+#ifndef RESOURCES_H
+#define RESOURCES_H
+
+#include <stdint.h>
+
+/**
+ * Returns our memory limit in bytes: the cgroup's (v2, then v1), or else
+ * physical RAM. Returns 0 if there's no telling. Sets *from_cgroup to
+ * whether a cgroup set it.
+ */
+uint64_t  resources_memory_limit(int* from_cgroup);
+
+/**
+ * Returns how many CPUs we can keep busy: the CPUs we may run on, capped
+ * by the cgroup's CPU quota (v2, then v1), rounded up. At least 1.
+ */
+unsigned  resources_cpu_limit(void);
+
+#endif
@@ -0,0 +1,247 @@
+/*
+ * Sharding. See shard.h.
+ */
+
+#include <stdlib.h>
+
+#include "extract-pst.h"
+#include "idindex.h"
+#include "shard.h"
+
+// Rendering an item costs something beyond its bytes: parsing, headers,
+// MIME boundaries. Counting it as this many bytes keeps a shard of small
+// messages from getting far more items than a shard of large ones.
+#define ITEM_OVERHEAD_BYTES 4096
+
+// SLBLOCKs and SIBLOCKs nest at most one level (MS-PST 2.2.2.8.3.3); the
+// attachment subnode trees inside them add one more per embedded message.
+#define MAX_SUBNODE_DEPTH 8
+
+#define BTYPE_XBLOCK 0x01
+#define BTYPE_SLBLOCK 0x02
+#define NID_TYPE_ATTACHMENT 0x05
+// MS-PST 2.2.2.8.3.1: internal blocks (XBLOCKs, SLBLOCKs) have this BID bit
+#define BID_INTERNAL 0x02
+
+// Every descriptor without children, in process() order: "items", though
+// some are empty folders or items process() doesn't count
+typedef struct {
+    uint64_t*      weights;
+    unsigned char* classes;     // ItemClass
+    size_t         len;
+    size_t         cap;
+} Weights;
+
+static uint64_t       first_item = 0;
+static uint64_t       end_item = UINT64_MAX;
+static uint64_t       next_item = 0;
+static uint64_t       n_items = 0;
+static unsigned char* item_classes; // of the items before first_item
+
+
+static uint64_t
+read_le(const unsigned char* p, size_t size)
+{
+    uint64_t v = 0;
+    for (size_t i = size; i > 0; i--) v = (v << 8) | p[i - 1];
+    return v;
+}
+
+
+uint64_t
+stored_data_bytes(pst_file* pstfile, uint64_t bid)
+{
+    pst_index_ll* ptr = id_index_get(pstfile, bid);
+    if (!ptr) return 0;
+    if (!(bid & BID_INTERNAL)) return ptr->size;
+
+    char* buf = NULL;
+    size_t len = pst_ff_getIDblock_dec(pstfile, bid, &buf);
+    uint64_t bytes = ptr->size;
+    if (buf && len >= 8 && buf[0] == BTYPE_XBLOCK) {
+        bytes = read_le((unsigned char*) buf + 4, 4); // lcbTotal
+    }
+    free(buf);
+    return bytes;
+}
+
+
+/**
+ * Returns the number of data bytes in a subnode tree (an SLBLOCK or
+ * SIBLOCK), including the subnode trees nested in it. Adds the bytes under
+ * attachment subnodes to *attachment_bytes, if it isn't NULL.
+ */
+static uint64_t
+subnode_bytes(pst_file* pstfile, uint64_t bid, int depth, uint64_t* attachment_bytes)
+{
+    if (depth > MAX_SUBNODE_DEPTH) return 0;
+
+    char* buf = NULL;
+    size_t len = pst_ff_getIDblock_dec(pstfile, bid, &buf);
+    if (!buf || len < 4 || buf[0] != BTYPE_SLBLOCK) {
+        free(buf);
+        return 0;
+    }
+
+    const unsigned char* p = (unsigned char*) buf;
+    size_t id_size = pstfile->do_read64 ? 8 : 4;
+    size_t header_size = pstfile->do_read64 ? 8 : 4;
+    int level = p[1];
+    size_t n_entries = read_le(p + 2, 2);
+    size_t entry_size = (level ? 2 : 3) * id_size;
+    if (header_size + n_entries * entry_size > len) {
+        n_entries = (len - header_size) / entry_size;
+    }
+
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < n_entries; i++) {
+        const unsigned char* entry = p + header_size + i * entry_size;
+        if (level) {
+            // SIENTRY: nid, bid of an SLBLOCK
+            bytes += subnode_bytes(pstfile, read_le(entry + id_size, id_size), depth + 1, attachment_bytes);
+        } else {
+            // SLENTRY: nid, bidData, bidSub. Everything under an attachment
+            // is the attachment's.
+            int attachment = (read_le(entry, id_size) & NID_TYPE_MASK) == NID_TYPE_ATTACHMENT;
+            uint64_t entry_bytes = stored_data_bytes(pstfile, read_le(entry + id_size, id_size));
+            uint64_t sub = read_le(entry + 2 * id_size, id_size);
+            if (sub) entry_bytes += subnode_bytes(pstfile, sub, depth + 1, attachment ? NULL : attachment_bytes);
+            if (attachment && attachment_bytes) *attachment_bytes += entry_bytes;
+            bytes += entry_bytes;
+        }
+    }
+    free(buf);
+    return bytes;
+}
+
+
+uint64_t
+item_stored_bytes(pst_file* pstfile, pst_desc_tree* d_ptr, uint64_t* attachment_bytes)
+{
+    uint64_t bytes = stored_data_bytes(pstfile, d_ptr->desc->i_id);
+    if (d_ptr->assoc_tree) {
+        bytes += subnode_bytes(pstfile, d_ptr->assoc_tree->i_id, 0, attachment_bytes);
+    }
+    return bytes;
+}
+
+
+static uint64_t
+item_weight(pst_file* pstfile, pst_desc_tree* d_ptr)
+{
+    return ITEM_OVERHEAD_BYTES + item_stored_bytes(pstfile, d_ptr, NULL);
+}
+
+
+/**
+ * Appends the weight of every item under folder, in process() order.
+ */
+static void
+collect_weights(pst_file* pstfile, const DescTable* table, const DescEntry* folder, Weights* weights)
+{
+    for (uint32_t i = 0; i < folder->n_children; i++) {
+        const DescEntry* entry = desc_child(table, folder, i);
+        if (entry->n_children) {
+            collect_weights(pstfile, table, entry, weights);
+            continue;
+        }
+
+        if (weights->len == weights->cap) {
+            weights->cap = weights->cap ? weights->cap * 2 : 1024;
+            uint64_t* grown = realloc(weights->weights, weights->cap * sizeof(uint64_t));
+            unsigned char* grown_classes = realloc(weights->classes, weights->cap);
+            if (grown) weights->weights = grown;
+            if (grown_classes) weights->classes = grown_classes;
+            if (!grown || !grown_classes) die("out of memory while planning shards");
+        }
+        pst_desc_tree node;
+        desc_node(table, entry, &node);
+        // Only what gets a part costs much to render
+        ItemClass class = classify_item(pstfile, &node);
+        weights->classes[weights->len] = class;
+        weights->weights[weights->len++] = class == ITEM_CLASS_NUMBERED ? item_weight(pstfile, &node) : 0;
+    }
+}
+
+
+void
+shard_plan(pst_file* pstfile, const DescTable* table, unsigned index, unsigned n_shards)
+{
+    Weights weights = { NULL, NULL, 0, 0 };
+    collect_weights(pstfile, table, &table->entries[0], &weights);
+
+    uint64_t total = 0;
+    for (size_t i = 0; i < weights.len; i++) total += weights.weights[i];
+    if (!total) total = 1; // nothing to render: shard 0 takes it all
+
+    // An item belongs to the shard its first byte falls in.
+    first_item = weights.len;
+    end_item = index == n_shards - 1 ? UINT64_MAX : weights.len;
+    uint64_t offset = 0;
+    for (size_t i = 0; i < weights.len; i++) {
+        unsigned shard = (unsigned) (offset * n_shards / total);
+        if (shard >= n_shards) shard = n_shards - 1; // weightless, at the end
+        if (shard == index && first_item == weights.len) first_item = i;
+        if (shard > index) {
+            end_item = i;
+            break;
+        }
+        offset += weights.weights[i];
+    }
+    if (first_item > end_item) first_item = end_item;
+
+    // What process() counts in "progress"
+    n_items = 0;
+    for (size_t i = first_item; i < weights.len && i < end_item; i++) {
+        if (weights.classes[i] != ITEM_CLASS_NONE) n_items += 1;
+    }
+
+    free(weights.weights);
+    free(item_classes);
+    item_classes = weights.classes;
+}
+
+
+uint64_t
+shard_n_items(void)
+{
+    return n_items;
+}
+
+
+static ShardRange
+range_of(uint64_t item)
+{
+    if (item < first_item) return SHARD_BEFORE;
+    if (item < end_item) return SHARD_MINE;
+    return SHARD_AFTER;
+}
+
+
+ShardRange
+shard_next_item(void)
+{
+    return range_of(next_item++);
+}
+
+
+uint64_t
+shard_items_left(void)
+{
+    if (end_item == UINT64_MAX) return UINT64_MAX;
+    return end_item > next_item ? end_item - next_item : 0;
+}
+
+
+int
+shard_item_numbered(void)
+{
+    return item_classes[next_item - 1] == ITEM_CLASS_NUMBERED;
+}
+
+
+ShardRange
+shard_here(void)
+{
+    return range_of(next_item);
+}
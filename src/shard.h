@@ -0,0 +1,87 @@
+/*
+ * Sharding: splitting one PST between several extract-pst processes.
+ *
+ * With EXTRACT_PST_SHARD=i/N, each of N processes loads the whole index and
+ * renders only the i'th of N contiguous ranges of items (0 <= i < N). The
+ * ranges are balanced by bytes: each item's property context plus its
+ * subnodes (long bodies, attachments), plus a fixed per-item cost. Every
+ * process computes the same ranges from the same index.
+ *
+ * To plan, each process classifies every item as process() would, with
+ * classify_item(): only items that get parts weigh anything, and only
+ * items that count in "progress" count in shard_n_items(). process() still
+ * walks the folder tree up to the end of its range, and numbers the items
+ * before it by their classes, so that each part keeps the index and
+ * filename a full run would give it. Concatenating the shards' parts
+ * (minus their "done" and "progress" parts) gives a full run's parts.
+ *
+ * That holds only if every numbered item gets a part. So sharding doesn't
+ * work with the item limits, or with dedup.
+ */
+
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stdint.h>
+
+#include <libpst.h>
+
+#include "desc.h"
+
+typedef enum {
+    SHARD_BEFORE,   // an earlier shard renders it: count it, don't render it
+    SHARD_MINE,
+    SHARD_AFTER,    // a later shard renders it, and everything after it
+} ShardRange;
+
+/**
+ * Computes this process's range of the items in table. Until this is
+ * called, every item is SHARD_MINE.
+ */
+void        shard_plan(pst_file* pstfile, const DescTable* table, unsigned index, unsigned n_shards);
+
+/**
+ * Returns the number of items in this process's range that process()
+ * counts in "progress".
+ */
+uint64_t    shard_n_items(void);
+
+/**
+ * Returns the range of the next item process() visits, and moves past it.
+ * Call it once per descriptor that has no children, in process() order.
+ */
+ShardRange  shard_next_item(void);
+
+/**
+ * Returns the number of items in this process's range from the one
+ * shard_next_item() will return next on, or UINT64_MAX if the range runs
+ * to the end.
+ */
+uint64_t    shard_items_left(void);
+
+/**
+ * Returns nonzero if the item shard_next_item() last returned is one that
+ * process() numbers. Only call it for an item before this process's range.
+ */
+int         shard_item_numbered(void);
+
+/**
+ * Returns the range a descriptor with children (a folder) falls in, without
+ * moving past anything.
+ */
+ShardRange  shard_here(void);
+
+/**
+ * Returns the number of data bytes under a BID: its block's size, or for an
+ * XBLOCK or XXBLOCK, the size of the data it points to.
+ */
+uint64_t    stored_data_bytes(pst_file* pstfile, uint64_t bid);
+
+/**
+ * Returns the bytes the PST stores for an item: its property context plus
+ * its subnodes (long bodies, attachments, embedded messages). If
+ * attachment_bytes isn't NULL, adds the attachments' share to it.
+ */
+uint64_t    item_stored_bytes(pst_file* pstfile, pst_desc_tree* d_ptr, uint64_t* attachment_bytes);
+
+#endif
@@ -0,0 +1,227 @@
+/*
+ * Run statistics. See stats.h.
+ */
+
+#include <inttypes.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "extract-pst.h"
+#include "options.h"
+#include "output.h"
+#include "stats.h"
+
+typedef struct {
+    uint64_t ns;
+    uint64_t count;
+} PhaseStats;
+
+static const char* PHASE_NAMES[N_PHASES] = {
+    "indexLoad",
+    "census",
+    "parseItem",
+    "utf8",
+    "headers",
+    "rtf",
+    "base64",
+    "stdoutWrite",
+    "export",
+};
+
+static const char* ITEM_KIND_NAMES[N_ITEM_KINDS] = {
+    "email",
+    "duplicateEmail",
+    "contact",
+    "journal",
+    "appointment",
+    "folder",
+    "other",
+    "skipped",
+};
+
+int stats_enabled = 0;
+
+static PhaseStats phases[N_PHASES];
+static uint64_t   n_items[N_ITEM_KINDS];
+static uint64_t   run_start_ns;
+static uint64_t   first_byte_ns;
+static uint64_t   run_start_bytes_out;
+static uint64_t   desc_n_nodes;
+static uint64_t   desc_tree_bytes;
+static uint64_t   desc_table_bytes;
+static uint64_t   stdout_pipe_bytes;
+static uint64_t   n_stdout_writes;
+static uint64_t   n_stdout_blocked_writes;
+static uint64_t   stdout_blocked_ns;
+static uint64_t   n_prefetch_reads;
+static uint64_t   prefetch_bytes;
+static uint64_t   n_prefetch_dropped;
+static int        prefetch_io_uring;
+static uint64_t   n_lookups;
+static uint64_t   n_lookup_probes;
+static uint64_t   max_lookup_probes;
+
+
+uint64_t
+stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+void
+stats_enable(void)
+{
+    stats_enabled = 1;
+    run_start_ns = stats_now();
+    // A batch input's process starts with its parent's counts
+    run_start_bytes_out = out_n_bytes();
+    first_byte_ns = 0;
+}
+
+
+void
+stats_add_phase(Phase phase, uint64_t start_ns)
+{
+    phases[phase].ns += stats_now() - start_ns;
+    phases[phase].count += 1;
+}
+
+
+void
+stats_count_item(ItemKind kind)
+{
+    n_items[kind] += 1;
+}
+
+
+void
+stats_stdout_pipe(uint64_t pipe_bytes)
+{
+    stdout_pipe_bytes = pipe_bytes;
+}
+
+
+void
+stats_prefetch(uint64_t n_reads, uint64_t bytes, uint64_t n_dropped, int io_uring)
+{
+    n_prefetch_reads = n_reads;
+    prefetch_bytes = bytes;
+    n_prefetch_dropped = n_dropped;
+    prefetch_io_uring = io_uring;
+}
+
+
+void
+stats_stdout_write(uint64_t ns, int blocked)
+{
+    n_stdout_writes += 1;
+    if (blocked) {
+        n_stdout_blocked_writes += 1;
+        stdout_blocked_ns += ns;
+    }
+}
+
+
+void
+stats_count_lookup(unsigned probes)
+{
+    n_lookups += 1;
+    n_lookup_probes += probes;
+    if (probes > max_lookup_probes) max_lookup_probes = probes;
+}
+
+
+void
+stats_desc_table(uint64_t n_nodes, uint64_t tree_bytes, uint64_t table_bytes)
+{
+    desc_n_nodes = n_nodes;
+    desc_tree_bytes = tree_bytes;
+    desc_table_bytes = table_bytes;
+}
+
+
+void
+stats_first_byte(void)
+{
+    if (!first_byte_ns) first_byte_ns = stats_now();
+}
+
+
+void
+output_stats(const char* input_path)
+{
+    struct stat st;
+    uint64_t bytes_in = stat(input_path, &st) == 0 ? (uint64_t) st.st_size : 0;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    output_part("stats", "");
+    // count the bytes of this part's own header, but nothing after it
+    uint64_t bytes_out = out_n_bytes() - run_start_bytes_out;
+
+    out_printf("{\"phases\":{");
+    for (int i = 0; i < N_PHASES; i++) {
+        out_printf(
+            "%s\"%s\":{\"ns\":%" PRIu64 ",\"count\":%" PRIu64 "}",
+            i ? "," : "",
+            PHASE_NAMES[i],
+            phases[i].ns,
+            phases[i].count
+        );
+    }
+    out_printf("},\"items\":{");
+    for (int i = 0; i < N_ITEM_KINDS; i++) {
+        out_printf("%s\"%s\":%" PRIu64, i ? "," : "", ITEM_KIND_NAMES[i], n_items[i]);
+    }
+    out_printf(
+        "},\"descTree\":{\"nodes\":%" PRIu64 ",\"libpstBytes\":%" PRIu64 ",\"tableBytes\":%" PRIu64 "}",
+        desc_n_nodes,
+        desc_tree_bytes,
+        desc_table_bytes
+    );
+    out_printf(
+        ",\"stdout\":{\"pipeBytes\":%" PRIu64 ",\"writes\":%" PRIu64 ",\"blockedWrites\":%" PRIu64 ",\"blockedNs\":%" PRIu64 "}",
+        stdout_pipe_bytes,
+        n_stdout_writes,
+        n_stdout_blocked_writes,
+        stdout_blocked_ns
+    );
+    out_printf(
+        ",\"resources\":{\"cpus\":%u,\"memoryBudgetBytes\":%" PRIu64 ",\"jobs\":%u,\"encodeThreads\":%u"
+        ",\"spillBytes\":%" PRIu64 ",\"outputBufferBytes\":%" PRIu64 ",\"pipeBufferBytes\":%" PRIu64 "}",
+        options.cpus,
+        options.memory_budget,
+        options.jobs,
+        options.encode_threads,
+        options.spill_bytes,
+        options.output_buffer_bytes,
+        options.pipe_bytes
+    );
+    out_printf(
+        ",\"prefetch\":{\"reads\":%" PRIu64 ",\"bytes\":%" PRIu64 ",\"dropped\":%" PRIu64 ",\"ioUring\":%s}",
+        n_prefetch_reads,
+        prefetch_bytes,
+        n_prefetch_dropped,
+        prefetch_io_uring ? "true" : "false"
+    );
+    out_printf(
+        ",\"idLookups\":{\"count\":%" PRIu64 ",\"probes\":%" PRIu64 ",\"maxProbes\":%" PRIu64 "}",
+        n_lookups,
+        n_lookup_probes,
+        max_lookup_probes
+    );
+    out_printf(
+        ",\"wallNs\":%" PRIu64 ",\"firstByteNs\":%" PRIu64 ",\"bytesIn\":%" PRIu64 ",\"bytesOut\":%" PRIu64 ",\"peakRssBytes\":%" PRIu64 "}",
+        stats_now() - run_start_ns,
+        // 0 when everything fit in the output buffer until now
+        first_byte_ns ? first_byte_ns - run_start_ns : 0,
+        bytes_in,
+        bytes_out,
+        (uint64_t) usage.ru_maxrss * 1024
+    );
+}
@@ -0,0 +1,95 @@
+/*
+ * Run statistics: per-phase timing and item counts.
+ *
+ * Disabled by default. When disabled, STATS_BEGIN/STATS_END cost a branch.
+ * Phase times are inclusive: a base64 phase may contain stdout writes, and a
+ * header phase may contain UTF-8 conversions.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+typedef enum {
+    PHASE_INDEX_LOAD,
+    PHASE_CENSUS,
+    PHASE_PARSE_ITEM,
+    PHASE_UTF8,
+    PHASE_HEADERS,
+    PHASE_RTF,
+    PHASE_BASE64,
+    PHASE_STDOUT_WRITE,
+    PHASE_EXPORT,
+    N_PHASES
+} Phase;
+
+typedef enum {
+    ITEM_EMAIL,
+    ITEM_DUPLICATE_EMAIL,
+    ITEM_CONTACT,
+    ITEM_JOURNAL,
+    ITEM_APPOINTMENT,
+    ITEM_FOLDER,
+    ITEM_OTHER,
+    ITEM_SKIPPED,
+    N_ITEM_KINDS
+} ItemKind;
+
+extern int stats_enabled;
+
+/**
+ * Turns on collection. Call it first thing: the run's wall time starts here.
+ */
+void      stats_enable(void);
+
+/**
+ * Returns CLOCK_MONOTONIC, in nanoseconds.
+ */
+uint64_t  stats_now(void);
+
+void      stats_add_phase(Phase phase, uint64_t start_ns);
+void      stats_count_item(ItemKind kind);
+
+/**
+ * Counts a block ID lookup that took this many hash probes.
+ */
+void      stats_count_lookup(unsigned probes);
+
+/**
+ * Records the descriptor tree's size: libpst's node count and bytes, and
+ * the bytes of the DescTable that replaced it.
+ */
+void      stats_desc_table(uint64_t n_nodes, uint64_t tree_bytes, uint64_t table_bytes);
+
+/**
+ * Records the size of the stdout pipe, or 0 if stdout isn't a pipe.
+ */
+void      stats_stdout_pipe(uint64_t pipe_bytes);
+
+/**
+ * Counts a write to stdout that took ns. It is "blocked" if the pipe hadn't
+ * room for it: it waited on the reader.
+ */
+void      stats_stdout_write(uint64_t ns, int blocked);
+
+/**
+ * Records what prefetch.c did: block reads started (or, without io_uring,
+ * advised), their bytes, and reads dropped for want of room.
+ */
+void      stats_prefetch(uint64_t n_reads, uint64_t bytes, uint64_t n_dropped, int io_uring);
+
+/**
+ * Notes that output is about to reach stdout. Only the first call counts.
+ */
+void      stats_first_byte(void);
+
+/**
+ * Writes the "stats" form-data part.
+ */
+void      output_stats(const char* input_path);
+
+#define STATS_BEGIN(var) uint64_t var = stats_enabled ? stats_now() : 0
+#define STATS_END(phase, var) do { if (stats_enabled) stats_add_phase((phase), (var)); } while (0)
+
+#endif
@@ -0,0 +1,151 @@
+/*
+ * Chrome trace_event output. See trace.h.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "extract-pst.h"
+#include "output.h"
+#include "stats.h"
+#include "trace.h"
+
+#define TRACE_BUFFER_SIZE (1024 * 1024)
+
+// room for one event's fixed fields; paths are bounded separately
+#define TRACE_EVENT_MAX 512
+#define TRACE_PATH_MAX 1024
+
+int trace_enabled = 0;
+
+static int      fd = -1;
+static char     buffer[TRACE_BUFFER_SIZE];
+static size_t   buffer_len = 0;
+static uint64_t trace_start_ns;
+
+
+static void
+flush_trace(void)
+{
+    const char* p = buffer;
+    while (buffer_len > 0) {
+        ssize_t n = write(fd, p, buffer_len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            // Tracing is a diagnostic; never fail the conversion over it.
+            trace_enabled = 0;
+            break;
+        }
+        p += n;
+        buffer_len -= n;
+    }
+    buffer_len = 0;
+}
+
+
+static void
+reserve(size_t len)
+{
+    if (TRACE_BUFFER_SIZE - buffer_len < len) flush_trace();
+}
+
+
+static void
+append_json_string(const char* s)
+{
+    size_t max = TRACE_PATH_MAX;
+    buffer[buffer_len++] = '"';
+    for (; *s && max; s++, max--) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            buffer[buffer_len++] = '\\';
+            buffer[buffer_len++] = c;
+        } else if (c < 0x20) {
+            buffer_len += sprintf(buffer + buffer_len, "\\u%04x", c);
+        } else {
+            buffer[buffer_len++] = c;
+        }
+    }
+    buffer[buffer_len++] = '"';
+}
+
+
+void
+trace_open(const char* path)
+{
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        die("could not open EXTRACT_PST_TRACE file");
+    }
+    trace_enabled = 1;
+    trace_start_ns = stats_now();
+    buffer_len = sprintf(
+        buffer,
+        "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+        "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"extract-pst\"}}"
+    );
+}
+
+
+void
+trace_close(void)
+{
+    if (fd < 0) return;
+    reserve(8);
+    buffer_len += sprintf(buffer + buffer_len, "\n]}\n");
+    flush_trace();
+    close(fd);
+    fd = -1;
+    trace_enabled = 0;
+}
+
+
+void
+trace_begin(TraceSpan* span, const char* name)
+{
+    if (!trace_enabled) return;
+    span->name = name;
+    span->d_id = 0;
+    span->path = NULL;
+    span->size = 0;
+    span->start_bytes_out = out_n_bytes();
+    span->start_ns = stats_now();
+}
+
+
+void
+trace_end(TraceSpan* span)
+{
+    if (!trace_enabled) return;
+    uint64_t end_ns = stats_now();
+
+    // worst case: every path byte escapes to \u00XX
+    reserve(TRACE_EVENT_MAX + TRACE_PATH_MAX * 6);
+    buffer_len += sprintf(
+        buffer + buffer_len,
+        ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%" PRIu64 ".%03" PRIu64 ",\"dur\":%" PRIu64 ".%03" PRIu64 ",\"args\":{\"bytesOut\":%" PRIu64,
+        span->name,
+        (span->start_ns - trace_start_ns) / 1000,
+        (span->start_ns - trace_start_ns) % 1000,
+        (end_ns - span->start_ns) / 1000,
+        (end_ns - span->start_ns) % 1000,
+        out_n_bytes() - span->start_bytes_out
+    );
+    if (span->d_id) {
+        buffer_len += sprintf(buffer + buffer_len, ",\"dId\":\"%#" PRIx64 "\"", span->d_id);
+    }
+    if (span->size) {
+        buffer_len += sprintf(buffer + buffer_len, ",\"size\":%" PRIu64, span->size);
+    }
+    if (span->path) {
+        memcpy(buffer + buffer_len, ",\"path\":", 8);
+        buffer_len += 8;
+        append_json_string(span->path);
+    }
+    buffer[buffer_len++] = '}';
+    buffer[buffer_len++] = '}';
+}
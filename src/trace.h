@@ -0,0 +1,41 @@
+/*
+ * Chrome trace_event output, for loading a run into Perfetto or
+ * chrome://tracing.
+ *
+ * Disabled unless EXTRACT_PST_TRACE names a file. Events are complete ("X")
+ * events, appended to a private buffer and written out in large blocks.
+ * Only the main thread may trace, so the writer needs no locks.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+typedef struct {
+    const char* name;       // must outlive the span
+    uint64_t    start_ns;
+    uint64_t    start_bytes_out;
+    uint64_t    d_id;       // descriptor ID, or 0 to omit
+    const char* path;       // folder path, or NULL to omit
+    uint64_t    size;       // input size in bytes, or 0 to omit
+} TraceSpan;
+
+extern int trace_enabled;
+
+void      trace_open(const char* path);
+void      trace_close(void);
+
+/**
+ * Starts a span. Callers may set span->name, d_id, path and size any time
+ * before trace_end().
+ */
+void      trace_begin(TraceSpan* span, const char* name);
+
+/**
+ * Records the span as one event. Its args hold whichever of d_id, path and
+ * size are set, plus bytesOut: the number of bytes written during the span.
+ */
+void      trace_end(TraceSpan* span);
+
+#endif
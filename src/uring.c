@@ -0,0 +1,136 @@
+/*
+ * io_uring, by hand. See uring.h.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if defined(__has_include)
+#  if __has_include(<linux/io_uring.h>)
+#    include <linux/io_uring.h>
+#  endif
+#endif
+#if defined(IORING_ENTER_GETEVENTS) && defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#  define HAVE_IO_URING 1
+#endif
+
+#include "extract-pst.h"
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+
+int
+ring_open(Ring* ring, unsigned n_entries)
+{
+    ring->fd = -1;
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, n_entries, &p);
+    if (fd < 0) return 0;
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    size_t sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    char* sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    char* cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    void* sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+        if (sq != MAP_FAILED) munmap(sq, sq_size);
+        if (cq != MAP_FAILED) munmap(cq, cq_size);
+        if (sqes != MAP_FAILED) munmap(sqes, sqes_size);
+        close(fd);
+        return 0;
+    }
+
+    ring->fd = fd;
+    ring->sq_head = (unsigned*) (sq + p.sq_off.head);
+    ring->sq_tail = (unsigned*) (sq + p.sq_off.tail);
+    ring->sq_mask = *(unsigned*) (sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned*) (sq + p.sq_off.array);
+    ring->sqes = sqes;
+    ring->cq_head = (unsigned*) (cq + p.cq_off.head);
+    ring->cq_tail = (unsigned*) (cq + p.cq_off.tail);
+    ring->cq_mask = *(unsigned*) (cq + p.cq_off.ring_mask);
+    ring->cqes = cq + p.cq_off.cqes;
+    ring->to_submit = 0;
+    return 1;
+}
+
+
+static void
+queue(Ring* ring, int opcode, int fd, const struct iovec* iov, uint64_t offset, uint64_t user_data)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & ring->sq_mask;
+    struct io_uring_sqe* sqe = (struct io_uring_sqe*) ring->sqes + index;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->addr = (uintptr_t) iov;
+    sqe->len = 1;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit += 1;
+}
+
+
+void
+ring_queue_write(Ring* ring, int fd, const struct iovec* iov, uint64_t offset, uint64_t user_data)
+{
+    queue(ring, IORING_OP_WRITEV, fd, iov, offset, user_data);
+}
+
+
+void
+ring_queue_read(Ring* ring, int fd, const struct iovec* iov, uint64_t offset, uint64_t user_data)
+{
+    queue(ring, IORING_OP_READV, fd, iov, offset, user_data);
+}
+
+
+void
+ring_enter(Ring* ring, unsigned min_complete)
+{
+    int n;
+    unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    while ((n = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, min_complete, flags, NULL, 0)) < 0 && errno == EINTR);
+    if (n < 0) die("io_uring_enter failed");
+    ring->to_submit -= n;
+}
+
+
+void
+ring_reap(Ring* ring, RingCompletion completion)
+{
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        struct io_uring_cqe* cqe = (struct io_uring_cqe*) ring->cqes + (head & ring->cq_mask);
+        completion(cqe->user_data, cqe->res);
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+#else // !HAVE_IO_URING
+
+int
+ring_open(Ring* ring, unsigned n_entries)
+{
+    (void) n_entries;
+    ring->fd = -1;
+    return 0;
+}
+
+// ring_open() never succeeds, so nothing calls these
+
+void ring_queue_write(Ring* ring, int fd, const struct iovec* iov, uint64_t offset, uint64_t user_data) {}
+void ring_queue_read(Ring* ring, int fd, const struct iovec* iov, uint64_t offset, uint64_t user_data) {}
+void ring_enter(Ring* ring, unsigned min_complete) {}
+void ring_reap(Ring* ring, RingCompletion completion) {}
+
+#endif // HAVE_IO_URING
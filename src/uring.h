@@ -0,0 +1,61 @@
+/*
+ * A minimal io_uring: one ring, vectored reads and writes, and completions
+ * handed to a callback.
+ *
+ * There is no liburing on Alpine 3.7, so we make the system calls
+ * ourselves. Where the kernel headers don't know them, ring_open() always
+ * fails. It fails, too, on kernels before 5.1, and under seccomp profiles
+ * that forbid io_uring (Docker's default, for one). Callers fall back to
+ * plain system calls then.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+typedef struct {
+    int       fd;           // -1 if not open
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned  sq_mask;
+    unsigned* sq_array;
+    void*     sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned  cq_mask;
+    void*     cqes;
+    unsigned  to_submit;
+} Ring;
+
+typedef void (*RingCompletion)(uint64_t user_data, int res);
+
+/**
+ * Sets up ring with room for n_entries operations at once. Returns 0, and
+ * leaves ring->fd at -1, if io_uring isn't available.
+ *
+ * The caller must keep no more than n_entries operations in flight.
+ */
+int       ring_open(Ring* ring, unsigned n_entries);
+
+/**
+ * Queues a pwritev() or preadv() of one iovec. iov must stay put until the
+ * operation completes; user_data comes back with its result.
+ */
+void      ring_queue_write(Ring* ring, int fd, const struct iovec* iov, uint64_t offset, uint64_t user_data);
+void      ring_queue_read(Ring* ring, int fd, const struct iovec* iov, uint64_t offset, uint64_t user_data);
+
+/**
+ * Submits what's queued, and waits until min_complete operations have
+ * completed (0 for "don't wait").
+ */
+void      ring_enter(Ring* ring, unsigned min_complete);
+
+/**
+ * Calls completion for each operation that has completed, without waiting.
+ * completion may queue more operations, but not reap.
+ */
+void      ring_reap(Ring* ring, RingCompletion completion);
+
+#endif
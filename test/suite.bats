@@ -17,3 +17,128 @@ setup() {
     diff --text -u /tmp/test/output.mime $dir/expect-output.mime
   done
 }
+
+# The options below change which parts there are, not how each item renders,
+# so rather than keep more expected outputs, each test compares runs.
+
+FIXTURE=/app/test/test-appointments-and-emails-ansi
+
+# Converts file $1, with the fixture's input.json plus options $2 (a JSON
+# object) and filename $3 (default: input.pst), into file $4
+convert() {
+  local json="$(jq --argjson options "$2" --arg filename "${3:-input.pst}" '. + { options: $options, filename: $filename }' $FIXTURE/input.json)"
+  mkdir "$4.d"
+  (cd "$4.d" && /app/do-convert-stream-to-mime-multipart MIME-BOUNDARY "$json" < "$1") > "$4"
+}
+
+# Prints a stream without the parts whose names match regex $1, or its end
+without_parts() {
+  awk -v drop="^Content-Disposition: form-data; name=($1)\r?$" '
+    /^--MIME-BOUNDARY--$/ { next }
+    /^--MIME-BOUNDARY\r?$/ { boundary = $0; getline header; skip = header ~ drop; if (!skip) { print boundary; print header }; next }
+    !skip { print }
+  '
+}
+
+# Prints the JSON of each part whose name matches regex $1, one per line
+json_parts() {
+  tr -d '\r' | awk -v keep="^Content-Disposition: form-data; name=($1)$" '
+    /^--MIME-BOUNDARY$/ { getline header; json = header ~ keep; getline; next }
+    json { print }
+  ' | jq -c .
+}
+
+# Prints the names of a stream's parts
+part_names() {
+  tr -d '\r' | sed -n 's/^Content-Disposition: form-data; name=//p'
+}
+
+# Writes a zip of two copies of the fixture, a.pst and b.pst, to pst.zip
+zip_fixture() {
+  cp $FIXTURE/input.blob a.pst
+  cp $FIXTURE/input.blob b.pst
+  zip -q pst.zip a.pst b.pst
+}
+
+@test "shards concatenate into a full run" {
+  convert $FIXTURE/input.blob '{}' input.pst full.mime
+  without_parts 'progress|done' < full.mime > full.parts
+  for n in 2 3; do
+    : > shards.parts
+    for i in $(seq 0 $((n - 1))); do
+      convert $FIXTURE/input.blob "{\"shard\":\"$i/$n\"}" input.pst shard-$i-$n.mime
+      without_parts 'progress|done' < shard-$i-$n.mime >> shards.parts
+    done
+    diff --text -u full.parts shards.parts
+  done
+}
+
+@test "a zip of PSTs numbers parts across its PSTs" {
+  convert $FIXTURE/input.blob '{}' input.pst single.mime
+  zip_fixture
+  convert "$PWD/pst.zip" '{}' input.zip batch.mime
+
+  n="$(json_parts '[0-9]+\.json' < single.mime | wc -l)"
+  [ "$n" -gt 0 ]
+  seq 0 $((2 * n - 1)) | sed 's/$/.json/' > expect-names
+  part_names < batch.mime | grep '\.json$' > names
+  diff -u expect-names names
+
+  json_parts '[0-9]+\.json' < single.mime | jq -r '.filename | sub("^input.pst"; "")' > single-filenames
+  (sed 's|^|input.zip/a.pst|' single-filenames; sed 's|^|input.zip/b.pst|' single-filenames) > expect-filenames
+  json_parts '[0-9]+\.json' < batch.mime | jq -r .filename > filenames
+  diff -u expect-filenames filenames
+}
+
+@test "dedup turns a second PST's emails into duplicates of the first's" {
+  zip_fixture
+  convert "$PWD/pst.zip" '{"dedup":true}' input.zip dedup.mime
+
+  n_emails="$(json_parts '[0-9]+\.json' < dedup.mime | jq -r .filename | grep -c '^input.zip/a.pst/.*\.eml$')"
+  [ "$n_emails" -gt 0 ]
+  [ -z "$(json_parts '[0-9]+\.json' < dedup.mime | jq -r .filename | grep '^input.zip/b.pst/.*\.eml$')" ]
+
+  json_parts duplicate < dedup.mime > duplicates
+  n_a_duplicates="$(grep -c '"filename":"/a.pst/' duplicates || true)"
+  [ "$(grep -c '"filename":"/b.pst/' duplicates)" -eq $((n_emails + n_a_duplicates)) ]
+  [ "$(jq -r 'select(.filename | startswith("/b.pst/")) | .duplicateOf | startswith("/a.pst/")' duplicates | sort -u)" = true ]
+  [ "$(jq -r .duplicateOfInput duplicates | sort -u)" = input.zip ]
+}
+
+@test "hashes add each blob's contentHash" {
+  zip_fixture
+  convert "$PWD/pst.zip" '{"hashes":true}' input.zip hashes.mime
+
+  json_parts '[0-9]+\.json' < hashes.mime > parts
+  [ "$(wc -l < parts)" -gt 0 ]
+  [ "$(jq -r '.contentHash | test("^xxh64:[0-9a-f]{16}$")' parts | sort -u)" = true ]
+  [ "$(jq -r '.attachmentHashes | type' parts | sort -u)" = array ]
+  # The two PSTs are the same, so their blobs hash the same
+  jq -r 'select(.filename | startswith("input.zip/a.pst/")) | .contentHash' parts > a-hashes
+  jq -r 'select(.filename | startswith("input.zip/b.pst/")) | .contentHash' parts > b-hashes
+  diff -u a-hashes b-hashes
+}
+
+@test "an item over a limit becomes a warning" {
+  convert $FIXTURE/input.blob '{}' input.pst full.mime
+  convert $FIXTURE/input.blob '{"item_max_bytes":1}' input.pst limited.mime
+
+  [ "$(json_parts '[0-9]+\.json' < limited.mime | wc -l)" -eq 0 ]
+  json_parts warning < limited.mime > warnings
+  [ "$(jq -r .limit warnings | sort -u)" = bytes ]
+  json_parts '[0-9]+\.json' < full.mime | jq -r '.filename | sub("^input.pst"; "")' > expect-filenames
+  jq -r .filename warnings > filenames
+  diff -u expect-filenames filenames
+}
+
+@test "items skipped for size leave the others' filenames alone" {
+  convert $FIXTURE/input.blob '{}' input.pst full.mime
+  json_parts '[0-9]+\.json' < full.mime | jq -r '.filename | sub("^input.pst"; "")' > expect-filenames
+
+  for max_bytes in 512 2048 8192 32768; do
+    convert $FIXTURE/input.blob "{\"item_max_bytes\":$max_bytes}" input.pst limited-$max_bytes.mime
+    # Written items and warnings, in order, are the full run's items
+    json_parts '[0-9]+\.json|warning' < limited-$max_bytes.mime | jq -r '.filename | sub("^input.pst"; "")' > filenames
+    diff -u expect-filenames filenames
+  done
+}